@@ -44,15 +44,14 @@ struct _CitrixServerClass {
 struct _CitrixServer {
 	Server parent;
 
-	gchar * username;
+	const gchar * username;
 	gchar * password;
-	gchar * domain;
+	const gchar * domain;
 	gboolean domain_required;
 };
 
 GType citrix_server_get_type (void);
 Server * citrix_server_new_from_keyfile (GKeyFile * keyfile, const gchar * name);
-Server * citrix_server_new_from_json (JsonObject * object);
 
 G_END_DECLS
 
@@ -28,15 +28,24 @@
 
 #define CONFIG_MAIN_GROUP "Remote Logon Service"
 #define CONFIG_MAIN_SERVERS   "Servers"
+#define CONFIG_MAIN_STATE_DELAY "StateChangeDelay"
 #define CONFIG_SERVER_PREFIX  "Server"
 #define CONFIG_SERVER_NAME    "Name"
 #define CONFIG_SERVER_URI     "URI"
 
 #define CONFIG_UCCS_EXEC      "Exec"
+#define CONFIG_UCCS_PERSISTENT "PersistentAgent"
+#define CONFIG_UCCS_NATIVE    "NativeFetch"
 #define CONFIG_UCCS_NETWORK   "NetworkRequired"
 #define CONFIG_UCCS_NETWORK_NONE "None"
 #define CONFIG_UCCS_NETWORK_GLOBAL "Global"
 #define CONFIG_UCCS_VERIFY    "VerifyServer"
+#define CONFIG_UCCS_PROBE     "ProbeInterval"
+#define CONFIG_UCCS_PROBE_SERVERS "ProbeServers"
+#define CONFIG_UCCS_RANK      "RankServers"
+#define CONFIG_UCCS_RESOLVE   "ResolveServers"
+#define CONFIG_UCCS_REFRESH   "RefreshInterval"
+#define CONFIG_UCCS_TIMEOUT   "Timeout"
 
 #define CONFIG_SERVER_TYPE       "Type"
 #define CONFIG_SERVER_TYPE_RDP   "RDP"
@@ -24,16 +24,20 @@
 
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
 
 #include <gcrypt.h>
 
 /* NOTE: Required to build without optimizations */
 #include <locale.h>
 
+#include <signal.h>
+
 #include "remote-logon.h"
 #include "defines.h"
 
 #include "server.h"
+#include "server-notify.h"
 #include "rdp-server.h"
 #include "citrix-server.h"
 #include "uccs-server.h"
@@ -44,11 +48,44 @@ gint server_list_to_array (GVariantBuilder * builder, GList * items);
 
 enum {
 	ERROR_SERVER_URI,
-	ERROR_LOGIN
+	ERROR_LOGIN,
+	ERROR_TIMEOUT
 };
 
 GList * config_file_servers = NULL;
 
+/* The servers in config_file_servers by URI, and the UCCS ones on
+   their own as those are the ones that get logged into */
+static GHashTable * config_servers_by_uri = NULL;
+static GHashTable * config_uccs_by_uri = NULL;
+
+/* Memoized array of the available servers in config_file_servers, built
+   lazily by server_list_get() and dropped whenever one of them changes */
+static GVariant * server_list = NULL;
+
+/* What clients were last told about a server in the list, by URI */
+typedef struct _published_t published_t;
+struct _published_t {
+	GVariant * variant;
+	guint64 added;
+	guint64 changed;
+	guint64 seen;
+};
+
+/* The generation of the list from GetServers, bumped each time it
+   differs from what was published.  Removed servers are remembered for
+   a while so that GetServersSince can say so, asking about anything
+   before the horizon gets the whole list. */
+#define REMOVED_MAX 128
+static GHashTable * published = NULL;
+static GHashTable * removed = NULL;
+static guint64 generation = 0;
+static guint64 horizon = 0;
+
+/* State changes are broadcast once they've settled, after the
+   StateChangeDelay or on the next idle if there isn't one */
+static ServerNotify * state_notify = NULL;
+
 /* Get the error domain for this module */
 static GQuark
 error_domain (void)
@@ -60,31 +97,226 @@ error_domain (void)
 	return value;
 }
 
-/* When one of the state changes on the server emit that so that everone knows there
-   might be a new server available. */
+/* Get a reference to the array of available servers, only building it
+   if something changed since the last time we were asked */
+static GVariant *
+server_list_get (void)
+{
+	if (server_list == NULL) {
+		GVariantBuilder builder;
+		g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
+
+		if (server_list_to_array(&builder, config_file_servers) > 0) {
+			server_list = g_variant_builder_end(&builder);
+		} else {
+			g_variant_builder_clear(&builder);
+			server_list = g_variant_new_array(G_VARIANT_TYPE("(sssba(sbva{sv})a(si))"), NULL, 0);
+		}
+
+		g_variant_ref_sink(server_list);
+	}
+
+	return g_variant_ref(server_list);
+}
+
+/* One of the servers changed, so the array we have is stale */
 static void
-server_status_updated (Server RLS_UNUSED *server, ServerState newstate, RemoteLogon *rl)
+server_list_invalidate (Server RLS_UNUSED *server, gpointer RLS_UNUSED user_data)
 {
-	GVariant * array = NULL;
+	g_clear_pointer(&server_list, g_variant_unref);
+	return;
+}
 
-	GVariantBuilder builder;
-	g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
+static void
+published_free (gpointer data)
+{
+	published_t * pub = (published_t *)data;
+	g_variant_unref(pub->variant);
+	g_free(pub);
+	return;
+}
 
-	gint servers = server_list_to_array(&builder, config_file_servers);
-	if (servers > 0) {
-		array = g_variant_builder_end(&builder);
-	} else {
-		g_variant_builder_clear(&builder);
-		array = g_variant_new_array(G_VARIANT_TYPE("(sssba(sbva{sv})a(si))"), NULL, 0);
+/* Get the URI out of a server's tuple */
+static const gchar *
+server_variant_uri (GVariant * variant)
+{
+	const gchar * uri = NULL;
+	g_variant_get_child(variant, 2, "&s", &uri);
+	return uri;
+}
+
+/* Remember that the server went away, forgetting the oldest one if
+   there are too many */
+static void
+published_removed (const gchar * uri)
+{
+	if (g_hash_table_size(removed) >= REMOVED_MAX) {
+		GHashTableIter iter;
+		gpointer key, value;
+		gpointer oldest = NULL;
+		guint64 oldest_gen = G_MAXUINT64;
+
+		g_hash_table_iter_init(&iter, removed);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			if (*(guint64 *)value < oldest_gen) {
+				oldest = key;
+				oldest_gen = *(guint64 *)value;
+			}
+		}
+
+		horizon = oldest_gen;
+		g_hash_table_remove(removed, oldest);
 	}
 
-	g_debug ("%d server(s) available", servers);
-	g_debug ("Signalling state change to: %d", newstate);
+	guint64 * gen = g_new(guint64, 1);
+	*gen = generation;
+	g_hash_table_insert(removed, g_strdup(uri), gen);
+
+	return;
+}
+
+/* Compare the list with what was published, moving to a new generation
+   and telling everyone about the differences if there are any */
+static void
+published_sync (RemoteLogon * rl, GVariant * array)
+{
+	if (published == NULL) {
+		published = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, published_free);
+		removed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	}
+
+	guint64 next = generation + 1;
+	gboolean delta = FALSE;
+
+	GVariantBuilder added;
+	GVariantBuilder changed;
+	g_variant_builder_init(&added, G_VARIANT_TYPE("a(sssba(sbva{sv})a(si))"));
+	g_variant_builder_init(&changed, G_VARIANT_TYPE("a(sssba(sbva{sv})a(si))"));
+
+	GVariantIter iter;
+	GVariant * child;
+	g_variant_iter_init(&iter, array);
+	while ((child = g_variant_iter_next_value(&iter)) != NULL) {
+		const gchar * uri = server_variant_uri(child);
+		published_t * pub = g_hash_table_lookup(published, uri);
+
+		if (pub == NULL) {
+			pub = g_new0(published_t, 1);
+			pub->variant = g_variant_ref(child);
+			pub->added = next;
+			pub->changed = next;
+			g_hash_table_insert(published, g_strdup(uri), pub);
+			g_hash_table_remove(removed, uri);
+
+			g_variant_builder_add_value(&added, child);
+			delta = TRUE;
+		} else if (pub->seen != next && !g_variant_equal(pub->variant, child)) {
+			g_variant_unref(pub->variant);
+			pub->variant = g_variant_ref(child);
+			pub->changed = next;
+
+			g_variant_builder_add_value(&changed, child);
+			delta = TRUE;
+		}
+
+		/* The first server with a URI is the one we track */
+		pub->seen = next;
+		g_variant_unref(child);
+	}
+
+	/* Borrows the keys of those that are gone until they're removed */
+	GPtrArray * gone = g_ptr_array_new();
+	GHashTableIter hiter;
+	gpointer key, value;
+	g_hash_table_iter_init(&hiter, published);
+	while (g_hash_table_iter_next(&hiter, &key, &value)) {
+		published_t * pub = (published_t *)value;
+
+		if (pub->seen != next) {
+			g_ptr_array_add(gone, key);
+			delta = TRUE;
+		}
+	}
+	g_ptr_array_add(gone, NULL);
+
+	if (!delta) {
+		g_variant_builder_clear(&added);
+		g_variant_builder_clear(&changed);
+		g_ptr_array_free(gone, TRUE);
+		return;
+	}
+
+	generation = next;
+
+	remote_logon_emit_servers_changed(rl, generation,
+	                                  g_variant_builder_end(&added),
+	                                  g_variant_builder_end(&changed),
+	                                  (const gchar * const *)gone->pdata);
+
+	guint i;
+	for (i = 0; i < gone->len - 1; i++) {
+		published_removed(g_ptr_array_index(gone, i));
+		g_hash_table_remove(published, g_ptr_array_index(gone, i));
+	}
+	g_ptr_array_free(gone, TRUE);
+
+	return;
+}
+
+/* When the state of the servers changes emit that so that everone knows
+   there might be a new server available.  A burst of them, like all of
+   the servers reacting to the network going away, only gets one. */
+static void
+server_status_updated (gpointer user_data)
+{
+	RemoteLogon * rl = (RemoteLogon *)user_data;
+	GVariant * array = server_list_get();
+
+	g_debug ("%" G_GSIZE_FORMAT " server(s) available", g_variant_n_children(array));
 
 	remote_logon_emit_servers_updated(rl, array);
+	published_sync(rl, array);
+	g_variant_unref(array);
+
+	return;
+}
+
+/* Add a server to the URI indexes, the first one with a URI wins as
+   it would when going through the list */
+static void
+config_index_add (Server * server)
+{
+	if (config_servers_by_uri == NULL) {
+		config_servers_by_uri = g_hash_table_new(g_str_hash, g_str_equal);
+		config_uccs_by_uri = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	if (server->uri == NULL) {
+		return;
+	}
+
+	if (!g_hash_table_contains(config_servers_by_uri, server->uri)) {
+		g_hash_table_insert(config_servers_by_uri, (gpointer)server->uri, server);
+	}
+
+	if (IS_UCCS_SERVER(server) && !g_hash_table_contains(config_uccs_by_uri, server->uri)) {
+		g_hash_table_insert(config_uccs_by_uri, (gpointer)server->uri, server);
+	}
+
 	return;
 }
 
+/* Find the UCCS server in the config file with this URI */
+static UccsServer *
+config_find_uccs (const gchar * uri)
+{
+	if (config_uccs_by_uri == NULL || uri == NULL) {
+		return NULL;
+	}
+
+	return g_hash_table_lookup(config_uccs_by_uri, uri);
+}
+
 /* Looks for the config file and does some basic parsing to pull out the UCCS servers
    that are configured in it */
 static void
@@ -109,6 +341,13 @@ find_config_file (GKeyFile *parsed, const gchar *cmnd_line, RemoteLogon *rl)
 		return;
 	}
 
+	gint delay = 0;
+	if (g_key_file_has_key(parsed, CONFIG_MAIN_GROUP, CONFIG_MAIN_STATE_DELAY, NULL)) {
+		delay = g_key_file_get_integer(parsed, CONFIG_MAIN_GROUP, CONFIG_MAIN_STATE_DELAY, NULL);
+	}
+
+	state_notify = server_notify_new(MAX(delay, 0), server_status_updated, rl);
+
 	if (g_key_file_has_key(parsed, CONFIG_MAIN_GROUP, CONFIG_MAIN_SERVERS, NULL)) {
 		gchar ** grouplist = g_key_file_get_string_list(parsed, CONFIG_MAIN_GROUP, CONFIG_MAIN_SERVERS, NULL, NULL);
 		int i = 0;
@@ -125,7 +364,9 @@ find_config_file (GKeyFile *parsed, const gchar *cmnd_line, RemoteLogon *rl)
 			}
 
 			config_file_servers = g_list_append(config_file_servers, server);
-			g_signal_connect(server, SERVER_SIGNAL_STATE_CHANGED, G_CALLBACK(server_status_updated), rl);
+			config_index_add(server);
+			g_signal_connect(server, SERVER_SIGNAL_CHANGED, G_CALLBACK(server_list_invalidate), NULL);
+			server_notify_add(state_notify, server);
 		}
 
 		g_strfreev(grouplist);
@@ -133,7 +374,7 @@ find_config_file (GKeyFile *parsed, const gchar *cmnd_line, RemoteLogon *rl)
 
 	/* Signal the list of servers so that we're sure everyone's got them.  This is to
 	   solve a possible race where someone could ask while we're configuring these. */
-	server_status_updated(NULL, SERVER_STATE_ALLGOOD, rl);
+	server_status_updated(rl);
 	return;
 }
 
@@ -153,6 +394,7 @@ server_list_to_array (GVariantBuilder *builder, GList *items)
 		servercnt++;
 		GVariant * variant = server_get_variant(server);
 		g_variant_builder_add_value(builder, variant);
+		g_variant_unref(variant);
 	}
 
 	return servercnt;
@@ -161,21 +403,67 @@ server_list_to_array (GVariantBuilder *builder, GList *items)
 static gboolean
 handle_get_servers (RemoteLogon RLS_UNUSED *rl, GDBusMethodInvocation * invocation, gpointer RLS_UNUSED user_data)
 {
-	GVariant * array = NULL;
+	GVariant * array = server_list_get();
 
-	GVariantBuilder builder;
-	g_variant_builder_init(&builder, G_VARIANT_TYPE_ARRAY);
+	g_debug ("handle_get_servers: returning %" G_GSIZE_FORMAT " server(s)", g_variant_n_children(array));
 
-	if (server_list_to_array(&builder, config_file_servers) > 0) {
-		array = g_variant_builder_end(&builder);
-	} else {
-		g_variant_builder_clear(&builder);
-		array = g_variant_new_array(G_VARIANT_TYPE("(sssba(sbva{sv})a(si))"), NULL, 0);
+	g_dbus_method_invocation_return_value(invocation, g_variant_new_tuple(&array, 1));
+	g_variant_unref(array);
+
+	return TRUE;
+}
+
+/* Tell the client what changed since the generation it has, or give
+   it everything if we can't tell */
+static gboolean
+handle_get_servers_since (RemoteLogon * rl, GDBusMethodInvocation * invocation, guint64 since, gpointer RLS_UNUSED user_data)
+{
+	GVariant * array = server_list_get();
+	published_sync(rl, array);
+
+	gboolean complete = (since > generation || since < horizon);
+
+	GVariantBuilder added;
+	GVariantBuilder changed;
+	GVariantBuilder gone;
+	g_variant_builder_init(&added, G_VARIANT_TYPE("a(sssba(sbva{sv})a(si))"));
+	g_variant_builder_init(&changed, G_VARIANT_TYPE("a(sssba(sbva{sv})a(si))"));
+	g_variant_builder_init(&gone, G_VARIANT_TYPE_STRING_ARRAY);
+
+	GVariantIter iter;
+	GVariant * child;
+	g_variant_iter_init(&iter, array);
+	while ((child = g_variant_iter_next_value(&iter)) != NULL) {
+		published_t * pub = g_hash_table_lookup(published, server_variant_uri(child));
+
+		if (complete || pub->added > since) {
+			g_variant_builder_add_value(&added, child);
+		} else if (pub->changed > since) {
+			g_variant_builder_add_value(&changed, child);
+		}
+
+		g_variant_unref(child);
 	}
 
-	g_debug ("handle_get_servers: returning %s", g_variant_print (array, FALSE));
+	if (!complete) {
+		GHashTableIter hiter;
+		gpointer key, value;
+		g_hash_table_iter_init(&hiter, removed);
+		while (g_hash_table_iter_next(&hiter, &key, &value)) {
+			if (*(guint64 *)value > since) {
+				g_variant_builder_add(&gone, "s", key);
+			}
+		}
+	}
 
-	g_dbus_method_invocation_return_value(invocation, g_variant_new_tuple(&array, 1));
+	g_dbus_method_invocation_return_value(invocation,
+	                                      g_variant_new("(tb@a(sssba(sbva{sv})a(si))@a(sssba(sbva{sv})a(si))@as)",
+	                                                    generation,
+	                                                    complete,
+	                                                    g_variant_builder_end(&added),
+	                                                    g_variant_builder_end(&changed),
+	                                                    g_variant_builder_end(&gone)));
+	g_variant_unref(array);
 
 	return TRUE;
 }
@@ -183,19 +471,28 @@ handle_get_servers (RemoteLogon RLS_UNUSED *rl, GDBusMethodInvocation * invocati
 /* Handle the situation of whether we unlock or not and respond over
    DBus with either an error or the list of servers.  */
 static void
-handle_get_servers_login_cb (UccsServer * server, gboolean unlocked, gpointer user_data)
+handle_get_servers_login_cb (UccsServer * server, gboolean unlocked, gboolean cached, const GError * error, gpointer user_data)
 {
 	GDBusMethodInvocation * invocation = (GDBusMethodInvocation *)user_data;
 	const gchar * sender = g_dbus_method_invocation_get_sender(invocation);
 
+	/* Not the same as the wrong password, the greeter can try again */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+		g_dbus_method_invocation_return_error_literal(invocation,
+		                                              error_domain(),
+		                                              ERROR_TIMEOUT,
+		                                              error->message);
+		return;
+	}
+
 	GVariantBuilder builder;
 	g_variant_builder_init(&builder, G_VARIANT_TYPE_TUPLE);
 
 	/* Signal whether we're unlocked */
 	g_variant_builder_add_value(&builder, g_variant_new_boolean(unlocked));
 
-	/* Only network, no caching yet */
-	g_variant_builder_add_value(&builder, g_variant_new_string("network"));
+	/* Where the list came from */
+	g_variant_builder_add_value(&builder, g_variant_new_string(cached ? "cached" : "network"));
 
 	/* Get the array of servers */
 	GVariant * array = uccs_server_get_servers(server, sender);
@@ -219,25 +516,9 @@ handle_get_servers_login (RemoteLogon RLS_UNUSED *rl, GDBusMethodInvocation *inv
 	uri = g_variant_get_string(child, NULL);
 	g_variant_unref(child); /* fine as we know params is still ref'd */
 
-	GList * lserver = NULL;
-	Server * server = NULL;
-	for (lserver = config_file_servers; lserver != NULL; lserver = g_list_next(lserver)) {
-		server = SERVER(lserver->data);
-
-		if (server == NULL) {
-			continue;
-		}
-
-		if (!IS_UCCS_SERVER(server)) {
-			continue;
-		}
-
-		if (g_strcmp0(server->uri, uri) == 0) {
-			break;
-		}
-	}
+	UccsServer * server = config_find_uccs(uri);
 
-	if (lserver == NULL) {
+	if (server == NULL) {
 		/* Couldn't find something with that URI, we're done, thanks. */
 		g_dbus_method_invocation_return_error(invocation,
 		                                      error_domain(),
@@ -266,29 +547,236 @@ handle_get_servers_login (RemoteLogon RLS_UNUSED *rl, GDBusMethodInvocation *inv
  	g_variant_unref(child);
 
 	/* Try to login and mark us as servicing the message */
-	uccs_server_unlock(UCCS_SERVER(server), sender, username, password, allowcache, handle_get_servers_login_cb, invocation);
+	if (!uccs_server_unlock(server, sender, username, password, allowcache, handle_get_servers_login_cb, invocation)) {
+		handle_get_servers_login_cb(server, FALSE, FALSE, NULL, invocation);
+	}
+
 	return TRUE;
 }
 
-/* Look through a list of servers to see if one matches a URL */
-static Server *
-handle_get_domains_list_helper (GList *list, const gchar *uri)
+/* Unlocking all of the UCCS servers with the same credentials, the
+   answer goes out when they're all done or at the deadline */
+typedef struct _fanout_t fanout_t;
+typedef struct _fanout_broker_t fanout_broker_t;
+
+struct _fanout_broker_t {
+	fanout_t * fanout;
+	UccsServer * server;
+	gboolean done;
+	gboolean unlocked;
+	gboolean cached;
+	gboolean timedout;
+};
+
+struct _fanout_t {
+	GDBusMethodInvocation * invocation;
+	guint pending;
+	guint running;
+	guint timer;
+	guint n_brokers;
+	fanout_broker_t * brokers;
+};
+
+#define FANOUT_TIMEOUT_DEFAULT 30000
+
+/* Reply with what we've got, those that aren't done yet timed out */
+static void
+fanout_reply (fanout_t * fanout)
+{
+	const gchar * sender = g_dbus_method_invocation_get_sender(fanout->invocation);
+	guint i;
+
+	GVariantBuilder results;
+	GVariantBuilder servers;
+	g_variant_builder_init(&results, G_VARIANT_TYPE("a(sbs)"));
+	g_variant_builder_init(&servers, G_VARIANT_TYPE("a(sssba(sbva{sv})a(si))"));
+
+	for (i = 0; i < fanout->n_brokers; i++) {
+		fanout_broker_t * broker = &fanout->brokers[i];
+		const gchar * datatype = "timeout";
+
+		if (broker->done && !broker->timedout) {
+			datatype = broker->cached ? "cached" : "network";
+		}
+
+		g_variant_builder_add(&results, "(sbs)", SERVER(broker->server)->uri, broker->done && broker->unlocked, datatype);
+
+		if (!broker->done || !broker->unlocked) {
+			continue;
+		}
+
+		GVariant * array = g_variant_ref_sink(uccs_server_get_servers(broker->server, sender));
+		GVariantIter iter;
+		GVariant * child;
+
+		g_variant_iter_init(&iter, array);
+		while ((child = g_variant_iter_next_value(&iter)) != NULL) {
+			g_variant_builder_add_value(&servers, child);
+			g_variant_unref(child);
+		}
+
+		g_variant_unref(array);
+	}
+
+	g_dbus_method_invocation_return_value(fanout->invocation,
+	                                      g_variant_new("(@a(sbs)@a(sssba(sbva{sv})a(si)))",
+	                                                    g_variant_builder_end(&results),
+	                                                    g_variant_builder_end(&servers)));
+	g_clear_object(&fanout->invocation);
+
+	return;
+}
+
+/* One less to wait for, answering when it was the last one and freeing
+   when nobody is going to call back anymore */
+static void
+fanout_unref (fanout_t * fanout)
+{
+	fanout->pending--;
+
+	if (fanout->pending == 0) {
+		if (fanout->invocation != NULL) {
+			fanout_reply(fanout);
+		}
+
+		guint i;
+		for (i = 0; i < fanout->n_brokers; i++) {
+			g_object_unref(fanout->brokers[i].server);
+		}
+		g_free(fanout->brokers);
+		g_free(fanout);
+	}
+
+	return;
+}
+
+/* A broker answered, if we've already replied it still unlocked the
+   sender which then gets its servers through LoginServersUpdated */
+static void
+fanout_broker_cb (UccsServer RLS_UNUSED * server, gboolean unlocked, gboolean cached, const GError * error, gpointer user_data)
+{
+	fanout_broker_t * broker = (fanout_broker_t *)user_data;
+
+	broker->done = TRUE;
+	broker->unlocked = unlocked;
+	broker->cached = cached;
+	broker->timedout = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT);
+
+	fanout_t * fanout = broker->fanout;
+	fanout->running--;
+
+	/* All in before the deadline, it won't need its reference */
+	if (fanout->running == 0 && fanout->timer != 0) {
+		g_source_remove(fanout->timer);
+		fanout->timer = 0;
+		fanout_unref(fanout);
+	}
+
+	fanout_unref(fanout);
+	return;
+}
+
+/* Out of time, answer with the brokers that made it */
+static gboolean
+fanout_timeout_cb (gpointer user_data)
+{
+	fanout_t * fanout = (fanout_t *)user_data;
+
+	fanout->timer = 0;
+	fanout_reply(fanout);
+	fanout_unref(fanout);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Handle the GetServersForLoginAll DBus call */
+static gboolean
+handle_get_servers_login_all (RemoteLogon RLS_UNUSED *rl, GDBusMethodInvocation *invocation, const gchar * username, const gchar * password, gboolean allowcache, guint timeout, gpointer RLS_UNUSED user_data)
 {
-	if (list == NULL) return NULL;
+	const gchar * sender = g_dbus_method_invocation_get_sender(invocation);
+	fanout_t * fanout = g_new0(fanout_t, 1);
+	GList * lserver;
+
+	fanout->invocation = g_object_ref(invocation);
+	fanout->brokers = g_new0(fanout_broker_t, g_list_length(config_file_servers));
+
+	for (lserver = config_file_servers; lserver != NULL; lserver = g_list_next(lserver)) {
+		Server * server = SERVER(lserver->data);
 
-	Server * inserver = SERVER(list->data);
+		if (!IS_UCCS_SERVER(server) || server->state != SERVER_STATE_ALLGOOD) {
+			continue;
+		}
+
+		fanout_broker_t * broker = &fanout->brokers[fanout->n_brokers++];
+		broker->fanout = fanout;
+		broker->server = UCCS_SERVER(g_object_ref(server));
+	}
+
+	/* One for us, so that answers that come right away don't free it
+	   under us, one for each broker that is going to call back and one
+	   for the deadline */
+	fanout->pending = 1;
+
+	guint i;
+	for (i = 0; i < fanout->n_brokers; i++) {
+		fanout_broker_t * broker = &fanout->brokers[i];
+
+		fanout->pending++;
+		fanout->running++;
+
+		if (!uccs_server_unlock(broker->server, sender, username, password, allowcache, fanout_broker_cb, broker)) {
+			/* Not started, it won't call back */
+			broker->done = TRUE;
+			fanout->running--;
+			fanout->pending--;
+		}
+	}
+
+	if (fanout->running > 0) {
+		fanout->pending++;
+		fanout->timer = g_timeout_add(timeout != 0 ? timeout : FANOUT_TIMEOUT_DEFAULT, fanout_timeout_cb, fanout);
+	}
+
+	fanout_unref(fanout);
+	return TRUE;
+}
 
-	if (inserver == NULL) {
-		return handle_get_domains_list_helper(g_list_next(list), uri);
+/* Find the server with the URI, either in the config file or one that
+   a UCCS server got us.  Walk the config file in order so the first
+   server that knows the URI wins, no matter how the hash is laid out. */
+static Server *
+handle_get_domains_find (const gchar *uri)
+{
+	if (config_servers_by_uri == NULL) {
+		return NULL;
 	}
 
-	Server * outserver = server_find_uri(inserver, uri);
+	Server * direct = g_hash_table_lookup(config_servers_by_uri, uri);
+
+	GList * lserver = NULL;
+	for (lserver = config_file_servers; lserver != NULL; lserver = g_list_next(lserver)) {
+		Server * inserver = SERVER(lserver->data);
+
+		if (inserver == NULL) {
+			continue;
+		}
+
+		if (inserver == direct) {
+			return direct;
+		}
+
+		if (!IS_UCCS_SERVER(inserver)) {
+			continue;
+		}
+
+		Server * outserver = server_find_uri(inserver, uri);
 
-	if (outserver != NULL) {
-		return outserver;
+		if (outserver != NULL) {
+			return outserver;
+		}
 	}
 
-	return handle_get_domains_list_helper(g_list_next(list), uri);
+	return NULL;
 }
 
 /* Get the cached domains for a server */
@@ -304,7 +792,7 @@ handle_get_domains (RemoteLogon RLS_UNUSED *rl, GDBusMethodInvocation *invocatio
 	uri = g_variant_get_string(child, NULL);
 	g_variant_unref(child); /* fine as we know params is still ref'd */
 
-	Server * server = handle_get_domains_list_helper(config_file_servers, uri);
+	Server * server = handle_get_domains_find(uri);
 
 	GVariant * domains = NULL;
 	if (server != NULL) {
@@ -347,26 +835,10 @@ handle_set_last_used_server (RemoteLogon RLS_UNUSED * rl, GDBusMethodInvocation
 	serverUri = g_variant_get_string(child, NULL);
 	g_variant_unref(child); /* fine as we know params is still ref'd */
 
-	GList * lserver = NULL;
-	Server * server = NULL;
-	for (lserver = config_file_servers; lserver != NULL; lserver = g_list_next(lserver)) {
-		server = SERVER(lserver->data);
-
-		if (server == NULL) {
-			continue;
-		}
-
-		if (!IS_UCCS_SERVER(server)) {
-			continue;
-		}
-
-		if (g_strcmp0(server->uri, uccsUri) == 0) {
-			break;
-		}
-	}
+	UccsServer * server = config_find_uccs(uccsUri);
 
 	if (server != NULL) {
-		server_set_last_used_server (server, serverUri);
+		uccs_server_set_last_used_server (server, g_dbus_method_invocation_get_sender(invocation), serverUri);
 	}
 
 	g_dbus_method_invocation_return_value(invocation, NULL);
@@ -386,6 +858,17 @@ name_lost (GDBusConnection RLS_UNUSED * connection, const gchar * name, gpointer
 	return;
 }
 
+/* Asked to go away, leave the loop so that we can clean up */
+static gboolean
+sigterm_cb (gpointer user_data)
+{
+	GMainLoop * mainloop = (GMainLoop *)user_data;
+
+	g_main_loop_quit(mainloop);
+
+	return G_SOURCE_REMOVE;
+}
+
 static gchar * cmnd_line_config = NULL;
 
 static GOptionEntry general_options[] = {
@@ -403,6 +886,10 @@ main (int argc, char * argv[])
 	g_type_init();
 #endif
 
+	/* Persistent UCCS agents are talked to over pipes, if one goes away
+	   while we're writing to it we want an error, not to die with it */
+	signal(SIGPIPE, SIG_IGN);
+
 	/* Setup i18n */
 	setlocale (LC_ALL, "");
 	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
@@ -442,6 +929,8 @@ main (int argc, char * argv[])
 	g_signal_connect(skel, "handle-get-servers-for-login", G_CALLBACK(handle_get_servers_login), NULL);
 	g_signal_connect(skel, "handle-get-cached-domains-for-server", G_CALLBACK(handle_get_domains), NULL);
 	g_signal_connect(skel, "handle-set-last-used-server", G_CALLBACK(handle_set_last_used_server), NULL);
+	g_signal_connect(skel, "handle-get-servers-since", G_CALLBACK(handle_get_servers_since), NULL);
+	g_signal_connect(skel, "handle-get-servers-for-login-all", G_CALLBACK(handle_get_servers_login_all), NULL);
 
 	g_bus_own_name_on_connection(session_bus,
 	                             "org.ArcticaProject.RemoteLogon",
@@ -460,9 +949,21 @@ main (int argc, char * argv[])
 	gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
 	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
 
+	g_unix_signal_add(SIGTERM, sigterm_cb, mainloop);
+
 	/* Loop forever */
 	g_main_loop_run(mainloop);
 
+	/* Make sure the last used servers made it to disk */
+	GList * lserver;
+	for (lserver = config_file_servers; lserver != NULL; lserver = g_list_next(lserver)) {
+		if (IS_UCCS_SERVER(lserver->data)) {
+			uccs_server_flush(UCCS_SERVER(lserver->data));
+		}
+	}
+
+	server_notify_free(state_notify);
+
 	g_main_loop_unref(mainloop);
 	g_object_unref(config);
 
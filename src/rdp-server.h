@@ -44,15 +44,14 @@ struct _RdpServerClass {
 struct _RdpServer {
 	Server parent;
 
-	gchar * username;
+	const gchar * username;
 	gchar * password;
-	gchar * domain;
+	const gchar * domain;
 	gboolean domain_required;
 };
 
 GType rdp_server_get_type (void);
 Server * rdp_server_new_from_keyfile (GKeyFile * keyfile, const gchar * name);
-Server * rdp_server_new_from_json (JsonObject * object);
 
 G_END_DECLS
 
@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+
+#include "defines.h"
+#include "server-notify.h"
+
+/* Servers tend to change state together, like all of them reacting to
+   the network going away.  Rather than telling about each of them the
+   changes are gathered up and the callback is called once they've
+   settled: after a delay in milliseconds, or on the next idle if it is
+   zero. */
+
+struct _ServerNotify {
+	guint delay;
+	guint timer;
+	GPtrArray * servers;
+
+	ServerNotifyCallback callback;
+	gpointer userdata;
+};
+
+/* The changes have settled */
+static gboolean
+notify_flush (gpointer user_data)
+{
+	ServerNotify * notify = (ServerNotify *)user_data;
+
+	notify->timer = 0;
+	notify->callback(notify->userdata);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* A server changed state, arm the timer if it isn't already */
+static void
+state_changed (Server RLS_UNUSED * server, ServerState newstate, ServerNotify * notify)
+{
+	g_debug("Signalling state change to: %d", newstate);
+
+	if (notify->timer != 0) {
+		return;
+	}
+
+	if (notify->delay == 0) {
+		notify->timer = g_idle_add(notify_flush, notify);
+	} else {
+		notify->timer = g_timeout_add(notify->delay, notify_flush, notify);
+	}
+
+	return;
+}
+
+/**
+ * server_notify_new:
+ * @delay: Milliseconds to gather state changes for, zero for the next idle
+ * @callback: Called once the changes have settled
+ * @user_data: Data for @callback
+ *
+ * Creates a batch that @callback is called for once per burst of state
+ * changes of the servers added to it.
+ */
+ServerNotify *
+server_notify_new (guint delay, ServerNotifyCallback callback, gpointer user_data)
+{
+	g_return_val_if_fail(callback != NULL, NULL);
+
+	ServerNotify * notify = g_new0(ServerNotify, 1);
+
+	notify->delay = delay;
+	notify->servers = g_ptr_array_new_with_free_func(g_object_unref);
+	notify->callback = callback;
+	notify->userdata = user_data;
+
+	return notify;
+}
+
+/**
+ * server_notify_add:
+ * @notify: Batch to add to
+ * @server: Server to watch the state of
+ *
+ * Has the state changes of @server go through @notify.
+ */
+void
+server_notify_add (ServerNotify * notify, Server * server)
+{
+	g_return_if_fail(notify != NULL);
+	g_return_if_fail(IS_SERVER(server));
+
+	g_ptr_array_add(notify->servers, g_object_ref(server));
+	g_signal_connect(server, SERVER_SIGNAL_STATE_CHANGED, G_CALLBACK(state_changed), notify);
+
+	return;
+}
+
+/**
+ * server_notify_free:
+ * @notify: Batch to free
+ *
+ * Stops watching the servers, changes that haven't settled yet are
+ * dropped.
+ */
+void
+server_notify_free (ServerNotify * notify)
+{
+	if (notify == NULL) {
+		return;
+	}
+
+	guint i;
+	for (i = 0; i < notify->servers->len; i++) {
+		g_signal_handlers_disconnect_by_data(g_ptr_array_index(notify->servers, i), notify);
+	}
+	g_ptr_array_free(notify->servers, TRUE);
+
+	if (notify->timer != 0) {
+		g_source_remove(notify->timer);
+	}
+
+	g_free(notify);
+
+	return;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __SERVER_NOTIFY_H__
+#define __SERVER_NOTIFY_H__
+
+#include <glib.h>
+#include "server.h"
+
+G_BEGIN_DECLS
+
+typedef struct _ServerNotify ServerNotify;
+
+/* One or more of the servers changed state since the last call */
+typedef void (*ServerNotifyCallback) (gpointer user_data);
+
+ServerNotify * server_notify_new (guint delay, ServerNotifyCallback callback, gpointer user_data);
+void server_notify_add (ServerNotify * notify, Server * server);
+void server_notify_free (ServerNotify * notify);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include <string.h>
+
+#include "defines.h"
+#include "server-probe.h"
+
+/* A server is reachable if a TCP connection can be made to one of the
+   ports its class lists, tried in order.  Only the connection is made,
+   nothing is sent over it.  The host is looked up first, through a
+   cache that all of the probers share. */
+
+/* GResolver doesn't tell how long the answer it got may be kept, so
+   the addresses are kept for this many seconds no matter what */
+#define RESOLVE_CACHE_LIFETIME 60
+
+typedef struct _resolved_t resolved_t;
+struct _resolved_t {
+	GList * addresses;
+	gint64 expires;
+};
+
+typedef struct _probe_t probe_t;
+struct _probe_t {
+	ServerProbe * probe;
+	GCancellable * cancel;
+	Server * server;
+	gchar * host;
+	guint16 uri_port;
+	GList * addresses;
+	GList * address;
+	guint port;
+	gint64 start;
+};
+
+struct _ServerProbe {
+	ServerProbeFlags flags;
+	GResolver * resolver;
+	GSocketClient * client;
+	GCancellable * cancel;
+
+	guint max_running;
+	guint running;
+	GQueue pending;
+	gboolean changed;
+	gboolean starting;
+
+	ServerProbeCallback callback;
+	gpointer userdata;
+};
+
+/* Host name to resolved_t */
+static GHashTable * resolved = NULL;
+
+static void probe_next (ServerProbe * probe);
+
+static void
+resolved_free (gpointer data)
+{
+	resolved_t * entry = (resolved_t *)data;
+
+	g_resolver_free_addresses(entry->addresses);
+	g_free(entry);
+
+	return;
+}
+
+static gboolean
+resolved_expired (gpointer RLS_UNUSED key, gpointer value, gpointer user_data)
+{
+	return ((resolved_t *)value)->expires <= *(gint64 *)user_data;
+}
+
+/* Addresses @host was resolved to lately, in a new list, or NULL if
+   it has to be looked up again */
+static GList *
+resolve_cache_lookup (const gchar * host)
+{
+	if (resolved == NULL) {
+		return NULL;
+	}
+
+	resolved_t * entry = g_hash_table_lookup(resolved, host);
+	if (entry == NULL) {
+		return NULL;
+	}
+
+	if (entry->expires <= g_get_monotonic_time()) {
+		g_hash_table_remove(resolved, host);
+		return NULL;
+	}
+
+	return g_list_copy_deep(entry->addresses, (GCopyFunc)g_object_ref, NULL);
+}
+
+/* Remember what @host resolved to, dropping whatever went stale */
+static void
+resolve_cache_store (const gchar * host, GList * addresses)
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (resolved == NULL) {
+		resolved = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, resolved_free);
+	}
+
+	g_hash_table_foreach_remove(resolved, resolved_expired, &now);
+
+	resolved_t * entry = g_new0(resolved_t, 1);
+	entry->addresses = g_list_copy_deep(addresses, (GCopyFunc)g_object_ref, NULL);
+	entry->expires = now + RESOLVE_CACHE_LIFETIME * G_USEC_PER_SEC;
+
+	g_hash_table_replace(resolved, g_strdup(host), entry);
+
+	return;
+}
+
+/**
+ * server_probe_new:
+ * @flags: What to find out about the servers
+ * @max_running: How many servers get probed at the same time
+ * @timeout: Seconds a connection gets to be made
+ * @callback: Called each time the servers given to
+ *   server_probe_start() are all done
+ * @user_data: Data for the callback
+ *
+ * Return value: A new prober, free with server_probe_free()
+ */
+ServerProbe *
+server_probe_new (ServerProbeFlags flags, guint max_running, guint timeout, ServerProbeCallback callback, gpointer user_data)
+{
+	ServerProbe * probe = g_new0(ServerProbe, 1);
+
+	probe->flags = flags;
+	probe->resolver = g_resolver_get_default();
+
+	probe->client = g_socket_client_new();
+	g_socket_client_set_timeout(probe->client, timeout);
+	/* Reaching the proxy says nothing about the server */
+	g_socket_client_set_enable_proxy(probe->client, FALSE);
+
+	probe->cancel = g_cancellable_new();
+	probe->max_running = MAX(max_running, 1);
+	probe->running = 0;
+	g_queue_init(&probe->pending);
+	probe->changed = FALSE;
+	probe->starting = FALSE;
+
+	probe->callback = callback;
+	probe->userdata = user_data;
+
+	return probe;
+}
+
+/* Drop what's still queued and stop what's running, the callbacks of
+   those find their cancellable cancelled and leave @probe alone */
+static void
+probe_cancel (ServerProbe * probe)
+{
+	g_cancellable_cancel(probe->cancel);
+	g_object_unref(probe->cancel);
+	probe->cancel = g_cancellable_new();
+
+	g_queue_free_full(&probe->pending, g_object_unref);
+	g_queue_init(&probe->pending);
+	probe->running = 0;
+	probe->changed = FALSE;
+
+	return;
+}
+
+static void
+probe_free (probe_t * p)
+{
+	g_resolver_free_addresses(p->addresses);
+	g_free(p->host);
+	g_object_unref(p->cancel);
+	g_object_unref(p->server);
+	g_free(p);
+
+	return;
+}
+
+/* Done with @p, record what we found if there's anything */
+static void
+probe_done (probe_t * p, gboolean found, gboolean reachable, gint latency)
+{
+	ServerProbe * probe = p->probe;
+	Server * server = p->server;
+
+	if (found) {
+		if (server_set_state(server, reachable ? SERVER_STATE_ALLGOOD : SERVER_STATE_UNAVAILABLE)) {
+			g_signal_emit_by_name(server, SERVER_SIGNAL_STATE_CHANGED, server->state);
+			probe->changed = TRUE;
+		}
+
+		if (server_set_latency(server, latency)) {
+			probe->changed = TRUE;
+		}
+	}
+
+	probe_free(p);
+
+	probe->running--;
+	probe_next(probe);
+
+	return;
+}
+
+/* Whether we're going to connect to the server at all */
+static gboolean
+probe_connects (probe_t * p)
+{
+	return (p->probe->flags & SERVER_PROBE_CONNECT) && SERVER_GET_CLASS(p->server)->probe_ports != NULL;
+}
+
+/* The port in the URI wins over those of the class */
+static guint16
+probe_port (probe_t * p)
+{
+	if (p->uri_port != 0) {
+		return p->uri_port;
+	}
+
+	return SERVER_GET_CLASS(p->server)->probe_ports[p->port];
+}
+
+static void probe_connect (probe_t * p);
+
+/* Got through or not */
+static void
+probe_connect_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	probe_t * p = (probe_t *)user_data;
+	GError * error = NULL;
+	GSocketConnection * connection = g_socket_client_connect_finish(G_SOCKET_CLIENT(src_obj), res, &error);
+
+	/* Another batch replaced this one, or the prober is gone */
+	if (g_cancellable_is_cancelled(p->cancel)) {
+		g_clear_error(&error);
+		g_clear_object(&connection);
+		probe_free(p);
+		return;
+	}
+
+	if (error != NULL) {
+		g_debug("Unable to reach '%s' on port %d: %s", p->server->uri, probe_port(p), error->message);
+		g_error_free(error);
+
+		/* Every address on this port, then the next port */
+		if (p->address->next != NULL) {
+			p->address = p->address->next;
+			probe_connect(p);
+			return;
+		}
+
+		if (p->uri_port == 0 && SERVER_GET_CLASS(p->server)->probe_ports[p->port + 1] != 0) {
+			p->port++;
+			p->address = p->addresses;
+			probe_connect(p);
+			return;
+		}
+
+		probe_done(p, TRUE, FALSE, -1);
+		return;
+	}
+
+	gint latency = (g_get_monotonic_time() - p->start) / 1000;
+
+	g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+	g_object_unref(connection);
+
+	probe_done(p, TRUE, TRUE, latency);
+
+	return;
+}
+
+/* Try to connect to the current address and port of the server */
+static void
+probe_connect (probe_t * p)
+{
+	GSocketAddress * address = g_inet_socket_address_new(G_INET_ADDRESS(p->address->data), probe_port(p));
+
+	p->start = g_get_monotonic_time();
+	g_socket_client_connect_async(p->probe->client, G_SOCKET_CONNECTABLE(address), p->cancel, probe_connect_cb, p);
+	g_object_unref(address);
+
+	return;
+}
+
+/* We know where the server is, pass that on and connect to it */
+static void
+probe_resolved (probe_t * p)
+{
+	ServerProbe * probe = p->probe;
+
+	if (probe->flags & SERVER_PROBE_RESOLVE) {
+		gchar ** strv = g_new0(gchar *, g_list_length(p->addresses) + 1);
+		GList * item;
+		guint i = 0;
+
+		for (item = p->addresses; item != NULL; item = g_list_next(item)) {
+			strv[i++] = g_inet_address_to_string(G_INET_ADDRESS(item->data));
+		}
+
+		if (server_set_addresses(p->server, (const gchar * const *)strv)) {
+			probe->changed = TRUE;
+		}
+
+		g_strfreev(strv);
+	}
+
+	if (!probe_connects(p)) {
+		probe_done(p, FALSE, FALSE, -1);
+		return;
+	}
+
+	p->port = 0;
+	p->address = p->addresses;
+	probe_connect(p);
+
+	return;
+}
+
+/* The host got looked up */
+static void
+probe_resolve_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	probe_t * p = (probe_t *)user_data;
+	GError * error = NULL;
+	GList * addresses = g_resolver_lookup_by_name_finish(G_RESOLVER(src_obj), res, &error);
+
+	if (g_cancellable_is_cancelled(p->cancel)) {
+		g_clear_error(&error);
+		g_resolver_free_addresses(addresses);
+		probe_free(p);
+		return;
+	}
+
+	/* A host that doesn't resolve can't be reached either */
+	if (error != NULL) {
+		g_debug("Unable to resolve '%s': %s", p->host, error->message);
+		g_error_free(error);
+
+		if ((p->probe->flags & SERVER_PROBE_RESOLVE) && server_set_addresses(p->server, NULL)) {
+			p->probe->changed = TRUE;
+		}
+
+		probe_done(p, probe_connects(p), FALSE, -1);
+		return;
+	}
+
+	resolve_cache_store(p->host, addresses);
+	p->addresses = addresses;
+	probe_resolved(p);
+
+	return;
+}
+
+/* Find out where the server is, from the cache if we can */
+static void
+probe_start (probe_t * p)
+{
+	const gchar * uri = p->server->uri;
+	GSocketConnectable * address = NULL;
+	GError * error = NULL;
+
+	if (strstr(uri, "://") != NULL) {
+		address = g_network_address_parse_uri(uri, 0, &error);
+	} else {
+		address = g_network_address_parse(uri, 0, &error);
+	}
+
+	/* Not something we can connect to, so no telling */
+	if (error != NULL) {
+		g_debug("Unable to probe '%s': %s", uri, error->message);
+		g_error_free(error);
+		probe_done(p, FALSE, FALSE, -1);
+		return;
+	}
+
+	p->host = g_strdup(g_network_address_get_hostname(G_NETWORK_ADDRESS(address)));
+	p->uri_port = g_network_address_get_port(G_NETWORK_ADDRESS(address));
+	g_object_unref(address);
+
+	if (g_hostname_is_ip_address(p->host)) {
+		GInetAddress * inet = g_inet_address_new_from_string(p->host);
+
+		if (inet == NULL) {
+			probe_done(p, FALSE, FALSE, -1);
+			return;
+		}
+
+		p->addresses = g_list_append(NULL, inet);
+		probe_resolved(p);
+		return;
+	}
+
+	p->addresses = resolve_cache_lookup(p->host);
+	if (p->addresses != NULL) {
+		probe_resolved(p);
+		return;
+	}
+
+	g_resolver_lookup_by_name_async(p->probe->resolver, p->host, p->cancel, probe_resolve_cb, p);
+
+	return;
+}
+
+/* Start on queued servers while there's room, and tell once they're
+   all done.  Probes that finish right away end up back here, they
+   leave it to the loop that started them so that the stack doesn't
+   grow with the number of servers. */
+static void
+probe_next (ServerProbe * probe)
+{
+	if (probe->starting) {
+		return;
+	}
+
+	probe->starting = TRUE;
+
+	while (probe->running < probe->max_running && !g_queue_is_empty(&probe->pending)) {
+		probe_t * p = g_new0(probe_t, 1);
+
+		p->probe = probe;
+		p->cancel = g_object_ref(probe->cancel);
+		p->server = SERVER(g_queue_pop_head(&probe->pending));
+		p->port = 0;
+
+		probe->running++;
+		probe_start(p);
+	}
+
+	probe->starting = FALSE;
+
+	if (probe->running == 0 && g_queue_is_empty(&probe->pending) && probe->callback != NULL) {
+		gboolean changed = probe->changed;
+		probe->changed = FALSE;
+		probe->callback(changed, probe->userdata);
+	}
+
+	return;
+}
+
+/**
+ * server_probe_start:
+ * @probe: Prober to use
+ * @servers: (element-type Server) Servers to probe
+ *
+ * Probes the servers, setting the addresses their host resolved to
+ * with %SERVER_PROBE_RESOLVE and, with %SERVER_PROBE_CONNECT, the
+ * state and latency of those whose class has ports to try, as the
+ * answers come in.  Probes from an earlier call that are still going
+ * are dropped.
+ */
+void
+server_probe_start (ServerProbe * probe, GPtrArray * servers)
+{
+	g_return_if_fail(probe != NULL);
+	g_return_if_fail(servers != NULL);
+
+	probe_cancel(probe);
+
+	guint i;
+	for (i = 0; i < servers->len; i++) {
+		Server * server = SERVER(g_ptr_array_index(servers, i));
+
+		if (server->uri == NULL) {
+			continue;
+		}
+
+		if (!(probe->flags & SERVER_PROBE_RESOLVE) && SERVER_GET_CLASS(server)->probe_ports == NULL) {
+			continue;
+		}
+
+		g_queue_push_tail(&probe->pending, g_object_ref(server));
+	}
+
+	/* Nothing to probe, nothing to tell */
+	if (g_queue_is_empty(&probe->pending)) {
+		return;
+	}
+
+	probe_next(probe);
+
+	return;
+}
+
+/**
+ * server_probe_forget:
+ *
+ * Drops the cached addresses of all hosts, the next probes look them
+ * up again.
+ */
+void
+server_probe_forget (void)
+{
+	g_clear_pointer(&resolved, g_hash_table_unref);
+
+	return;
+}
+
+/**
+ * server_probe_free:
+ * @probe: Prober to free
+ *
+ * Stops all of the probes, the callback isn't called anymore.
+ */
+void
+server_probe_free (ServerProbe * probe)
+{
+	if (probe == NULL) {
+		return;
+	}
+
+	probe_cancel(probe);
+
+	g_object_unref(probe->cancel);
+	g_object_unref(probe->client);
+	g_object_unref(probe->resolver);
+	g_free(probe);
+
+	return;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __SERVER_PROBE_H__
+#define __SERVER_PROBE_H__
+
+#include <glib.h>
+#include "server.h"
+
+G_BEGIN_DECLS
+
+typedef struct _ServerProbe ServerProbe;
+typedef enum   _ServerProbeFlags ServerProbeFlags;
+
+/* Look the host up and pass on its addresses, connect to the ports of
+   the server's class */
+enum _ServerProbeFlags {
+	SERVER_PROBE_RESOLVE = 1 << 0,
+	SERVER_PROBE_CONNECT = 1 << 1
+};
+
+/* All of the servers given to server_probe_start() have been probed,
+   @changed is whether any of them changed state, latency or addresses */
+typedef void (*ServerProbeCallback) (gboolean changed, gpointer user_data);
+
+ServerProbe * server_probe_new (ServerProbeFlags flags, guint max_running, guint timeout, ServerProbeCallback callback, gpointer user_data);
+void server_probe_start (ServerProbe * probe, GPtrArray * servers);
+void server_probe_forget (void);
+void server_probe_free (ServerProbe * probe);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,744 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/mman.h>
+#include <string.h>
+
+#include "defines.h"
+#include "server-table.h"
+
+/* Each server of the list is a record in one array, with its strings in
+   an arena shared by the whole list.  Brokers send hundreds of servers
+   of which the greeter only ever shows a handful, so a Server object is
+   only made when one is asked for.  It keeps the arena alive for as
+   long as it's around. */
+
+typedef struct _arena_t arena_t;
+struct _arena_t {
+	gint ref_count;
+	GStringChunk * strings;
+};
+
+/* The value of a class field, in the order of klass->fields */
+typedef union _value_t value_t;
+union _value_t {
+	const gchar * string;
+	gchar * secret;
+	gboolean boolean;
+};
+
+typedef struct _record_t record_t;
+struct _record_t {
+	ServerClass * klass;
+	const gchar * name;
+	const gchar * uri;
+	gboolean last_used;
+	value_t values[SERVER_MAX_FIELDS];
+
+	/* Memoized variant while there's no server object */
+	GVariant * variant;
+	Server * server;
+};
+
+struct _ServerTable {
+	GArray * records;
+	/* URI to index + 1, the first server with a URI wins */
+	GHashTable * index;
+	arena_t * arena;
+};
+
+#define RECORD(table, i) (&g_array_index((table)->records, record_t, (i)))
+
+static arena_t *
+arena_new (void)
+{
+	arena_t * arena = g_new0(arena_t, 1);
+
+	arena->ref_count = 1;
+	arena->strings = g_string_chunk_new(4096);
+
+	return arena;
+}
+
+static gpointer
+arena_ref (arena_t * arena)
+{
+	g_atomic_int_inc(&arena->ref_count);
+	return arena;
+}
+
+static void
+arena_unref (gpointer data)
+{
+	arena_t * arena = data;
+
+	if (g_atomic_int_dec_and_test(&arena->ref_count)) {
+		g_string_chunk_free(arena->strings);
+		g_free(arena);
+	}
+
+	return;
+}
+
+static GQuark
+arena_quark (void)
+{
+	static GQuark quark = 0;
+
+	if (quark == 0) {
+		quark = g_quark_from_static_string("server-table-arena");
+	}
+
+	return quark;
+}
+
+static gchar *
+secret_dup (const gchar * secret)
+{
+	gchar * copy = g_strdup(secret);
+
+	if (copy != NULL) {
+		mlock(copy, strlen(copy));
+	}
+
+	return copy;
+}
+
+static void
+secret_free (gchar * secret)
+{
+	if (secret == NULL) {
+		return;
+	}
+
+	gsize length = strlen(secret);
+	memset(secret, 0, length);
+	munlock(secret, length);
+	g_free(secret);
+
+	return;
+}
+
+/* Classes are only peeked at by the objects, so take a reference the
+   first time a protocol shows up and keep it */
+static ServerClass *
+record_class (GType type)
+{
+	gpointer klass = g_type_class_peek(type);
+
+	if (klass == NULL) {
+		klass = g_type_class_ref(type);
+	}
+
+	return SERVER_CLASS(klass);
+}
+
+/* Where the value of @field is kept in a record, -1 for the fields of
+   the base class */
+static gint
+field_position (ServerClass * klass, const ServerField * field)
+{
+	guint i;
+
+	for (i = 0; i < klass->n_fields; i++) {
+		if (&klass->fields[i] == field) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void
+record_clear (record_t * record)
+{
+	guint i;
+
+	for (i = 0; i < record->klass->n_fields; i++) {
+		if (record->klass->fields[i].type == SERVER_FIELD_SECRET) {
+			secret_free(record->values[i].secret);
+			record->values[i].secret = NULL;
+		}
+	}
+
+	g_clear_pointer(&record->variant, g_variant_unref);
+	g_clear_object(&record->server);
+
+	return;
+}
+
+/* Whether the two records have the same class, name, URI and values */
+static gboolean
+record_equal (const record_t * a, const record_t * b)
+{
+	guint i;
+
+	if (a->klass != b->klass || g_strcmp0(a->name, b->name) != 0 || g_strcmp0(a->uri, b->uri) != 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < a->klass->n_fields; i++) {
+		switch (a->klass->fields[i].type) {
+		case SERVER_FIELD_BOOLEAN:
+			if (a->values[i].boolean != b->values[i].boolean) {
+				return FALSE;
+			}
+			break;
+		case SERVER_FIELD_STRING:
+			if (g_strcmp0(a->values[i].string, b->values[i].string) != 0) {
+				return FALSE;
+			}
+			break;
+		case SERVER_FIELD_SECRET:
+			if (g_strcmp0(a->values[i].secret, b->values[i].secret) != 0) {
+				return FALSE;
+			}
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Makes a server object out of @record, its strings stay in @arena */
+static Server *
+record_new_server (record_t * record, arena_t * arena)
+{
+	ServerClass * klass = record->klass;
+	Server * server = g_object_new(G_TYPE_FROM_CLASS(klass), NULL);
+	guint i;
+
+	server->name = record->name;
+	server->uri = record->uri;
+	server->last_used = record->last_used;
+
+	for (i = 0; i < klass->n_fields; i++) {
+		const ServerField * field = &klass->fields[i];
+
+		switch (field->type) {
+		case SERVER_FIELD_BOOLEAN:
+			G_STRUCT_MEMBER(gboolean, server, field->offset) = record->values[i].boolean;
+			break;
+		case SERVER_FIELD_STRING:
+			G_STRUCT_MEMBER(const gchar *, server, field->offset) = record->values[i].string;
+			break;
+		case SERVER_FIELD_SECRET:
+			G_STRUCT_MEMBER(gchar *, server, field->offset) = secret_dup(record->values[i].secret);
+			break;
+		}
+	}
+
+	g_object_set_qdata_full(G_OBJECT(server), arena_quark(), arena_ref(arena), arena_unref);
+
+	return server;
+}
+
+typedef struct _parse_t parse_t;
+struct _parse_t {
+	arena_t * arena;
+	record_t * record;
+};
+
+/* Same rules as server_new_from_json(), only into a record */
+static void
+record_field_set (JsonObject RLS_UNUSED * object, const gchar * member, JsonNode * node, gpointer user_data)
+{
+	parse_t * parse = (parse_t *)user_data;
+	record_t * record = parse->record;
+	const ServerField * field = g_hash_table_lookup(record->klass->field_index, member);
+
+	if (field == NULL || JSON_NODE_TYPE(node) != JSON_NODE_VALUE) {
+		return;
+	}
+
+	gint position = field_position(record->klass, field);
+
+	if (field->type == SERVER_FIELD_BOOLEAN) {
+		if (position >= 0 && json_node_get_value_type(node) == G_TYPE_BOOLEAN) {
+			record->values[position].boolean = json_node_get_boolean(node);
+		}
+		return;
+	}
+
+	if (json_node_get_value_type(node) != G_TYPE_STRING || json_node_get_string(node) == NULL) {
+		return;
+	}
+
+	if (field->type == SERVER_FIELD_SECRET) {
+		if (position >= 0) {
+			secret_free(record->values[position].secret);
+			record->values[position].secret = secret_dup(json_node_get_string(node));
+		}
+		return;
+	}
+
+	/* Brokers repeat hosts, domains and users a lot */
+	const gchar * value = g_string_chunk_insert_const(parse->arena->strings, json_node_get_string(node));
+
+	if (position >= 0) {
+		record->values[position].string = value;
+	} else if (field->offset == G_STRUCT_OFFSET(Server, name)) {
+		record->name = value;
+	} else if (field->offset == G_STRUCT_OFFSET(Server, uri)) {
+		record->uri = value;
+	}
+
+	return;
+}
+
+/**
+ * server_table_new_from_json:
+ * @array: Servers as the broker sent them
+ *
+ * Parses the servers without making any objects, so it can be used
+ * from a worker thread.  Servers with a protocol we don't know are
+ * left out.
+ *
+ * Return value: (transfer full): A new table
+ */
+ServerTable *
+server_table_new_from_json (JsonArray * array)
+{
+	g_return_val_if_fail(array != NULL, NULL);
+
+	guint length = json_array_get_length(array);
+	ServerTable * table = g_new0(ServerTable, 1);
+	guint i;
+
+	table->records = g_array_sized_new(FALSE, TRUE, sizeof(record_t), length);
+	table->index = g_hash_table_new(g_str_hash, g_str_equal);
+	table->arena = arena_new();
+
+	for (i = 0; i < length; i++) {
+		JsonNode * node = json_array_get_element(array, i);
+
+		if (JSON_NODE_TYPE(node) != JSON_NODE_OBJECT) {
+			continue;
+		}
+
+		JsonObject * object = json_node_get_object(node);
+		JsonNode * proto = json_object_get_member(object, JSON_PROTOCOL);
+
+		if (proto == NULL || JSON_NODE_TYPE(proto) != JSON_NODE_VALUE || json_node_get_value_type(proto) != G_TYPE_STRING) {
+			continue;
+		}
+
+		GType type = server_protocol_type(json_node_get_string(proto));
+		if (type == G_TYPE_INVALID) {
+			continue;
+		}
+
+		record_t record;
+		memset(&record, 0, sizeof(record_t));
+		record.klass = record_class(type);
+
+		parse_t parse = { table->arena, &record };
+		json_object_foreach_member(object, record_field_set, &parse);
+
+		g_array_append_val(table->records, record);
+
+		if (record.uri != NULL && !g_hash_table_contains(table->index, record.uri)) {
+			g_hash_table_insert(table->index, (gpointer)record.uri, GUINT_TO_POINTER(table->records->len));
+		}
+	}
+
+	return table;
+}
+
+/**
+ * server_table_free:
+ * @table: (allow-none): Table to free
+ *
+ * Frees the records and drops the server objects made from them.  The
+ * strings stay around until the last of those objects is gone.
+ */
+void
+server_table_free (ServerTable * table)
+{
+	guint i;
+
+	if (table == NULL) {
+		return;
+	}
+
+	for (i = 0; i < table->records->len; i++) {
+		record_clear(RECORD(table, i));
+	}
+
+	g_array_free(table->records, TRUE);
+	g_hash_table_unref(table->index);
+	arena_unref(table->arena);
+	g_free(table);
+
+	return;
+}
+
+/**
+ * server_table_adopt:
+ * @table: A list that just came in
+ * @old: (allow-none): The list it replaces
+ *
+ * Moves the server objects and memoized variants of @old over to the
+ * servers of @table that are still the same, so they keep what was
+ * probed about them.  A server is looked up by URI and has to keep its
+ * protocol and name.  When only its values changed it gets a new
+ * object that starts out with the state, latency and addresses of the
+ * old one.
+ *
+ * Return value: Whether @table is any different from @old
+ */
+gboolean
+server_table_adopt (ServerTable * table, ServerTable * old)
+{
+	g_return_val_if_fail(table != NULL, FALSE);
+
+	guint oldlength = old != NULL ? old->records->len : 0;
+	gboolean changed = table->records->len != oldlength;
+	gboolean * taken = g_new0(gboolean, oldlength + 1);
+	guint i;
+
+	for (i = 0; i < table->records->len; i++) {
+		record_t * record = RECORD(table, i);
+		guint match = 0;
+
+		if (old != NULL && record->uri != NULL) {
+			match = GPOINTER_TO_UINT(g_hash_table_lookup(old->index, record->uri));
+		}
+
+		/* Each old server only gets taken over once, the ones sharing a
+		   URI with an earlier one can stay where they were */
+		if (match == 0 || taken[match - 1]) {
+			match = 0;
+
+			if (i < oldlength && !taken[i] && record->uri != NULL && g_strcmp0(RECORD(old, i)->uri, record->uri) == 0) {
+				match = i + 1;
+			}
+		}
+
+		if (match == 0) {
+			changed = TRUE;
+			continue;
+		}
+
+		record_t * oldrecord = RECORD(old, match - 1);
+
+		if (oldrecord->klass != record->klass || g_strcmp0(oldrecord->name, record->name) != 0) {
+			changed = TRUE;
+			continue;
+		}
+
+		taken[match - 1] = TRUE;
+
+		if (match - 1 != i) {
+			changed = TRUE;
+		}
+
+		if (record_equal(record, oldrecord)) {
+			record->server = oldrecord->server;
+			oldrecord->server = NULL;
+
+			if (record->server != NULL) {
+				if (server_set_last_used(record->server, record->last_used)) {
+					changed = TRUE;
+				}
+			} else if (record->last_used == oldrecord->last_used) {
+				record->variant = oldrecord->variant;
+				oldrecord->variant = NULL;
+			} else {
+				changed = TRUE;
+			}
+
+			continue;
+		}
+
+		changed = TRUE;
+
+		if (oldrecord->server != NULL) {
+			Server * from = oldrecord->server;
+			Server * server = server_table_get_server(table, i);
+
+			server_set_state(server, from->state);
+			server_set_latency(server, from->latency);
+			server_set_addresses(server, (const gchar * const *)from->addresses);
+		}
+	}
+
+	g_free(taken);
+
+	return changed;
+}
+
+/**
+ * server_table_length:
+ * @table: Table to look in
+ *
+ * Return value: The number of servers
+ */
+guint
+server_table_length (ServerTable * table)
+{
+	g_return_val_if_fail(table != NULL, 0);
+
+	return table->records->len;
+}
+
+/**
+ * server_table_get_name:
+ * @table: Table to look in
+ * @index: Position of the server
+ *
+ * Return value: (transfer none): The name of the server
+ */
+const gchar *
+server_table_get_name (ServerTable * table, guint index)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+	g_return_val_if_fail(index < table->records->len, NULL);
+
+	return RECORD(table, index)->name;
+}
+
+/**
+ * server_table_get_uri:
+ * @table: Table to look in
+ * @index: Position of the server
+ *
+ * Return value: (transfer none): The URI of the server
+ */
+const gchar *
+server_table_get_uri (ServerTable * table, guint index)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+	g_return_val_if_fail(index < table->records->len, NULL);
+
+	return RECORD(table, index)->uri;
+}
+
+/**
+ * server_table_get_state:
+ * @table: Table to look in
+ * @index: Position of the server
+ *
+ * Servers that have no object were never probed, so they're taken as
+ * being fine.
+ *
+ * Return value: The state of the server
+ */
+ServerState
+server_table_get_state (ServerTable * table, guint index)
+{
+	g_return_val_if_fail(table != NULL, SERVER_STATE_ALLGOOD);
+	g_return_val_if_fail(index < table->records->len, SERVER_STATE_ALLGOOD);
+
+	record_t * record = RECORD(table, index);
+
+	if (record->server == NULL) {
+		return SERVER_STATE_ALLGOOD;
+	}
+
+	return record->server->state;
+}
+
+/**
+ * server_table_find_name:
+ * @table: Table to look in
+ * @name: (allow-none): Name of the server
+ *
+ * Return value: The position of the first server called @name, or -1
+ */
+gint
+server_table_find_name (ServerTable * table, const gchar * name)
+{
+	g_return_val_if_fail(table != NULL, -1);
+
+	guint i;
+
+	if (name == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < table->records->len; i++) {
+		if (g_strcmp0(RECORD(table, i)->name, name) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * server_table_find_uri:
+ * @table: Table to look in
+ * @uri: (allow-none): URI of the server
+ *
+ * Return value: The position of the first server with @uri, or -1
+ */
+gint
+server_table_find_uri (ServerTable * table, const gchar * uri)
+{
+	g_return_val_if_fail(table != NULL, -1);
+
+	if (uri == NULL) {
+		return -1;
+	}
+
+	return (gint)GPOINTER_TO_UINT(g_hash_table_lookup(table->index, uri)) - 1;
+}
+
+/**
+ * server_table_set_last_used:
+ * @table: Table to change
+ * @index: Position of the server
+ * @last_used: Whether it is the last used one
+ *
+ * Sets the flag on the record and on its object if it has one.
+ *
+ * Return value: Whether the flag changed
+ */
+gboolean
+server_table_set_last_used (ServerTable * table, guint index, gboolean last_used)
+{
+	g_return_val_if_fail(table != NULL, FALSE);
+	g_return_val_if_fail(index < table->records->len, FALSE);
+
+	record_t * record = RECORD(table, index);
+
+	last_used = last_used ? TRUE : FALSE;
+
+	if (record->server != NULL) {
+		record->last_used = last_used;
+		return server_set_last_used(record->server, last_used);
+	}
+
+	if (record->last_used == last_used) {
+		return FALSE;
+	}
+
+	record->last_used = last_used;
+	g_clear_pointer(&record->variant, g_variant_unref);
+
+	return TRUE;
+}
+
+/**
+ * server_table_get_variant:
+ * @table: Table to look in
+ * @index: Position of the server
+ *
+ * Gets the variant the greeter is sent for the server.  Without an
+ * object it's built through a short lived one and memoized in the
+ * record.
+ *
+ * Return value: (transfer full): The variant
+ */
+GVariant *
+server_table_get_variant (ServerTable * table, guint index)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+	g_return_val_if_fail(index < table->records->len, NULL);
+
+	record_t * record = RECORD(table, index);
+
+	if (record->server != NULL) {
+		return server_get_variant(record->server);
+	}
+
+	if (record->variant == NULL) {
+		Server * server = record_new_server(record, table->arena);
+		record->variant = server_get_variant(server);
+		g_object_unref(server);
+
+		if (record->variant == NULL) {
+			return NULL;
+		}
+	}
+
+	return g_variant_ref(record->variant);
+}
+
+/**
+ * server_table_peek:
+ * @table: Table to look in
+ * @index: Position of the server
+ *
+ * Return value: (transfer none): The object of the server if one was
+ *   made already, NULL otherwise
+ */
+Server *
+server_table_peek (ServerTable * table, guint index)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+	g_return_val_if_fail(index < table->records->len, NULL);
+
+	return RECORD(table, index)->server;
+}
+
+/**
+ * server_table_get_server:
+ * @table: Table to look in
+ * @index: Position of the server
+ *
+ * Gets the object of the server, making it the first time.  It's kept
+ * for as long as the table is, or is moved on by server_table_adopt().
+ *
+ * Return value: (transfer none): The server
+ */
+Server *
+server_table_get_server (ServerTable * table, guint index)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+	g_return_val_if_fail(index < table->records->len, NULL);
+
+	record_t * record = RECORD(table, index);
+
+	if (record->server == NULL) {
+		record->server = record_new_server(record, table->arena);
+		/* The object memoizes its own from now on */
+		g_clear_pointer(&record->variant, g_variant_unref);
+	}
+
+	return record->server;
+}
+
+/**
+ * server_table_get_servers:
+ * @table: Table to look in
+ *
+ * Gets the objects of all the servers, making the ones that are
+ * missing.
+ *
+ * Return value: (transfer full): Array of servers, each with a reference
+ */
+GPtrArray *
+server_table_get_servers (ServerTable * table)
+{
+	g_return_val_if_fail(table != NULL, NULL);
+
+	GPtrArray * servers = g_ptr_array_new_full(table->records->len, g_object_unref);
+	guint i;
+
+	for (i = 0; i < table->records->len; i++) {
+		g_ptr_array_add(servers, g_object_ref(server_table_get_server(table, i)));
+	}
+
+	return servers;
+}
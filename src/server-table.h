@@ -0,0 +1,49 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __SERVER_TABLE_H__
+#define __SERVER_TABLE_H__
+
+#include <glib.h>
+#include <json-glib/json-glib.h>
+#include "server.h"
+
+G_BEGIN_DECLS
+
+/* The servers a broker sent, kept as plain records.  A Server object is
+   only made for the ones that get probed or looked up. */
+typedef struct _ServerTable ServerTable;
+
+ServerTable * server_table_new_from_json (JsonArray * array);
+void server_table_free (ServerTable * table);
+gboolean server_table_adopt (ServerTable * table, ServerTable * old);
+guint server_table_length (ServerTable * table);
+const gchar * server_table_get_name (ServerTable * table, guint index);
+const gchar * server_table_get_uri (ServerTable * table, guint index);
+ServerState server_table_get_state (ServerTable * table, guint index);
+gint server_table_find_name (ServerTable * table, const gchar * name);
+gint server_table_find_uri (ServerTable * table, const gchar * uri);
+gboolean server_table_set_last_used (ServerTable * table, guint index, gboolean last_used);
+GVariant * server_table_get_variant (ServerTable * table, guint index);
+Server * server_table_peek (ServerTable * table, guint index);
+Server * server_table_get_server (ServerTable * table, guint index);
+GPtrArray * server_table_get_servers (ServerTable * table);
+
+G_END_DECLS
+
+#endif
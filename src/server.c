@@ -22,6 +22,10 @@
 #include "config.h"
 #endif
 
+#include <sys/mman.h>
+
+#include <string.h>
+
 #include "server.h"
 #include "defines.h"
 #include "citrix-server.h"
@@ -33,10 +37,13 @@ static void server_class_init (ServerClass *klass);
 static void server_init       (Server *self);
 static void server_dispose    (GObject *object);
 static void server_finalize   (GObject *object);
+static GVariant * get_field_properties (Server * server);
+static GVariant * server_property_measured (const gchar * name, GVariant * value);
 
 /* Signals */
 enum {
 	STATE_CHANGED,
+	CHANGED,
 	LAST_SIGNAL
 };
 
@@ -44,6 +51,18 @@ G_DEFINE_TYPE (Server, server, G_TYPE_OBJECT);
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
+/* The parts of a property tuple that don't depend on the server, built
+   once in class init and shared by all of the properties */
+static GVariant * property_empty = NULL;
+static GVariant * property_hints = NULL;
+static GVariant * property_required[2] = { NULL, NULL };
+
+/* Fields every server gets from the broker */
+static const ServerField server_fields[] = {
+	{ JSON_SERVER_NAME, SERVER_FIELD_STRING, G_STRUCT_OFFSET(Server, name), NULL, -1 },
+	{ JSON_URI,         SERVER_FIELD_STRING, G_STRUCT_OFFSET(Server, uri),  NULL, -1 }
+};
+
 static void
 server_class_init (ServerClass *klass)
 {
@@ -52,6 +71,8 @@ server_class_init (ServerClass *klass)
 	object_class->dispose = server_dispose;
 	object_class->finalize = server_finalize;
 
+	klass->get_properties = get_field_properties;
+
 	signals[STATE_CHANGED] = g_signal_new(SERVER_SIGNAL_STATE_CHANGED,
 	                                      G_TYPE_FROM_CLASS(klass),
 	                                      G_SIGNAL_RUN_LAST,
@@ -60,6 +81,19 @@ server_class_init (ServerClass *klass)
 	                                      g_cclosure_marshal_VOID__INT,
 	                                      G_TYPE_NONE, 1, G_TYPE_INT, G_TYPE_NONE);
 
+	signals[CHANGED] = g_signal_new(SERVER_SIGNAL_CHANGED,
+	                                G_TYPE_FROM_CLASS(klass),
+	                                G_SIGNAL_RUN_LAST,
+	                                G_STRUCT_OFFSET(ServerClass, changed),
+	                                NULL, NULL,
+	                                g_cclosure_marshal_VOID__VOID,
+	                                G_TYPE_NONE, 0);
+
+	property_empty = g_variant_ref_sink(g_variant_new_variant(g_variant_new_string("")));
+	property_hints = g_variant_ref_sink(g_variant_new_array(G_VARIANT_TYPE("{sv}"), NULL, 0));
+	property_required[FALSE] = g_variant_ref_sink(g_variant_new_boolean(FALSE));
+	property_required[TRUE] = g_variant_ref_sink(g_variant_new_boolean(TRUE));
+
 	return;
 }
 
@@ -70,6 +104,10 @@ server_init (Server *self)
 	self->uri = NULL;
 	self->last_used = FALSE;
 	self->state = SERVER_STATE_ALLGOOD;
+	self->latency = -1;
+	self->score = -1;
+	self->addresses = NULL;
+	self->variant = NULL;
 
 	return;
 }
@@ -86,9 +124,21 @@ static void
 server_finalize (GObject *object)
 {
 	Server * server = SERVER(object);
+	ServerClass * klass = SERVER_GET_CLASS(server);
+	guint i;
+
+	for (i = 0; i < klass->n_fields; i++) {
+		const ServerField * field = &klass->fields[i];
+		gchar ** value = G_STRUCT_MEMBER_P(server, field->offset);
+
+		if (field->type == SERVER_FIELD_SECRET && *value != NULL) {
+			munlock(*value, strlen(*value));
+			g_clear_pointer(value, g_free);
+		}
+	}
 
-	g_free(server->name);
-	g_free(server->uri);
+	g_clear_pointer(&server->addresses, g_strfreev);
+	g_clear_pointer(&server->variant, g_variant_unref);
 
 	G_OBJECT_CLASS (server_parent_class)->finalize (object);
 	return;
@@ -130,12 +180,188 @@ server_new_from_keyfile (GKeyFile * keyfile, const gchar * group)
 	return NULL;
 }
 
+/**
+ * server_class_set_fields:
+ * @klass: Class of a server subclass
+ * @fields: (array length=n_fields) Fields the subclass adds, must stay
+ *   around for the life of the class
+ * @n_fields: Number of entries in @fields
+ *
+ * Describes the values that the broker can send for this type of
+ * server.  They are filled in by server_new_from_json(), turned into
+ * properties by the default get_properties() and freed on finalize.
+ */
+void
+server_class_set_fields (ServerClass * klass, const ServerField * fields, guint n_fields)
+{
+	g_return_if_fail(IS_SERVER_CLASS(klass));
+	g_return_if_fail(n_fields <= SERVER_MAX_FIELDS);
+
+	guint i;
+
+	klass->fields = fields;
+	klass->n_fields = n_fields;
+	klass->field_index = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (i = 0; i < G_N_ELEMENTS(server_fields); i++) {
+		g_hash_table_insert(klass->field_index, (gpointer)server_fields[i].json, (gpointer)&server_fields[i]);
+	}
+
+	for (i = 0; i < n_fields; i++) {
+		g_hash_table_insert(klass->field_index, (gpointer)fields[i].json, (gpointer)&fields[i]);
+	}
+
+	return;
+}
+
+/* Build the properties from the fields of the class */
+static GVariant *
+get_field_properties (Server * server)
+{
+	ServerClass * klass = SERVER_GET_CLASS(server);
+	guint i;
+
+	GVariantBuilder propbuilder;
+	g_variant_builder_init(&propbuilder, G_VARIANT_TYPE_ARRAY);
+
+	for (i = 0; i < klass->n_fields; i++) {
+		const ServerField * field = &klass->fields[i];
+
+		if (field->property == NULL) {
+			continue;
+		}
+
+		gboolean required = TRUE;
+		if (field->required >= 0) {
+			required = G_STRUCT_MEMBER(gboolean, server, field->required);
+		}
+
+		g_variant_builder_add_value(&propbuilder, server_property_new(field->property, required, G_STRUCT_MEMBER(gchar *, server, field->offset)));
+	}
+
+	return g_variant_builder_end(&propbuilder);
+}
+
+/* Set the field for a member of the JSON object, if it is one and it
+   has the right type */
+static void
+json_field_set (JsonObject RLS_UNUSED * object, const gchar * member, JsonNode * node, gpointer user_data)
+{
+	Server * server = SERVER(user_data);
+	const ServerField * field = g_hash_table_lookup(SERVER_GET_CLASS(server)->field_index, member);
+
+	if (field == NULL || JSON_NODE_TYPE(node) != JSON_NODE_VALUE) {
+		return;
+	}
+
+	if (field->type == SERVER_FIELD_BOOLEAN) {
+		if (json_node_get_value_type(node) == G_TYPE_BOOLEAN) {
+			G_STRUCT_MEMBER(gboolean, server, field->offset) = json_node_get_boolean(node);
+		}
+		return;
+	}
+
+	if (json_node_get_value_type(node) != G_TYPE_STRING) {
+		return;
+	}
+
+	if (field->type == SERVER_FIELD_STRING) {
+		/* Brokers repeat hosts, domains and users a lot */
+		G_STRUCT_MEMBER(const gchar *, server, field->offset) = g_intern_string(json_node_get_string(node));
+		return;
+	}
+
+	gchar ** value = G_STRUCT_MEMBER_P(server, field->offset);
+	g_free(*value);
+	*value = g_strdup(json_node_get_string(node));
+	mlock(*value, strlen(*value));
+
+	return;
+}
+
+/* The names a broker may use for each protocol, compared without
+   regard to case */
+typedef struct _protocol_t protocol_t;
+struct _protocol_t {
+	const gchar * name;
+	GType (*get_type) (void);
+};
+
+static const protocol_t protocols[] = {
+	{ "ica",      citrix_server_get_type },
+	{ "freerdp",  rdp_server_get_type },
+	{ "freerdp2", rdp_server_get_type },
+	{ "rdp",      rdp_server_get_type },
+	{ "x2go",     x2go_server_get_type }
+};
+
+static guint
+protocol_hash (gconstpointer key)
+{
+	const gchar * p;
+	guint hash = 5381;
+
+	for (p = key; *p != '\0'; p++) {
+		hash = (hash << 5) + hash + g_ascii_tolower(*p);
+	}
+
+	return hash;
+}
+
+static gboolean
+protocol_equal (gconstpointer a, gconstpointer b)
+{
+	return g_ascii_strcasecmp(a, b) == 0;
+}
+
+/* Protocol names to entries in protocols[], built on first use which
+   may well be on the thread parsing a server list */
+static GHashTable *
+protocol_table (void)
+{
+	static GHashTable * table = NULL;
+
+	if (g_once_init_enter(&table)) {
+		GHashTable * newtable = g_hash_table_new(protocol_hash, protocol_equal);
+		guint i;
+
+		for (i = 0; i < G_N_ELEMENTS(protocols); i++) {
+			g_hash_table_insert(newtable, (gpointer)protocols[i].name, (gpointer)&protocols[i]);
+		}
+
+		g_once_init_leave(&table, newtable);
+	}
+
+	return table;
+}
+
+/**
+ * server_protocol_type:
+ * @protocol: Protocol name the broker used
+ *
+ * Return value: The server subclass for @protocol, %G_TYPE_INVALID if
+ *   we don't know it
+ */
+GType
+server_protocol_type (const gchar * protocol)
+{
+	g_return_val_if_fail(protocol != NULL, G_TYPE_INVALID);
+
+	const protocol_t * entry = g_hash_table_lookup(protocol_table(), protocol);
+
+	if (entry == NULL) {
+		return G_TYPE_INVALID;
+	}
+
+	return entry->get_type();
+}
+
 /**
  * server_new_from_json:
  * @object: JSON object with server definition
  *
- * Looks at the type and then uses a subclassed function to build the
- * server.
+ * Looks at the type to pick the subclass and then fills in the fields
+ * it has in one pass over the members of @object.
  *
  * Return value: A new Server object or NULL if error
  */
@@ -144,11 +370,10 @@ server_new_from_json (JsonObject * object)
 {
 	g_return_val_if_fail(object != NULL, NULL);
 
-	if (!json_object_has_member(object, "Protocol")) {
+	JsonNode * proto_node = json_object_get_member(object, JSON_PROTOCOL);
+	if (proto_node == NULL) {
 		return NULL;
 	}
-
-	JsonNode * proto_node = json_object_get_member(object, "Protocol");
 	if (JSON_NODE_TYPE(proto_node) != JSON_NODE_VALUE) {
 		return NULL;
 	}
@@ -156,45 +381,29 @@ server_new_from_json (JsonObject * object)
 		return NULL;
 	}
 
-	const gchar * proto = json_node_get_string(proto_node);
-	Server * newserver = NULL;
+	GType type = server_protocol_type(json_node_get_string(proto_node));
 
-	if (g_strcmp0(proto, "ICA") == 0 || g_strcmp0(proto, "ica") == 0) {
-		newserver = citrix_server_new_from_json(object);
-	}
-	else if (g_strcmp0(proto, "freerdp") == 0 || g_strcmp0(proto, "rdp") == 0 || g_strcmp0(proto, "freerdp2") == 0 || g_strcmp0(proto, "RDP") == 0 || g_strcmp0(proto, "FreeRDP") == 0 || g_strcmp0(proto, "FreeRDP2") == 0) {
-		newserver = rdp_server_new_from_json(object);
-	}
-	else if (g_strcmp0(proto, "x2go") == 0 || g_strcmp0(proto, "X2go") == 0 || g_strcmp0(proto, "X2Go") == 0 || g_strcmp0(proto, "X2GO") == 0 || g_strcmp0(proto, "x2GO") == 0 || g_strcmp0(proto, "x2gO") == 0) {
-		newserver = x2go_server_new_from_json(object);
+	if (type == G_TYPE_INVALID) {
+		return NULL;
 	}
 
-	return newserver;
+	Server * server = g_object_new(type, NULL);
+	json_object_foreach_member(object, json_field_set, server);
+
+	return server;
 }
 
-GVariant *
-server_get_variant (Server * server)
+/* Build the variant describing the server from scratch */
+static GVariant *
+build_variant (Server * server)
 {
-	/* Okay, this doesn't do anything useful, but it will generate an error
-	   which could be a good thing */
-	g_return_val_if_fail(IS_SERVER(server), NULL);
-
 	ServerClass * klass = SERVER_GET_CLASS(server);
 	if (klass->get_properties != NULL) {
 		GVariantBuilder tuple;
 		g_variant_builder_init(&tuple, G_VARIANT_TYPE_TUPLE);
 
-		if (IS_CITRIX_SERVER(server)) {
-			g_variant_builder_add_value(&tuple, g_variant_new_string("ica"));
-		} else if (IS_RDP_SERVER(server)) {
-			g_variant_builder_add_value(&tuple, g_variant_new_string("freerdp2"));
-		} else if (IS_UCCS_SERVER(server)) {
-			g_variant_builder_add_value(&tuple, g_variant_new_string("uccs"));
-		} else if (IS_X2GO_SERVER(server)) {
-			g_variant_builder_add_value(&tuple, g_variant_new_string("x2go"));
-		} else {
-			g_assert_not_reached();
-		}
+		g_assert(klass->protocol != NULL);
+		g_variant_builder_add_value(&tuple, g_variant_new_string(klass->protocol));
 
 		if (server->name != NULL) {
 			g_variant_builder_add_value(&tuple, g_variant_new_string(server->name));
@@ -212,8 +421,40 @@ server_get_variant (Server * server)
 
 		g_variant_builder_add_value(&tuple, g_variant_new_boolean(server->last_used));
 
-		GVariant * props = klass->get_properties(server);
-		g_variant_builder_add_value(&tuple, props);
+		/* Subclasses may hand back a reference to a shared array */
+		GVariant * props = g_variant_ref_sink(klass->get_properties(server));
+
+		if (server->latency >= 0 || server->score >= 0 || server->addresses != NULL) {
+			GVariantBuilder propbuilder;
+			GVariantIter iter;
+			GVariant * prop;
+
+			g_variant_builder_init(&propbuilder, G_VARIANT_TYPE("a(sbva{sv})"));
+
+			g_variant_iter_init(&iter, props);
+			while ((prop = g_variant_iter_next_value(&iter)) != NULL) {
+				g_variant_builder_add_value(&propbuilder, prop);
+				g_variant_unref(prop);
+			}
+
+			if (server->latency >= 0) {
+				g_variant_builder_add_value(&propbuilder, server_property_measured("latency", g_variant_new_int32(server->latency)));
+			}
+
+			if (server->score >= 0) {
+				g_variant_builder_add_value(&propbuilder, server_property_measured("score", g_variant_new_int32(server->score)));
+			}
+
+			if (server->addresses != NULL) {
+				g_variant_builder_add_value(&propbuilder, server_property_measured("addresses", g_variant_new_strv((const gchar * const *)server->addresses, -1)));
+			}
+
+			g_variant_builder_add_value(&tuple, g_variant_builder_end(&propbuilder));
+		} else {
+			g_variant_builder_add_value(&tuple, props);
+		}
+
+		g_variant_unref(props);
 
 		if (klass->get_applications != NULL) {
 			GVariant * array = klass->get_applications(server);
@@ -229,6 +470,82 @@ server_get_variant (Server * server)
 	return NULL;
 }
 
+/**
+ * server_get_variant:
+ * @server: Server to describe
+ *
+ * Gets the (sssba(sbva{sv})a(si)) tuple describing the server.  The
+ * tuple is built once and kept until server_changed() is called, so
+ * asking again is only a reference bump.
+ *
+ * Return value: (transfer full) A reference to the memoized variant,
+ *   to be released with g_variant_unref()
+ */
+GVariant *
+server_get_variant (Server * server)
+{
+	/* Okay, this doesn't do anything useful, but it will generate an error
+	   which could be a good thing */
+	g_return_val_if_fail(IS_SERVER(server), NULL);
+
+	if (server->variant == NULL) {
+		server->variant = build_variant(server);
+
+		if (server->variant == NULL) {
+			return NULL;
+		}
+
+		g_variant_ref_sink(server->variant);
+	}
+
+	return g_variant_ref(server->variant);
+}
+
+/**
+ * server_property_new:
+ * @name: Name of the property
+ * @required: Whether the greeter has to fill it in
+ * @value: (allow-none) Current value, NULL for an empty string
+ *
+ * Builds a (sbva{sv}) property tuple for the get_properties()
+ * implementations.  Only the name and the value are allocated, the
+ * rest is shared between all of the properties.
+ *
+ * Return value: (transfer floating) The property tuple
+ */
+GVariant *
+server_property_new (const gchar * name, gboolean required, const gchar * value)
+{
+	g_return_val_if_fail(name != NULL, NULL);
+
+	GVariant * children[4];
+
+	children[0] = g_variant_new_string(name);
+	children[1] = property_required[required ? TRUE : FALSE];
+	if (value == NULL) {
+		children[2] = property_empty;
+	} else {
+		children[2] = g_variant_new_variant(g_variant_new_string(value));
+	}
+	children[3] = property_hints;
+
+	return g_variant_new_tuple(children, 4);
+}
+
+/* Something we found out about the server, read-only for the greeter */
+static GVariant *
+server_property_measured (const gchar * name, GVariant * value)
+{
+	GVariant * children[4];
+
+	children[0] = g_variant_new_string(name);
+	children[1] = property_required[FALSE];
+	children[2] = g_variant_new_variant(value);
+	children[3] = property_hints;
+
+	return g_variant_new_tuple(children, 4);
+}
+
 /**
  * server_cached_domains:
  * @server: Where should we find those domains?
@@ -289,7 +606,7 @@ server_set_last_used_server (Server * server, const gchar * uri)
 	g_return_if_fail(IS_SERVER(server));
 
 	if (g_strcmp0(server->uri, uri) == 0) {
-		server->last_used = TRUE;
+		server_set_last_used(server, TRUE);
 	} else {
 		ServerClass * klass = SERVER_GET_CLASS(server);
 
@@ -298,3 +615,260 @@ server_set_last_used_server (Server * server, const gchar * uri)
 		}
 	}
 }
+
+/**
+ * server_update:
+ * @server: Server to update
+ * @from: A server of the same type with the new values
+ *
+ * Copies the fields of the class and the last used flag from @from,
+ * keeping @server, its memoized variant and its state if they're all
+ * the same already.
+ *
+ * Return value: Whether anything changed
+ */
+gboolean
+server_update (Server * server, Server * from)
+{
+	g_return_val_if_fail(IS_SERVER(server), FALSE);
+	g_return_val_if_fail(G_OBJECT_TYPE(server) == G_OBJECT_TYPE(from), FALSE);
+
+	ServerClass * klass = SERVER_GET_CLASS(server);
+	gboolean changed = FALSE;
+	guint i;
+
+	/* Strings of @from can be in the arena of another table, new ones
+	   are interned so they outlive it */
+	if (g_strcmp0(server->name, from->name) != 0 || g_strcmp0(server->uri, from->uri) != 0) {
+		server->name = g_intern_string(from->name);
+		server->uri = g_intern_string(from->uri);
+		changed = TRUE;
+	}
+
+	for (i = 0; i < klass->n_fields; i++) {
+		const ServerField * field = &klass->fields[i];
+
+		switch (field->type) {
+		case SERVER_FIELD_BOOLEAN: {
+			gboolean * value = G_STRUCT_MEMBER_P(server, field->offset);
+			gboolean newvalue = G_STRUCT_MEMBER(gboolean, from, field->offset);
+
+			if (*value != newvalue) {
+				*value = newvalue;
+				changed = TRUE;
+			}
+			break;
+		}
+		case SERVER_FIELD_STRING: {
+			const gchar ** value = G_STRUCT_MEMBER_P(server, field->offset);
+			const gchar * newvalue = G_STRUCT_MEMBER(const gchar *, from, field->offset);
+
+			if (g_strcmp0(*value, newvalue) != 0) {
+				*value = g_intern_string(newvalue);
+				changed = TRUE;
+			}
+			break;
+		}
+		case SERVER_FIELD_SECRET: {
+			gchar ** value = G_STRUCT_MEMBER_P(server, field->offset);
+			gchar ** newvalue = G_STRUCT_MEMBER_P(from, field->offset);
+
+			if (g_strcmp0(*value, *newvalue) != 0) {
+				if (*value != NULL) {
+					munlock(*value, strlen(*value));
+					g_free(*value);
+				}
+
+				/* Already locked in @from */
+				*value = *newvalue;
+				*newvalue = NULL;
+				changed = TRUE;
+			}
+			break;
+		}
+		}
+	}
+
+	if (server->last_used != (from->last_used ? TRUE : FALSE)) {
+		server->last_used = from->last_used ? TRUE : FALSE;
+		changed = TRUE;
+	}
+
+	/* Once for everything that changed */
+	if (changed) {
+		server_changed(server);
+	}
+
+	return changed;
+}
+
+/**
+ * server_changed:
+ * @server: Server whose description changed
+ *
+ * Drops the memoized variant and tells listeners that anything they
+ * built from it is out of date.  Needs to be called whenever one of
+ * the fields that ends up in server_get_variant() is modified.
+ */
+void
+server_changed (Server * server)
+{
+	g_return_if_fail(IS_SERVER(server));
+
+	g_clear_pointer(&server->variant, g_variant_unref);
+	g_signal_emit(server, signals[CHANGED], 0);
+
+	return;
+}
+
+/**
+ * server_set_state:
+ * @server: Server to update
+ * @state: New state of the server
+ *
+ * Sets the state and calls server_changed() if it's actually
+ * different.  Emitting 'state-changed' is left to the caller.
+ *
+ * Return value: Whether the state changed
+ */
+gboolean
+server_set_state (Server * server, ServerState state)
+{
+	g_return_val_if_fail(IS_SERVER(server), FALSE);
+
+	if (server->state == state) {
+		return FALSE;
+	}
+
+	server->state = state;
+	server_changed(server);
+
+	return TRUE;
+}
+
+/**
+ * server_set_last_used:
+ * @server: Server to update
+ * @last_used: Whether it is the last used one
+ *
+ * Sets the last used flag and calls server_changed() if it's actually
+ * different.
+ *
+ * Return value: Whether the flag changed
+ */
+gboolean
+server_set_last_used (Server * server, gboolean last_used)
+{
+	g_return_val_if_fail(IS_SERVER(server), FALSE);
+
+	last_used = last_used ? TRUE : FALSE;
+
+	if (server->last_used == last_used) {
+		return FALSE;
+	}
+
+	server->last_used = last_used;
+	server_changed(server);
+
+	return TRUE;
+}
+
+/**
+ * server_set_latency:
+ * @server: Server to update
+ * @latency: Milliseconds it took to connect to it, -1 if unknown
+ *
+ * Sets the latency and calls server_changed() if it's actually
+ * different.  The greeter gets it as the "latency" property.
+ *
+ * Return value: Whether the latency changed
+ */
+gboolean
+server_set_latency (Server * server, gint latency)
+{
+	g_return_val_if_fail(IS_SERVER(server), FALSE);
+
+	latency = MAX(latency, -1);
+
+	if (server->latency == latency) {
+		return FALSE;
+	}
+
+	server->latency = latency;
+	server_changed(server);
+
+	return TRUE;
+}
+
+/**
+ * server_set_score:
+ * @server: Server to update
+ * @score: How good a choice it is from 0 to 100, -1 if not ranked
+ *
+ * Sets the score and calls server_changed() if it's actually
+ * different.  The greeter gets it as the "score" property.
+ *
+ * Return value: Whether the score changed
+ */
+gboolean
+server_set_score (Server * server, gint score)
+{
+	g_return_val_if_fail(IS_SERVER(server), FALSE);
+
+	score = CLAMP(score, -1, 100);
+
+	if (server->score == score) {
+		return FALSE;
+	}
+
+	server->score = score;
+	server_changed(server);
+
+	return TRUE;
+}
+
+/**
+ * server_set_addresses:
+ * @server: Server to update
+ * @addresses: (allow-none) IP addresses its host resolved to, NULL
+ *   if it wasn't resolved
+ *
+ * Sets the addresses and calls server_changed() if they're actually
+ * different.  The greeter gets them as the "addresses" property so
+ * that it doesn't have to look the host up again.
+ *
+ * Return value: Whether the addresses changed
+ */
+gboolean
+server_set_addresses (Server * server, const gchar * const * addresses)
+{
+	g_return_val_if_fail(IS_SERVER(server), FALSE);
+
+	if (addresses != NULL && addresses[0] == NULL) {
+		addresses = NULL;
+	}
+
+	if (addresses == NULL && server->addresses == NULL) {
+		return FALSE;
+	}
+
+	if (addresses != NULL && server->addresses != NULL) {
+		guint i;
+
+		for (i = 0; addresses[i] != NULL && server->addresses[i] != NULL; i++) {
+			if (g_strcmp0(addresses[i], server->addresses[i]) != 0) {
+				break;
+			}
+		}
+
+		if (addresses[i] == NULL && server->addresses[i] == NULL) {
+			return FALSE;
+		}
+	}
+
+	g_strfreev(server->addresses);
+	server->addresses = g_strdupv((gchar **)addresses);
+	server_changed(server);
+
+	return TRUE;
+}
@@ -34,18 +34,60 @@ G_BEGIN_DECLS
 #define SERVER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SERVER_TYPE, ServerClass))
 
 #define SERVER_SIGNAL_STATE_CHANGED  "state-changed"
+#define SERVER_SIGNAL_CHANGED        "changed"
 
 typedef struct _Server      Server;
 typedef struct _ServerClass ServerClass;
 typedef enum   _ServerState ServerState;
+typedef struct _ServerField ServerField;
+typedef enum   _ServerFieldType ServerFieldType;
 
 enum _ServerState {
 	SERVER_STATE_ALLGOOD,
 	SERVER_STATE_UNAVAILABLE
 };
 
+/* Strings are interned, or shared with the other servers of the
+   ServerTable they came from, and must not be freed.  Equal strings
+   needn't be the same pointer, compare them with g_strcmp0().  Secrets
+   are owned by the server and kept locked in memory */
+enum _ServerFieldType {
+	SERVER_FIELD_STRING,
+	SERVER_FIELD_SECRET,
+	SERVER_FIELD_BOOLEAN
+};
+
+/* Most fields a subclass can have, a ServerTable keeps room for that
+   many values with each server */
+#define SERVER_MAX_FIELDS 4
+
+/* A value the broker sends for a server, where it is kept in the
+   instance and, if it's passed on to the greeter, the name of the
+   property and the offset of the flag saying whether it's required
+   (-1 when it always is) */
+struct _ServerField {
+	const gchar * json;
+	ServerFieldType type;
+	goffset offset;
+	const gchar * property;
+	goffset required;
+};
+
 struct _ServerClass {
 	GObjectClass parent_class;
+
+	/* Protocol name used for the server on the bus */
+	const gchar * protocol;
+
+	/* Set with server_class_set_fields() */
+	const ServerField * fields;
+	guint n_fields;
+	GHashTable * field_index;
+
+	/* Ports where the server can be reached, tried in order when
+	   probing it, 0 terminated.  NULL if it can't be probed. */
+	const guint16 * probe_ports;
+
 	GVariant * (*get_properties) (Server * server);
 	GVariant * (*get_applications) (Server * server);
 	GVariant * (*get_domains) (Server * server);
@@ -54,25 +96,50 @@ struct _ServerClass {
 
 	/* signals */
 	void (*state_changed) (Server * server, ServerState newstate, gpointer user_data);
+	void (*changed) (Server * server, gpointer user_data);
 };
 
 struct _Server {
 	GObject parent;
 
-	gchar * name;
-	gchar * uri;
+	/* Interned with g_intern_string(), or in the arena of the
+	   ServerTable the server was made from */
+	const gchar * name;
+	const gchar * uri;
 	gboolean last_used;
 
 	ServerState state;
+
+	/* Milliseconds it took to connect to it, -1 if we don't know */
+	gint latency;
+
+	/* Rank among the servers it was listed with, -1 if not ranked */
+	gint score;
+
+	/* What its host resolved to, NULL if it wasn't looked up */
+	gchar ** addresses;
+
+	/* Memoized result of server_get_variant(), dropped by server_changed() */
+	GVariant * variant;
 };
 
 GType server_get_type (void);
+GType server_protocol_type (const gchar * protocol);
+void server_class_set_fields (ServerClass * klass, const ServerField * fields, guint n_fields);
 Server * server_new_from_keyfile (GKeyFile * keyfile, const gchar * group);
 Server * server_new_from_json (JsonObject * object);
 GVariant * server_get_variant (Server * server);
+GVariant * server_property_new (const gchar * name, gboolean required, const gchar * value);
 GVariant * server_cached_domains (Server * server);
 Server * server_find_uri (Server * server, const gchar * uri);
 void server_set_last_used_server (Server * server, const gchar * uri);
+gboolean server_update (Server * server, Server * from);
+void server_changed (Server * server);
+gboolean server_set_state (Server * server, ServerState state);
+gboolean server_set_last_used (Server * server, gboolean last_used);
+gboolean server_set_latency (Server * server, gint latency);
+gboolean server_set_score (Server * server, gint score);
+gboolean server_set_addresses (Server * server, const gchar * const * addresses);
 
 G_END_DECLS
 
@@ -0,0 +1,724 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
+
+#include <json-glib/json-glib.h>
+
+#include <signal.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "uccs-agent.h"
+#include "defines.h"
+
+/* A persistent agent is started once with UCCS_AGENT_PERSISTENT_ARG.
+   Before anything else it prints UCCS_AGENT_BANNER on a line of its
+   own, then it gets one request per line on its stdin:
+
+     {"Username": "...", "Password": "..."}
+
+   It answers every request, in the order they were sent, with a single
+   line on its stdout: the status the one-shot agent would have exited
+   with, a space, and the JSON it would have printed with any newlines
+   taken out.
+
+   An agent that doesn't know about the persistent mode takes the
+   argument for the username and reads its stdin for the password, so
+   nothing is written to it until it has introduced itself.  If it
+   doesn't within UCCS_AGENT_HANDSHAKE_TIMEOUT seconds it isn't asked
+   again, queries go to one-shot agents from then on. */
+
+#define UCCS_AGENT_HANDSHAKE_TIMEOUT 5
+
+typedef struct _agent_request_t agent_request_t;
+struct _agent_request_t {
+	UccsAgentCallback callback;
+	gpointer userdata;
+
+	/* Kept to send it again if the agent gets restarted */
+	gchar * line;
+	gsize length;
+};
+
+typedef struct _agent_write_t agent_write_t;
+struct _agent_write_t {
+	UccsAgent * agent;
+	gchar * buffer;
+	gsize length;
+};
+
+struct _UccsAgent {
+	gchar * exec;
+	gchar * uri;
+
+	GPid pid;
+	guint watch;
+
+	GOutputStream * request_stream;
+	GDataInputStream * reply_stream;
+	GCancellable * cancel;
+
+	/* Holds passwords, wiped before it's freed or grown */
+	GString * outbuf;
+	gboolean writing;
+	gboolean reading;
+	gboolean ready;
+	gboolean unsupported;
+	guint handshake;
+
+	GQueue requests;
+};
+
+static void agent_flush (UccsAgent * agent);
+static void agent_read (UccsAgent * agent);
+static void agent_handshake (UccsAgent * agent);
+
+/**
+ * uccs_agent_new:
+ * @exec: Path to the agent
+ * @uri: UCCS server the agent talks to
+ *
+ * Sets up a persistent agent.  The process itself is only started on
+ * the first query and restarted if it goes away.
+ *
+ * Return value: A new agent, free with uccs_agent_free()
+ */
+UccsAgent *
+uccs_agent_new (const gchar * exec, const gchar * uri)
+{
+	g_return_val_if_fail(exec != NULL, NULL);
+
+	UccsAgent * agent = g_new0(UccsAgent, 1);
+
+	agent->exec = g_strdup(exec);
+	agent->uri = g_strdup(uri);
+	agent->outbuf = g_string_new(NULL);
+	g_queue_init(&agent->requests);
+
+	return agent;
+}
+
+/* Reap an agent that we're no longer interested in */
+static void
+agent_reap_cb (GPid pid, gint RLS_UNUSED status, gpointer RLS_UNUSED user_data)
+{
+	g_spawn_close_pid(pid);
+	return;
+}
+
+/* The line has the password in it */
+static void
+agent_request_free (agent_request_t * request)
+{
+	memset(request->line, 0, request->length);
+	g_free(request->line);
+	g_free(request);
+
+	return;
+}
+
+/* Tell everyone still waiting that they won't get an answer */
+static void
+agent_fail_requests (UccsAgent * agent, const GError * error)
+{
+	/* NOTE: Taking the queue as the callbacks might send new requests
+	   which shouldn't get failed along with these */
+	GQueue requests = agent->requests;
+	g_queue_init(&agent->requests);
+
+	agent_request_t * request;
+	while ((request = g_queue_pop_head(&requests)) != NULL) {
+		if (request->callback != NULL) {
+			request->callback(-1, NULL, 0, error, request->userdata);
+		}
+
+		agent_request_free(request);
+	}
+
+	return;
+}
+
+/* Drop the process and the streams, the next query starts over */
+static void
+agent_stop (UccsAgent * agent, const GError * error)
+{
+	/* Before its stdin gets closed, an old agent would take that as
+	   the end of the password */
+	if (agent->pid != 0) {
+		g_source_remove(agent->watch);
+		kill(agent->pid, SIGTERM);
+		g_child_watch_add(agent->pid, agent_reap_cb, NULL);
+
+		agent->watch = 0;
+		agent->pid = 0;
+	}
+
+	if (agent->cancel != NULL) {
+		g_cancellable_cancel(agent->cancel);
+		g_clear_object(&agent->cancel);
+	}
+
+	if (agent->handshake != 0) {
+		g_source_remove(agent->handshake);
+		agent->handshake = 0;
+	}
+
+	/* Pending operations hold their own references, the pipes get
+	   closed when those are done */
+	g_clear_object(&agent->request_stream);
+	g_clear_object(&agent->reply_stream);
+
+	/* Requests that never made it out, see agent_queue_line() */
+	memset(agent->outbuf->str, 0, agent->outbuf->len);
+	g_string_truncate(agent->outbuf, 0);
+	agent->writing = FALSE;
+	agent->reading = FALSE;
+	agent->ready = FALSE;
+
+	agent_fail_requests(agent, error);
+
+	return;
+}
+
+/* The agent exited on us */
+static void
+agent_exit_cb (GPid pid, gint status, gpointer user_data)
+{
+	UccsAgent * agent = (UccsAgent *)user_data;
+
+	g_debug("Persistent UCCS agent exited with status: %d", status);
+
+	g_spawn_close_pid(pid);
+	agent->pid = 0;
+	agent->watch = 0;
+
+	/* If there are requests outstanding the replies might still be in
+	   the pipe, reading hits the end of it and stops us then */
+	if (g_queue_is_empty(&agent->requests)) {
+		agent_stop(agent, NULL);
+	}
+
+	return;
+}
+
+/* Start the agent process and hook up to its pipes */
+static gboolean
+agent_start (UccsAgent * agent)
+{
+	gint std_in, std_out;
+	GError * error = NULL;
+
+	const gchar * argv[3];
+	argv[0] = agent->exec;
+	argv[1] = UCCS_AGENT_PERSISTENT_ARG;
+	argv[2] = NULL;
+
+	gchar ** envp = g_get_environ();
+	if (agent->uri != NULL) {
+		envp = g_environ_setenv(envp, "SERVER_ROOT", agent->uri, TRUE);
+	}
+	envp = g_environ_setenv(envp, "API_VERSION", UCCS_API_VERSION, TRUE);
+
+	g_spawn_async_with_pipes(NULL, /* pwd */
+	                         (gchar **)argv,
+	                         envp,
+	                         G_SPAWN_DO_NOT_REAP_CHILD,
+	                         NULL, NULL, /* child setup */
+	                         &agent->pid,
+	                         &std_in,
+	                         &std_out,
+	                         NULL, /* stderr */
+	                         &error); /* error */
+
+	g_strfreev(envp);
+
+	if (error != NULL) {
+		g_warning("Unable to start persistent UCCS agent: %s", error->message);
+		g_error_free(error);
+		agent->pid = 0;
+		return FALSE;
+	}
+
+	g_debug("Started persistent UCCS agent for: %s", agent->uri);
+
+	agent->watch = g_child_watch_add(agent->pid, agent_exit_cb, agent);
+	agent->cancel = g_cancellable_new();
+
+	agent->request_stream = g_unix_output_stream_new(std_in, TRUE);
+
+	GInputStream * reply_stream = g_unix_input_stream_new(std_out, TRUE);
+	agent->reply_stream = g_data_input_stream_new(reply_stream);
+	g_data_input_stream_set_newline_type(agent->reply_stream, G_DATA_STREAM_NEWLINE_TYPE_LF);
+	g_object_unref(reply_stream);
+
+	agent_handshake(agent);
+
+	return TRUE;
+}
+
+/* A batch of requests made it to the agent */
+static void
+agent_write_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	agent_write_t * request = (agent_write_t *)user_data;
+	UccsAgent * agent = request->agent;
+	GError * error = NULL;
+
+	g_output_stream_write_all_finish(G_OUTPUT_STREAM(src_obj), res, NULL, &error);
+
+	memset(request->buffer, 0, request->length);
+	g_free(request->buffer);
+	g_free(request);
+
+	if (error != NULL) {
+		/* Cancelled means the agent might be gone, don't touch it */
+		if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_warning("Unable to write to persistent UCCS agent: %s", error->message);
+			agent_stop(agent, error);
+		}
+
+		g_error_free(error);
+		return;
+	}
+
+	agent->writing = FALSE;
+	agent_flush(agent);
+
+	return;
+}
+
+/* Send whatever requests have queued up.  Only one write is in flight
+   at a time, the others wait in the buffer for it to finish. */
+static void
+agent_flush (UccsAgent * agent)
+{
+	if (!agent->ready || agent->writing || agent->request_stream == NULL || agent->outbuf->len == 0) {
+		return;
+	}
+
+	agent_write_t * request = g_new0(agent_write_t, 1);
+
+	request->agent = agent;
+	request->length = agent->outbuf->len;
+	request->buffer = g_string_free(agent->outbuf, FALSE);
+	agent->outbuf = g_string_new(NULL);
+	agent->writing = TRUE;
+
+	g_output_stream_write_all_async(agent->request_stream,
+	                                request->buffer,
+	                                request->length,
+	                                G_PRIORITY_DEFAULT,
+	                                agent->cancel,
+	                                agent_write_cb,
+	                                request);
+
+	return;
+}
+
+/* Got a reply line, hand it to whoever asked first */
+static void
+agent_read_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	GError * error = NULL;
+	gsize length = 0;
+
+	gchar * line = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(src_obj), res, &length, &error);
+
+	/* Cancelled means the agent might be gone, don't touch it */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(error);
+		return;
+	}
+
+	UccsAgent * agent = (UccsAgent *)user_data;
+	agent->reading = FALSE;
+
+	if (line == NULL) {
+		if (error == NULL) {
+			error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CLOSED, "Persistent UCCS agent closed its output");
+		}
+
+		g_warning("Unable to read from persistent UCCS agent: %s", error->message);
+		agent_stop(agent, error);
+		g_error_free(error);
+		return;
+	}
+
+	gchar * data = NULL;
+	gint status = (gint)g_ascii_strtoll(line, &data, 10);
+
+	if (data == line) {
+		g_warning("Persistent UCCS agent reply is missing its status");
+		g_free(line);
+
+		error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Persistent UCCS agent reply is missing its status");
+		agent_stop(agent, error);
+		g_error_free(error);
+		return;
+	}
+
+	agent_request_t * request = g_queue_pop_head(&agent->requests);
+
+	if (request != NULL) {
+		while (*data == ' ') {
+			data++;
+		}
+
+		if (request->callback != NULL) {
+			request->callback(status, data, length - (data - line), NULL, request->userdata);
+		}
+
+		agent_request_free(request);
+	} else {
+		g_warning("Unexpected reply from persistent UCCS agent");
+	}
+
+	g_free(line);
+
+	agent_read(agent);
+
+	return;
+}
+
+/* Wait for the next reply if someone is expecting one */
+static void
+agent_read (UccsAgent * agent)
+{
+	if (!agent->ready || agent->reading || agent->reply_stream == NULL || g_queue_is_empty(&agent->requests)) {
+		return;
+	}
+
+	agent->reading = TRUE;
+	g_data_input_stream_read_line_async(agent->reply_stream,
+	                                    G_PRIORITY_DEFAULT,
+	                                    agent->cancel,
+	                                    agent_read_cb,
+	                                    agent);
+
+	return;
+}
+
+/* Not a persistent agent, failing the requests sends them to a one-shot
+   agent instead */
+static void
+agent_unsupported (UccsAgent * agent)
+{
+	g_warning("UCCS agent '%s' doesn't support " UCCS_AGENT_PERSISTENT_ARG ", not using it anymore", agent->exec);
+
+	agent->unsupported = TRUE;
+
+	GError * error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "UCCS agent doesn't support " UCCS_AGENT_PERSISTENT_ARG);
+	agent_stop(agent, error);
+	g_error_free(error);
+
+	return;
+}
+
+/* Got the first line, only a persistent agent starts with the banner */
+static void
+agent_banner_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	GError * error = NULL;
+
+	gchar * line = g_data_input_stream_read_line_finish(G_DATA_INPUT_STREAM(src_obj), res, NULL, &error);
+
+	/* Cancelled means the agent might be gone, don't touch it */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(error);
+		return;
+	}
+
+	UccsAgent * agent = (UccsAgent *)user_data;
+	agent->reading = FALSE;
+
+	if (agent->handshake != 0) {
+		g_source_remove(agent->handshake);
+		agent->handshake = 0;
+	}
+
+	if (line == NULL) {
+		if (error == NULL) {
+			error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CLOSED, "Persistent UCCS agent closed its output");
+		}
+
+		g_warning("Unable to read from persistent UCCS agent: %s", error->message);
+		agent_stop(agent, error);
+		g_error_free(error);
+		return;
+	}
+
+	gboolean persistent = (g_strcmp0(line, UCCS_AGENT_BANNER) == 0);
+	g_free(line);
+
+	if (!persistent) {
+		agent_unsupported(agent);
+		return;
+	}
+
+	g_debug("Persistent UCCS agent for '%s' is ready", agent->uri);
+
+	agent->ready = TRUE;
+	agent_flush(agent);
+	agent_read(agent);
+
+	return;
+}
+
+/* The agent didn't introduce itself.  An old one is waiting for the
+   password on its stdin, and doesn't get one. */
+static gboolean
+agent_handshake_timeout_cb (gpointer user_data)
+{
+	UccsAgent * agent = (UccsAgent *)user_data;
+
+	agent->handshake = 0;
+	agent_unsupported(agent);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Wait for the banner before sending any requests */
+static void
+agent_handshake (UccsAgent * agent)
+{
+	agent->reading = TRUE;
+	g_data_input_stream_read_line_async(agent->reply_stream,
+	                                    G_PRIORITY_DEFAULT,
+	                                    agent->cancel,
+	                                    agent_banner_cb,
+	                                    agent);
+
+	agent->handshake = g_timeout_add_seconds(UCCS_AGENT_HANDSHAKE_TIMEOUT, agent_handshake_timeout_cb, agent);
+
+	return;
+}
+
+/* Add a request line to the buffer.  When the buffer has to grow the
+   old one is wiped rather than left to realloc() with passwords in it. */
+static void
+agent_queue_line (UccsAgent * agent, const gchar * line, gsize length)
+{
+	GString * outbuf = agent->outbuf;
+
+	if (outbuf->len + length + 1 >= outbuf->allocated_len) {
+		GString * bigger = g_string_sized_new(outbuf->len + length + 2);
+		g_string_append_len(bigger, outbuf->str, outbuf->len);
+
+		memset(outbuf->str, 0, outbuf->len);
+		g_string_free(outbuf, TRUE);
+		agent->outbuf = outbuf = bigger;
+	}
+
+	g_string_append_len(outbuf, line, length);
+	g_string_append_c(outbuf, '\n');
+
+	return;
+}
+
+/**
+ * uccs_agent_query:
+ * @agent: Agent to ask
+ * @username: Username for the UCCS
+ * @password: (allow-none) Password to use
+ * @callback: Function to call with the reply
+ * @user_data: Data for the callback
+ *
+ * Queues a request for the server list of @username, starting the
+ * agent if it isn't running.  @callback is always called exactly once
+ * if this returns TRUE, with an error if the agent went away first.
+ *
+ * Return value: FALSE if the agent couldn't be started or doesn't
+ *   support the persistent mode
+ */
+gboolean
+uccs_agent_query (UccsAgent * agent, const gchar * username, const gchar * password, UccsAgentCallback callback, gpointer user_data)
+{
+	g_return_val_if_fail(agent != NULL, FALSE);
+	g_return_val_if_fail(username != NULL, FALSE);
+
+	if (agent->unsupported) {
+		return FALSE;
+	}
+
+	if (agent->pid == 0) {
+		/* Dead or never started, anything left over from the last one
+		   isn't going to get an answer */
+		GError * error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE, "Persistent UCCS agent exited");
+		agent_stop(agent, error);
+		g_error_free(error);
+
+		if (!agent_start(agent)) {
+			return FALSE;
+		}
+	}
+
+	JsonBuilder * builder = json_builder_new();
+	json_builder_begin_object(builder);
+	json_builder_set_member_name(builder, JSON_USERNAME);
+	json_builder_add_string_value(builder, username);
+	json_builder_set_member_name(builder, JSON_PASSWORD);
+	json_builder_add_string_value(builder, password != NULL ? password : "");
+	json_builder_end_object(builder);
+
+	JsonNode * root = json_builder_get_root(builder);
+	JsonGenerator * generator = json_generator_new();
+	json_generator_set_root(generator, root);
+
+	gsize length = 0;
+	gchar * line = json_generator_to_data(generator, &length);
+
+	agent_queue_line(agent, line, length);
+
+	g_object_unref(generator);
+	json_node_free(root);
+	g_object_unref(builder);
+
+	agent_request_t * request = g_new0(agent_request_t, 1);
+	request->callback = callback;
+	request->userdata = user_data;
+	request->line = line;
+	request->length = length;
+	g_queue_push_tail(&agent->requests, request);
+
+	agent_flush(agent);
+	agent_read(agent);
+
+	return TRUE;
+}
+
+/* The agent is stuck on the first request, which was dropped.  Start
+   a new one and send it the others again. */
+static void
+agent_restart (UccsAgent * agent)
+{
+	GQueue requests = agent->requests;
+	g_queue_init(&agent->requests);
+
+	agent_stop(agent, NULL);
+
+	agent_request_t * request;
+	while ((request = g_queue_pop_head(&requests)) != NULL) {
+		if (request->callback == NULL) {
+			agent_request_free(request);
+			continue;
+		}
+
+		g_queue_push_tail(&agent->requests, request);
+	}
+
+	if (g_queue_is_empty(&agent->requests)) {
+		return;
+	}
+
+	if (!agent_start(agent)) {
+		GError * error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE, "Unable to restart persistent UCCS agent");
+		agent_fail_requests(agent, error);
+		g_error_free(error);
+		return;
+	}
+
+	GList * link;
+	for (link = agent->requests.head; link != NULL; link = link->next) {
+		request = (agent_request_t *)link->data;
+		agent_queue_line(agent, request->line, request->length);
+	}
+
+	agent_flush(agent);
+	agent_read(agent);
+
+	return;
+}
+
+/**
+ * uccs_agent_cancel:
+ * @agent: Agent that was asked
+ * @user_data: Data the query was made with
+ *
+ * Gives up on a query, its callback gets a G_IO_ERROR_CANCELLED error
+ * right away.  If the agent is still working on it, it's restarted
+ * and gets the other queries again.  Otherwise the reply is dropped
+ * when it comes.
+ */
+void
+uccs_agent_cancel (UccsAgent * agent, gpointer user_data)
+{
+	g_return_if_fail(agent != NULL);
+
+	GList * link;
+	for (link = agent->requests.head; link != NULL; link = link->next) {
+		agent_request_t * request = (agent_request_t *)link->data;
+
+		if (request->callback != NULL && request->userdata == user_data) {
+			break;
+		}
+	}
+
+	if (link == NULL) {
+		return;
+	}
+
+	agent_request_t * request = (agent_request_t *)link->data;
+	UccsAgentCallback callback = request->callback;
+
+	/* Stays in the queue so the replies still line up */
+	request->callback = NULL;
+
+	if (link == agent->requests.head) {
+		agent_restart(agent);
+	}
+
+	GError * error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Query to the persistent UCCS agent was cancelled");
+	callback(-1, NULL, 0, error, user_data);
+	g_error_free(error);
+
+	return;
+}
+
+/**
+ * uccs_agent_free:
+ * @agent: Agent to shut down
+ *
+ * Stops the agent process.  Outstanding queries get a
+ * G_IO_ERROR_CANCELLED error.
+ */
+void
+uccs_agent_free (UccsAgent * agent)
+{
+	if (agent == NULL) {
+		return;
+	}
+
+	GError * error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Persistent UCCS agent shut down");
+	agent_stop(agent, error);
+	g_error_free(error);
+
+	g_string_free(agent->outbuf, TRUE);
+	g_free(agent->exec);
+	g_free(agent->uri);
+	g_free(agent);
+
+	return;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright © 2012 Canonical Ltd.
+ * Copyright © 2015 The Arctica Project
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranties of
+ * MERCHANTABILITY, SATISFACTORY QUALITY, or FITNESS FOR A PARTICULAR
+ * PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __UCCS_AGENT_H__
+#define __UCCS_AGENT_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define UCCS_AGENT_PERSISTENT_ARG "--persistent"
+#define UCCS_AGENT_BANNER "UCCS-AGENT persistent/1"
+
+typedef struct _UccsAgent UccsAgent;
+
+/* @status is the status the agent reported for the request, @data its
+   JSON reply.  If @error is set the agent went away before answering. */
+typedef void (*UccsAgentCallback) (gint status, const gchar * data, gsize length, const GError * error, gpointer user_data);
+
+UccsAgent * uccs_agent_new (const gchar * exec, const gchar * uri);
+gboolean uccs_agent_query (UccsAgent * agent, const gchar * username, const gchar * password, UccsAgentCallback callback, gpointer user_data);
+void uccs_agent_cancel (UccsAgent * agent, gpointer user_data);
+void uccs_agent_free (UccsAgent * agent);
+
+G_END_DECLS
+
+#endif
@@ -24,6 +24,7 @@
 
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
 #include <json-glib/json-glib.h>
 
@@ -32,8 +33,12 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/types.h>
 
 #include "uccs-server.h"
+#include "server-probe.h"
+#include "server-table.h"
 #include "defines.h"
 
 #include "rdp-server.h"
@@ -46,25 +51,145 @@ static void uccs_server_init       (UccsServer *self);
 static void uccs_server_dispose    (GObject *object);
 static void uccs_server_finalize   (GObject *object);
 static GVariant *  get_properties        (Server * server);
-static void json_waiters_notify (UccsServer * server, gboolean unlocked);
 static GVariant * get_cached_domains (Server * server);
 static Server * find_uri (Server * server, const gchar * uri);
 static void set_last_used_server (Server * server, const gchar * uri);
 static void nm_state_changed (NMClient *client, const GParamSpec *pspec, gpointer user_data);
 
+typedef struct _UccsSession UccsSession;
+
 typedef struct _json_callback_t json_callback_t;
 struct _json_callback_t {
+	UccsSession * session;
 	gchar * sender;
-	void (*callback) (UccsServer * server, gboolean unlocked, gpointer user_data);
+	guint watch;
+	UccsServerUnlockCallback callback;
 	gpointer userdata;
+	gboolean allowcache;
+};
+
+typedef struct _json_query_t json_query_t;
+struct _json_query_t {
+	UccsServer * server;
+	guint id;
+};
+
+/* What came out of parsing the JSON in the worker thread, @json is
+   the list that was loaded from the cache */
+typedef struct _json_result_t json_result_t;
+struct _json_result_t {
+	gboolean passed;
+	gboolean replace;
+	ServerTable * subservers;
+	GBytes * json;
+};
+
+/* What the worker thread needs to parse the JSON and keep it in the
+   cache, or to load it from there */
+typedef struct _json_task_t json_task_t;
+struct _json_task_t {
+	GBytes * data;
+	gchar * cache_path;
+	gchar * password;
+};
+
+/* Everything about one user that is logging in through us, so that
+   different users don't get in each other's way */
+struct _UccsSession {
+	UccsServer * server;
+
+	gchar * username;
+	gchar * password;
+	gboolean valid;
+
+	GHashTable * lovers;
+
+	ServerTable * subservers;
+	gboolean cached;
+	GBytes * json_last;
+	guint refresh_timer;
+	ServerProbe * probe;
+
+	GKeyFile * last_used;
+	gint64 last_used_mtime;
+	goffset last_used_size;
+	gboolean last_used_dirty;
+	guint last_used_timer;
+	guint last_used_write;
+
+	GList * json_waiters;
+	guint json_watch;
+	GPid json_pid;
+	guint json_query;
+	/* The query the persistent agent has, for uccs_agent_cancel() */
+	gpointer json_agent;
+	gboolean json_native;
+	guint json_deadline;
+
+	GCancellable * json_cancel;
+	SoupMessage * json_message;
+	GBytes * json_data;
+	gint json_status;
+	GOutputStream * pass_stream;
 };
 
+static void json_waiters_notify (UccsSession * session, gboolean unlocked, const GError * error);
+static void refresh_schedule (UccsSession * session);
+static void session_probe_servers (UccsSession * session);
+static void session_last_used_save (UccsSession * session);
+static void session_record_health (UccsSession * session, const gchar * name, gboolean success);
+static void cache_json_save (const gchar * path, const gchar * password, GBytes * data);
+static void fetch_json (UccsSession * session);
+static guint json_query_new_id (void);
+
+/* Seconds an agent run or a broker request gets before we give up on
+   it, unless the config file says otherwise */
+#define UCCS_TIMEOUT_DEFAULT 120
+
+/* How much the history, the latency and being the last used one count
+   in the score of a server, out of 100, and how much each result moves
+   the history */
+#define RANK_WEIGHT_HEALTH 50
+#define RANK_WEIGHT_LATENCY 30
+#define RANK_WEIGHT_LAST_USED 20
+#define RANK_HEALTH_ALPHA 0.3
+
+/* How long we wait for more SetLastUsedServer calls before writing */
+#define LAST_USED_WRITE_DELAY 500
+
+/* Identifies queries sent to persistent agents or over HTTP */
+static guint json_query_id = 0;
+
 G_DEFINE_TYPE (UccsServer, uccs_server, SERVER_TYPE);
 
 /* Static global client so we don't keep reallocating them.  We only need
    one really */
 static NMClient * global_client = NULL;
 
+/* Same for the HTTP session, sharing it lets brokers on the same host
+   share connections too */
+static SoupSession * global_session = NULL;
+
+/* Seconds between checks that the broker is still there, and how long
+   one gets.  A broker that failed is retried sooner, backing off up to
+   the maximum. */
+#define UCCS_PROBE_INTERVAL_DEFAULT 60
+#define UCCS_PROBE_TIMEOUT 10
+#define UCCS_PROBE_RETRY_MIN 5
+#define UCCS_PROBE_RETRY_MAX 300
+
+/* How many of a user's servers get probed at the same time, and the
+   seconds each one gets to answer */
+#define UCCS_PROBE_SERVERS_MAX 16
+#define UCCS_PROBE_SERVERS_TIMEOUT 5
+
+/* Connections the HTTP session keeps open, in total and to each host */
+#define UCCS_HTTP_MAX_CONNS 16
+#define UCCS_HTTP_MAX_CONNS_PER_HOST 4
+
+/* The properties are the same for every UCCS server */
+static GVariant * uccs_properties = NULL;
+
 static void
 uccs_server_class_init (UccsServerClass *klass)
 {
@@ -75,6 +200,7 @@ uccs_server_class_init (UccsServerClass *klass)
 
 	ServerClass * server_class = SERVER_CLASS(klass);
 
+	server_class->protocol = "uccs";
 	server_class->get_properties = get_properties;
 	/* UCCS can't have applications */
 	server_class->get_applications = NULL;
@@ -82,27 +208,37 @@ uccs_server_class_init (UccsServerClass *klass)
 	server_class->find_uri = find_uri;
 	server_class->set_last_used_server = set_last_used_server;
 
+	GVariantBuilder propbuilder;
+	g_variant_builder_init(&propbuilder, G_VARIANT_TYPE_ARRAY);
+	g_variant_builder_add_value(&propbuilder, server_property_new("email", TRUE, NULL));
+	g_variant_builder_add_value(&propbuilder, server_property_new("password", TRUE, NULL));
+	uccs_properties = g_variant_ref_sink(g_variant_builder_end(&propbuilder));
+
 	return;
 }
 
+/* Free a session, telling those who had it that it's gone */
+static void session_free (gpointer data);
+
 static void
 uccs_server_init (UccsServer *self)
 {
 	self->exec = g_find_program_in_path(UCCS_QUERY_TOOL);
-
-	self->username = NULL;
-	self->password = NULL;
-
-	self->lovers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-	self->subservers = NULL;
-
-	self->json_waiters = NULL;
-	self->json_watch = 0;
-	self->json_pid = 0;
-
-	self->json_stream = NULL;
-	self->pass_stream = NULL;
+	self->persistent = FALSE;
+	self->agent = NULL;
+	self->native = FALSE;
+
+	/* Sessions own their username, which is the key */
+	self->sessions = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, session_free);
+	self->senders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	self->refresh_interval = 0;
+	self->timeout = UCCS_TIMEOUT_DEFAULT;
+	self->probe_servers = FALSE;
+	self->rank_servers = FALSE;
+	self->resolve_servers = FALSE;
+	self->resolve = NULL;
+	self->last_used_writes = 0;
 
 	self->min_network = NM_STATE_CONNECTED_GLOBAL;
 	self->last_network = NM_STATE_DISCONNECTED;
@@ -133,10 +269,27 @@ uccs_server_init (UccsServer *self)
 
 	self->verify_server = TRUE;
 	self->verified_server = FALSE;
+	self->verify_message = NULL;
+	self->probe_interval = UCCS_PROBE_INTERVAL_DEFAULT;
+	self->probe_timer = 0;
+	self->probe_failures = 0;
+	self->probe_start = 0;
+	self->latency = -1;
 	self->session = NULL;
 
 	/* Need the soup session before the state changed */
-	self->session = soup_session_new();
+	if (global_session == NULL) {
+		global_session = soup_session_new_with_options(SOUP_SESSION_MAX_CONNS, UCCS_HTTP_MAX_CONNS,
+		                                               SOUP_SESSION_MAX_CONNS_PER_HOST, UCCS_HTTP_MAX_CONNS_PER_HOST,
+		                                               NULL);
+		g_object_add_weak_pointer(G_OBJECT(global_session), (gpointer *)&global_session);
+		self->session = global_session;
+	} else {
+		self->session = g_object_ref(global_session);
+	}
+
+	/* Cancels our requests on the shared session, and only ours */
+	self->cancel = g_cancellable_new();
 
 	nm_state_changed(self->nm_client, NULL, self);
 	uccs_notify_state_change(self);
@@ -159,8 +312,7 @@ uccs_notify_state_change (UccsServer * server)
 		tempstate = SERVER_STATE_UNAVAILABLE;
 	}
 
-	if (tempstate != server->parent.state) {
-		server->parent.state = tempstate;
+	if (server_set_state(SERVER(server), tempstate)) {
 		g_signal_emit_by_name(server, SERVER_SIGNAL_STATE_CHANGED, server->parent.state);
 	}
 
@@ -183,7 +335,7 @@ clear_hash_helper (gpointer key, gpointer RLS_UNUSED value, gpointer user_data)
 	                              (const gchar *)key, /* dest */
 	                              "/org/ArcticaProject/RemoteLogon", /* object path */
 	                              "org.ArcticaProject.RemoteLogon", /* interface name */
-	                              "org.ArcticaProject.RemoteLogon.LoginChanged", /* signal name */
+	                              "LoginChanged", /* signal name */
 	                              helper->params, /* params */
 	                              &error);
 
@@ -197,58 +349,245 @@ clear_hash_helper (gpointer key, gpointer RLS_UNUSED value, gpointer user_data)
 
 /* Clear the hash table by going through it and signaling */
 static void
-clear_hash (UccsServer * server)
+clear_hash (UccsSession * session)
 {
-	if (g_hash_table_size(server->lovers) == 0) {
+	if (g_hash_table_size(session->lovers) == 0) {
 		return;
 	}
 
+	UccsServer * server = session->server;
+
 	g_return_if_fail(server->parent.uri != NULL);
-	g_return_if_fail(server->username != NULL);
+	g_return_if_fail(session->username != NULL);
+
+	/* They're not logged in as this user anymore */
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, session->lovers);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (g_hash_table_lookup(server->senders, key) == session) {
+			g_hash_table_remove(server->senders, key);
+		}
+	}
 
-	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL); /* Shouldn't block, we should have it */
-	GVariant * param = g_variant_new("(ss)", server->parent.uri, server->username); /* params */
+	GDBusConnection * bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL); /* Shouldn't block, we should have it */
+	GVariant * param = g_variant_new("(ss)", server->parent.uri, session->username); /* params */
 	g_variant_ref_sink(param);
 
 	struct _hash_helper helper;
 	helper.params = param;
-	helper.session = session;
+	helper.session = bus;
 
-	g_hash_table_foreach_remove(server->lovers, clear_hash_helper, &helper);
+	g_hash_table_foreach_remove(session->lovers, clear_hash_helper, &helper);
 
-	g_object_unref(session);
+	g_object_unref(bus);
 	g_variant_unref(param);
 
 	return;
 }
 
+/* Collect the one-shot agent once it's gone, nobody wants its answer */
+static void
+json_reap_cb (GPid pid, gint RLS_UNUSED status, gpointer RLS_UNUSED user_data)
+{
+	g_spawn_close_pid(pid);
+	return;
+}
+
+/* Stop getting the JSON, killing the agent if it's still running */
+static void
+json_stop (UccsSession * session)
+{
+	if (session->json_deadline != 0) {
+		g_source_remove(session->json_deadline);
+		session->json_deadline = 0;
+	}
+
+	if (session->json_watch != 0) {
+		g_source_remove(session->json_watch);
+		session->json_watch = 0;
+	}
+
+	if (session->json_pid != 0) {
+		kill(session->json_pid, SIGKILL);
+		g_child_watch_add(session->json_pid, json_reap_cb, NULL);
+		session->json_pid = 0;
+	}
+
+	/* The agent or broker still answers, but nobody's listening anymore */
+	session->json_query = 0;
+	session->json_agent = NULL;
+	session->json_native = FALSE;
+
+	if (session->json_cancel != NULL) {
+		g_cancellable_cancel(session->json_cancel);
+		g_clear_object(&session->json_cancel);
+	}
+
+	g_clear_object(&session->json_message);
+
+	g_clear_pointer(&session->json_data, g_bytes_unref);
+
+	if (session->pass_stream != NULL) {
+		g_output_stream_close(session->pass_stream, NULL, NULL);
+		g_object_unref(session->pass_stream);
+		session->pass_stream = NULL;
+	}
+
+	return;
+}
+
 /* Clear the JSON task and waiters */
 static void
-clear_json (UccsServer * self)
+clear_json (UccsSession * session)
+{
+	if (session->refresh_timer != 0) {
+		g_source_remove(session->refresh_timer);
+		session->refresh_timer = 0;
+	}
+
+	json_stop(session);
+	json_waiters_notify(session, FALSE, NULL);
+
+	return;
+}
+
+/* Forget the password, wiping it from memory */
+static void
+session_clear_password (UccsSession * session)
+{
+	if (session->password != NULL) {
+		memset(session->password, 0, strlen(session->password));
+		g_clear_pointer(&session->password, g_free);
+	}
+
+	return;
+}
+
+/* Start a session for @username */
+static UccsSession *
+session_new (UccsServer * server, const gchar * username, const gchar * password)
+{
+	UccsSession * session = g_new0(UccsSession, 1);
+
+	session->server = server;
+	session->username = g_strdup(username);
+	session->password = g_strdup(password);
+	session->valid = TRUE;
+
+	session->lovers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	session->subservers = NULL;
+	session->cached = FALSE;
+	session->json_last = NULL;
+	session->refresh_timer = 0;
+	session->probe = NULL;
+
+	session->last_used = NULL;
+	session->last_used_mtime = 0;
+	session->last_used_size = 0;
+	session->last_used_dirty = FALSE;
+	session->last_used_timer = 0;
+	session->last_used_write = 0;
+
+	session->json_waiters = NULL;
+	session->json_watch = 0;
+	session->json_pid = 0;
+	session->json_query = 0;
+	session->json_agent = NULL;
+	session->json_native = FALSE;
+	session->json_deadline = 0;
+
+	session->json_cancel = NULL;
+	session->json_message = NULL;
+	session->json_data = NULL;
+	session->json_status = 0;
+	session->pass_stream = NULL;
+
+	return session;
+}
+
+static void
+session_free (gpointer data)
+{
+	UccsSession * session = (UccsSession *)data;
+
+	clear_json(session);
+	clear_hash(session);
+
+	g_clear_pointer(&session->probe, server_probe_free);
+	session_last_used_save(session);
+
+	g_hash_table_unref(session->lovers);
+
+	g_clear_pointer(&session->subservers, server_table_free);
+	g_clear_pointer(&session->json_last, g_bytes_unref);
+	g_clear_pointer(&session->last_used, g_key_file_free);
+
+	session_clear_password(session);
+	g_free(session->username);
+
+	g_free(session);
+
+	return;
+}
+
+/* Find the session that's waiting for query @id, none if the query
+   is no longer interesting */
+static UccsSession *
+session_find_query (UccsServer * server, guint id)
 {
-	if (self->json_watch != 0) {
-		g_source_remove(self->json_watch);
-		self->json_watch = 0;
+	if (id == 0) {
+		return NULL;
+	}
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, server->sessions);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		UccsSession * session = (UccsSession *)value;
+
+		if (session->json_query == id) {
+			return session;
+		}
 	}
 
-	if (self->json_pid != 0) {
-		g_spawn_close_pid(self->json_pid);
-		self->json_pid = 0;
+	return NULL;
+}
+
+/* @address is now logged in as the user of @session, and no longer
+   as anyone else */
+static void
+session_add_lover (UccsSession * session, const gchar * address)
+{
+	UccsServer * server = session->server;
+	UccsSession * old = g_hash_table_lookup(server->senders, address);
+
+	if (old != NULL && old != session) {
+		g_hash_table_remove(old->lovers, address);
 	}
 
-	if (self->json_stream != NULL) {
-		g_input_stream_close(self->json_stream, NULL, NULL);
-		g_object_unref(self->json_stream);
-		self->json_stream = NULL;
+	g_hash_table_insert(session->lovers, g_strdup(address), GINT_TO_POINTER(TRUE));
+	g_hash_table_insert(server->senders, g_strdup(address), session);
+
+	return;
+}
+
+/* Drop a session whose credentials didn't work out, unless someone is
+   still using the list they got before */
+static void
+session_check_unused (UccsSession * session)
+{
+	if (session->valid || g_hash_table_size(session->lovers) != 0 || session->json_waiters != NULL) {
+		return;
 	}
 
-	if (self->pass_stream != NULL) {
-		g_output_stream_close(self->pass_stream, NULL, NULL);
-		g_object_unref(self->pass_stream);
-		self->pass_stream = NULL;
+	if (session->json_pid != 0 || session->json_query != 0) {
+		return;
 	}
 
-	json_waiters_notify(self, FALSE);
+	g_hash_table_remove(session->server->sessions, session->username);
 
 	return;
 }
@@ -259,6 +598,24 @@ uccs_server_dispose (GObject *object)
 {
 	UccsServer * self = UCCS_SERVER(object);
 
+	/* Cancels their fetches */
+	if (self->sessions != NULL) {
+		g_hash_table_remove_all(self->sessions);
+	}
+	g_clear_pointer(&self->agent, uccs_agent_free);
+
+	if (self->cancel != NULL) {
+		g_cancellable_cancel(self->cancel);
+		g_clear_object(&self->cancel);
+	}
+
+	if (self->probe_timer != 0) {
+		g_source_remove(self->probe_timer);
+		self->probe_timer = 0;
+	}
+
+	g_clear_pointer(&self->resolve, server_probe_free);
+	g_clear_object(&self->verify_message);
 	g_clear_object(&self->session);
 
 	if (self->nm_signal != 0) {
@@ -268,16 +625,6 @@ uccs_server_dispose (GObject *object)
 
 	g_clear_object(&self->nm_client);
 
-	clear_json(self);
-
-	if (self->lovers != NULL) {
-		clear_hash(self);
-	}
-
-	g_list_free_full(self->subservers, g_object_unref);
-	self->subservers = NULL; /* Ironically the free function is the only GList
-	                      function that doesn't return a new pointer by itself */
-
 	G_OBJECT_CLASS (uccs_server_parent_class)->dispose (object);
 	return;
 }
@@ -289,35 +636,182 @@ uccs_server_finalize (GObject *object)
 	UccsServer * self = UCCS_SERVER(object);
 
 	g_free(self->exec); self->exec = NULL;
-	g_free(self->username); self->username = NULL;
-	g_free(self->password); self->password = NULL;
 
-	if (self->lovers != NULL) {
-		g_hash_table_unref(self->lovers);
-		self->lovers = NULL;
-	}
+	g_clear_pointer(&self->sessions, g_hash_table_unref);
+	g_clear_pointer(&self->senders, g_hash_table_unref);
 
 	G_OBJECT_CLASS (uccs_server_parent_class)->finalize (object);
 	return;
 }
 
-/* Callback from the message getting complete */
+static void verify_server (UccsServer * server);
+
+/* Look up the broker's host so that the greeter gets its addresses,
+   the cache makes this cheap when it was just done */
 static void
-verify_server_cb (SoupSession RLS_UNUSED *session, SoupMessage *message, gpointer user_data)
+resolve_broker (UccsServer * server)
+{
+	if (!server->resolve_servers || server->parent.uri == NULL) {
+		return;
+	}
+
+	if (server->resolve == NULL) {
+		server->resolve = server_probe_new(SERVER_PROBE_RESOLVE, 1, UCCS_PROBE_SERVERS_TIMEOUT, NULL, NULL);
+	}
+
+	GPtrArray * broker = g_ptr_array_new();
+	g_ptr_array_add(broker, server);
+	server_probe_start(server->resolve, broker);
+	g_ptr_array_unref(broker);
+
+	return;
+}
+
+/* Time for the next check on the broker */
+static gboolean
+probe_cb (gpointer user_data)
 {
 	UccsServer * server = UCCS_SERVER(user_data);
-	guint statuscode = 404;
 
-	g_object_get(G_OBJECT(message), SOUP_MESSAGE_STATUS_CODE, &statuscode, NULL);
-	g_debug("Verification came back with status: %d", statuscode);
+	server->probe_timer = 0;
+	verify_server(server);
+
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * uccs_server_probe_delay:
+ * @server: Server to check the broker of
+ *
+ * Works out how long to wait before checking the broker again: the
+ * ProbeInterval while it answers, sooner if it failed but backing off
+ * each time it fails again, up to five minutes or the ProbeInterval if
+ * that's longer.  Some jitter keeps servers that failed
+ * together from all coming back at once.
+ *
+ * Return value: The delay in milliseconds
+ */
+guint
+uccs_server_probe_delay (UccsServer * server)
+{
+	g_return_val_if_fail(IS_UCCS_SERVER(server), 0);
+
+	guint64 delay = server->probe_interval;
+
+	/* Never backing off to longer than the interval, unless that's
+	   shorter than the longest backoff */
+	if (server->probe_failures > 0) {
+		guint shift = MIN(server->probe_failures - 1, 32);
+		delay = MIN((guint64)UCCS_PROBE_RETRY_MIN << shift, MAX(server->probe_interval, UCCS_PROBE_RETRY_MAX));
+	}
+
+	/* A long ProbeInterval doesn't fit in a guint of milliseconds */
+	gint64 delay_ms = (gint64)delay * 1000;
+	gdouble jitter = delay_ms / 5;
+	delay_ms += (gint64)g_random_double_range(-jitter, jitter);
+
+	return (guint)CLAMP(delay_ms, 0, G_MAXUINT);
+}
+
+/* Check the broker again later */
+static void
+probe_schedule (UccsServer * server)
+{
+	if (server->probe_interval == 0 || server->probe_timer != 0 || server->verify_message != NULL) {
+		return;
+	}
+
+	if (!server->verify_server || server->last_network != NM_STATE_CONNECTED_GLOBAL) {
+		return;
+	}
+
+	server->probe_timer = g_timeout_add(uccs_server_probe_delay(server), probe_cb, server);
+
+	return;
+}
 
-	if (statuscode == 200) {
+/* We know how the broker is doing */
+static void
+probe_done (UccsServer * server, guint statuscode)
+{
+	if (statuscode == SOUP_STATUS_OK) {
 		server->verified_server = TRUE;
+		server->probe_failures = 0;
+		server->latency = g_get_monotonic_time() - server->probe_start;
+		g_debug("Broker '%s' answered in %" G_GINT64_FORMAT " us", server->parent.uri, server->latency);
 	} else {
 		server->verified_server = FALSE;
+		server->probe_failures++;
+		server->latency = -1;
 	}
 
 	uccs_notify_state_change(server);
+	probe_schedule(server);
+
+	return;
+}
+
+/* The broker took too long to answer the check */
+static gboolean
+probe_timeout_cb (gpointer user_data)
+{
+	UccsServer * server = UCCS_SERVER(user_data);
+
+	server->probe_timer = 0;
+	g_debug("Verification of '%s' timed out", server->parent.uri);
+
+	/* The callback leaves it alone as it's cancelled */
+	soup_session_cancel_message(server->session, server->verify_message, SOUP_STATUS_CANCELLED);
+	g_clear_object(&server->verify_message);
+
+	probe_done(server, SOUP_STATUS_REQUEST_TIMEOUT);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Callback from the message getting complete */
+static void
+verify_server_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	GError * error = NULL;
+	GInputStream * stream = soup_session_send_finish(SOUP_SESSION(src_obj), res, &error);
+
+	/* Cancelled means the server might be gone, don't touch it */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(error);
+		return;
+	}
+
+	UccsServer * server = UCCS_SERVER(user_data);
+	guint statuscode = 404;
+
+	/* Already gave up on it */
+	if (server->verify_message == NULL) {
+		g_clear_error(&error);
+		g_clear_object(&stream);
+		return;
+	}
+
+	if (error != NULL) {
+		g_debug("Verification failed: %s", error->message);
+		g_error_free(error);
+	} else {
+		/* Nothing to read from a HEAD */
+		g_input_stream_close(stream, NULL, NULL);
+		g_object_unref(stream);
+
+		g_object_get(G_OBJECT(server->verify_message), SOUP_MESSAGE_STATUS_CODE, &statuscode, NULL);
+		g_debug("Verification came back with status: %d", statuscode);
+	}
+
+	g_clear_object(&server->verify_message);
+
+	if (server->probe_timer != 0) {
+		g_source_remove(server->probe_timer);
+		server->probe_timer = 0;
+	}
+
+	probe_done(server, statuscode);
 
 	return;
 }
@@ -328,17 +822,81 @@ verify_server (UccsServer * server)
 {
 	g_return_if_fail(server->session != NULL);
 
-	if (server->parent.uri == NULL) {
+	if (server->parent.uri == NULL || server->verify_message != NULL) {
 		return;
 	}
 
-	SoupMessage * message = soup_message_new("HEAD", server->parent.uri);
-	soup_session_queue_message(server->session, message, verify_server_cb, server);
+	if (server->probe_timer != 0) {
+		g_source_remove(server->probe_timer);
+		server->probe_timer = 0;
+	}
+
+	server->verify_message = soup_message_new("HEAD", server->parent.uri);
+
+	if (server->verify_message == NULL) {
+		g_warning("Unable to build verification request for: %s", server->parent.uri);
+		return;
+	}
+
+	resolve_broker(server);
+
+	server->probe_start = g_get_monotonic_time();
+	soup_session_send_async(server->session, server->verify_message, server->cancel, verify_server_cb, server);
+	server->probe_timer = g_timeout_add_seconds(UCCS_PROBE_TIMEOUT, probe_timeout_cb, server);
 	g_debug("Getting HEAD from: %s", server->parent.uri);
 
 	return;
 }
 
+/* Cancel everything we've got going on the HTTP session, the
+   fetches that were waiting on it didn't work */
+static void
+http_cancel (UccsServer * server)
+{
+	g_cancellable_cancel(server->cancel);
+	g_object_unref(server->cancel);
+	server->cancel = g_cancellable_new();
+
+	g_clear_object(&server->verify_message);
+
+	/* Starting over when the network is back */
+	if (server->probe_timer != 0) {
+		g_source_remove(server->probe_timer);
+		server->probe_timer = 0;
+	}
+
+	server->probe_failures = 0;
+	server->latency = -1;
+
+	/* Telling the waiters might start new sessions, don't do it
+	   while walking them */
+	GList * fetching = NULL;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, server->sessions);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		UccsSession * session = (UccsSession *)value;
+
+		if (session->json_native) {
+			fetching = g_list_prepend(fetching, session);
+		}
+	}
+
+	GList * lsession;
+	for (lsession = fetching; lsession != NULL; lsession = g_list_next(lsession)) {
+		UccsSession * session = (UccsSession *)lsession->data;
+
+		json_stop(session);
+		json_waiters_notify(session, FALSE, NULL);
+		refresh_schedule(session);
+	}
+
+	g_list_free(fetching);
+
+	return;
+}
+
 /* Callback for when the Network Manger state changes */
 static void
 nm_state_changed (NMClient RLS_UNUSED *client, const GParamSpec RLS_UNUSED *pspec, gpointer user_data)
@@ -354,11 +912,17 @@ nm_state_changed (NMClient RLS_UNUSED *client, const GParamSpec RLS_UNUSED *pspe
 
 	if (server->last_network == NM_STATE_DISCONNECTED) {
 		server->verified_server = FALSE;
-		soup_session_abort(server->session);
+		http_cancel(server);
+		/* The next network might well have other name servers */
+		server_probe_forget();
 	}
 
-	if (server->last_network == NM_STATE_CONNECTED_GLOBAL && server->verify_server && !server->verified_server) {
-		verify_server(server);
+	if (server->last_network == NM_STATE_CONNECTED_GLOBAL && server->verify_server) {
+		if (!server->verified_server) {
+			verify_server(server);
+		} else {
+			probe_schedule(server);
+		}
 	}
 
 	uccs_notify_state_change(server);
@@ -370,26 +934,7 @@ nm_state_changed (NMClient RLS_UNUSED *client, const GParamSpec RLS_UNUSED *pspe
 static GVariant *
 get_properties (Server RLS_UNUSED *server)
 {
-	GVariantBuilder propbuilder;
-	g_variant_builder_init(&propbuilder, G_VARIANT_TYPE_ARRAY);
-
-	GVariantBuilder namebuilder;
-	g_variant_builder_init(&namebuilder, G_VARIANT_TYPE_TUPLE);
-	g_variant_builder_add_value(&namebuilder, g_variant_new_string("email"));
-	g_variant_builder_add_value(&namebuilder, g_variant_new_boolean(TRUE));
-	g_variant_builder_add_value(&namebuilder, g_variant_new_variant(g_variant_new_string("")));
-	g_variant_builder_add_value(&namebuilder, g_variant_parse(G_VARIANT_TYPE_VARDICT, "{}", NULL, NULL, NULL));
-	g_variant_builder_add_value(&propbuilder, g_variant_builder_end(&namebuilder));
-
-	GVariantBuilder passbuilder;
-	g_variant_builder_init(&passbuilder, G_VARIANT_TYPE_TUPLE);
-	g_variant_builder_add_value(&passbuilder, g_variant_new_string("password"));
-	g_variant_builder_add_value(&passbuilder, g_variant_new_boolean(TRUE));
-	g_variant_builder_add_value(&passbuilder, g_variant_new_variant(g_variant_new_string("")));
-	g_variant_builder_add_value(&passbuilder, g_variant_parse(G_VARIANT_TYPE_VARDICT, "{}", NULL, NULL, NULL));
-	g_variant_builder_add_value(&propbuilder, g_variant_builder_end(&passbuilder));
-
-	return g_variant_builder_end(&propbuilder);
+	return g_variant_ref(uccs_properties);
 }
 
 /* Set the exec value for the server */
@@ -398,6 +943,19 @@ uccs_server_set_exec (UccsServer * server, const gchar * exec)
 {
 	g_return_val_if_fail(IS_UCCS_SERVER(server), NULL);
 
+	/* A running agent is the old program */
+	if (server->agent != NULL) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, server->sessions);
+
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			clear_json((UccsSession *)value);
+		}
+
+		g_clear_pointer(&server->agent, uccs_agent_free);
+	}
+
 	g_clear_pointer(&server->exec, g_free);
 	server->exec = g_find_program_in_path(exec);
 
@@ -424,12 +982,14 @@ uccs_server_new_from_keyfile (GKeyFile * keyfile, const gchar * groupname)
 
 	if (g_key_file_has_key(keyfile, groupname, CONFIG_SERVER_NAME, NULL)) {
 		gchar * keyname = g_key_file_get_string(keyfile, groupname, CONFIG_SERVER_NAME, NULL);
-		server->parent.name = g_strdup(_(keyname));
+		server->parent.name = g_intern_string(_(keyname));
 		g_free(keyname);
 	}
 
 	if (g_key_file_has_key(keyfile, groupname, CONFIG_SERVER_URI, NULL)) {
-		server->parent.uri = g_key_file_get_string(keyfile, groupname, CONFIG_SERVER_URI, NULL);
+		gchar * uri = g_key_file_get_string(keyfile, groupname, CONFIG_SERVER_URI, NULL);
+		server->parent.uri = g_intern_string(uri);
+		g_free(uri);
 	}
 
 	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_EXEC, NULL)) {
@@ -438,6 +998,14 @@ uccs_server_new_from_keyfile (GKeyFile * keyfile, const gchar * groupname)
 		g_free(key);
 	}
 
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_PERSISTENT, NULL)) {
+		server->persistent = g_key_file_get_boolean(keyfile, groupname, CONFIG_UCCS_PERSISTENT, NULL);
+	}
+
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_NATIVE, NULL)) {
+		server->native = g_key_file_get_boolean(keyfile, groupname, CONFIG_UCCS_NATIVE, NULL);
+	}
+
 	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_NETWORK, NULL)) {
 		gchar * key = g_key_file_get_string(keyfile, groupname, CONFIG_UCCS_NETWORK, NULL);
 
@@ -457,321 +1025,1690 @@ uccs_server_new_from_keyfile (GKeyFile * keyfile, const gchar * groupname)
 		server->verify_server = g_key_file_get_boolean(keyfile, groupname, CONFIG_UCCS_VERIFY, NULL);
 	}
 
-	nm_state_changed(server->nm_client, NULL, server);
-	uccs_notify_state_change(server);
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_PROBE_SERVERS, NULL)) {
+		server->probe_servers = g_key_file_get_boolean(keyfile, groupname, CONFIG_UCCS_PROBE_SERVERS, NULL);
+	}
 
-	return SERVER(server);
-}
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_RANK, NULL)) {
+		server->rank_servers = g_key_file_get_boolean(keyfile, groupname, CONFIG_UCCS_RANK, NULL);
+	}
 
-/* Look at the array of RLS data and build a server for each entry
-   in the array */
-static gboolean
-parse_rds_array (UccsServer * server, JsonArray * array)
-{
-	// Got a new set of servers, delete the old one
-	g_list_free_full(server->subservers, g_object_unref);
-	server->subservers = NULL;
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_RESOLVE, NULL)) {
+		server->resolve_servers = g_key_file_get_boolean(keyfile, groupname, CONFIG_UCCS_RESOLVE, NULL);
+	}
 
-	guint i;
-	for (i = 0; i < json_array_get_length(array); i++) {
-		JsonNode * node = json_array_get_element(array, i);
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_PROBE, NULL)) {
+		gint interval = g_key_file_get_integer(keyfile, groupname, CONFIG_UCCS_PROBE, NULL);
+		server->probe_interval = MAX(interval, 0);
+	}
 
-		if (JSON_NODE_TYPE(node) != JSON_NODE_OBJECT) {
-			continue;
-		}
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_REFRESH, NULL)) {
+		gint interval = g_key_file_get_integer(keyfile, groupname, CONFIG_UCCS_REFRESH, NULL);
+		server->refresh_interval = MAX(interval, 0);
+	}
 
-		JsonObject * object = json_node_get_object(node);
-		Server * newserver = server_new_from_json(object);
-		if (newserver != NULL) {
-			server->subservers = g_list_append(server->subservers, newserver);
-		}
+	if (g_key_file_has_key(keyfile, groupname, CONFIG_UCCS_TIMEOUT, NULL)) {
+		gint timeout = g_key_file_get_integer(keyfile, groupname, CONFIG_UCCS_TIMEOUT, NULL);
+		server->timeout = MAX(timeout, 0);
 	}
 
-	return TRUE;
+	nm_state_changed(server->nm_client, NULL, server);
+	uccs_notify_state_change(server);
+
+	return SERVER(server);
 }
 
-/* Parse the JSON content and allocate servers based on that */
+/* Look at the root of the JSON data and allocate servers based on that.
+   Runs in a worker thread, so it only touches @result. */
 static gboolean
-parse_json (UccsServer * server, GInputStream * json)
+parse_json_root (JsonNode * root_node, json_result_t * result)
 {
-	if (json == NULL) return FALSE; /* Shouldn't happen, but let's just handle it */
-
 	gboolean passed = TRUE;
-	JsonParser * parser = json_parser_new();
+
+#if 0
+	JsonGenerator * gen = json_generator_new();
+	json_generator_set_root(gen, root_node);
+	gchar * data = json_generator_to_data(gen, NULL);
+	g_debug("%s", data);
+	g_free(data);
+	g_object_unref(G_OBJECT(gen));
+#endif
+
+	/* Make sure we have a sane root node */
+	if (root_node != NULL && JSON_NODE_TYPE(root_node) != JSON_NODE_OBJECT) {
+		g_warning("Root node of JSON data is not an object.  It is: %s", json_node_type_name(root_node));
+		return FALSE;
+	}
+
+	/* Take our object and see if it has the property that we need */
+	JsonObject * root_object = NULL;
+	if (root_node != NULL) {
+		root_object = json_node_get_object(root_node);
+	}
+	if (root_object != NULL && json_object_has_member(root_object, "RemoteDesktopServers")) {
+		/* This shows that we have some.  It's okay if there aren't any.  Seems
+		   a bit silly, but we're not bitching too much. */
+		JsonNode * rds_node = json_object_get_member(root_object, "RemoteDesktopServers");
+		if (JSON_NODE_TYPE(rds_node) == JSON_NODE_ARRAY) {
+			JsonArray * rds_array = json_node_get_array(rds_node);
+			result->subservers = server_table_new_from_json(rds_array);
+			result->replace = TRUE;
+		} else {
+			/* Okay we're a little bit angrier about this one */
+			g_warning("Malformed 'RemoteDesktopServer' entry.  Not an array but a: %s", json_node_type_name(rds_node));
+			passed = FALSE;
+		}
+
+		if (json_object_has_member(root_object, "DefaultServer")) {
+			JsonNode * ds_node = json_object_get_member(root_object, "DefaultServer");
+			if (JSON_NODE_TYPE(ds_node) == JSON_NODE_VALUE && json_node_get_value_type(ds_node) == G_TYPE_STRING) {
+				const gchar * default_server_name = json_node_get_string(ds_node);
+				if (default_server_name != NULL) {
+					gint found = -1;
+					if (result->subservers != NULL) {
+						found = server_table_find_name(result->subservers, default_server_name);
+					}
+					if (found >= 0) {
+						server_table_set_last_used(result->subservers, found, TRUE);
+					} else if (strlen(default_server_name) > 0) {
+						g_warning("Could not find the 'DefaultServer' server.");
+						passed = FALSE;
+					}
+				}
+			} else {
+				g_warning("Malformed 'DefaultServer' entry.  Not a string value");
+				passed = FALSE;
+			}
+		}
+	} else {
+		g_debug("No 'RemoteDesktopServers' found");
+	}
+
+	return passed;
+}
+
+/* Free the result of parsing */
+static void
+json_result_free (gpointer data)
+{
+	json_result_t * result = (json_result_t *)data;
+
+	g_clear_pointer(&result->subservers, server_table_free);
+	g_clear_pointer(&result->json, g_bytes_unref);
+	g_free(result);
+
+	return;
+}
+
+/* Worker thread parsing the JSON content and building the servers, so
+   that large replies don't hold up the main loop.  A good list is saved
+   for next time here too. */
+static void
+parse_json_thread (GTask * task, gpointer RLS_UNUSED source_object, gpointer task_data, GCancellable RLS_UNUSED *cancellable)
+{
+	json_task_t * json_task = (json_task_t *)task_data;
+	json_result_t * result = g_new0(json_result_t, 1);
+	JsonParser * parser = json_parser_new();
 	GError * error = NULL;
 
-	if (!json_parser_load_from_stream(parser, json, NULL, &error)) {
+	gsize length = 0;
+	const gchar * buffer = g_bytes_get_data(json_task->data, &length);
+
+	if (json_parser_load_from_data(parser, buffer != NULL ? buffer : "", length, &error)) {
+		result->passed = parse_json_root(json_parser_get_root(parser), result);
+	} else {
 		g_warning("Unable to parse JSON data: %s", error->message);
 		g_error_free(error);
-		error = NULL;
-		passed = FALSE;
+		result->passed = FALSE;
+	}
+
+	g_object_unref(parser);
+
+	if (result->passed) {
+		cache_json_save(json_task->cache_path, json_task->password, json_task->data);
+	}
+
+	g_task_return_pointer(task, result, json_result_free);
+	return;
+}
+
+/* Builds the path to one of the user's files in our cache directory,
+   they're named after the hash of the username and, for the server
+   lists, the hash of the UCCS URI */
+static gchar *
+cache_file_path (const gchar * username, const gchar * uri)
+{
+	gchar * username_sha = g_compute_checksum_for_string(G_CHECKSUM_SHA256, username, -1);
+	gchar * filename = NULL;
+
+	if (uri != NULL) {
+		gchar * uri_sha = g_compute_checksum_for_string(G_CHECKSUM_SHA256, uri, -1);
+		filename = g_strdup_printf("%s-%s.json", username_sha, uri_sha);
+		g_free(uri_sha);
+	} else {
+		filename = g_strdup(username_sha);
+	}
+
+	gchar * path = g_build_path("/", g_get_user_cache_dir(), "remote-logon-service", "cache", filename, NULL);
+
+	g_free(filename);
+	g_free(username_sha);
+
+	return path;
+}
+
+/* Take the servers from @result, moving over the objects of the ones
+   we already have that are the same type with the same name and URI so
+   they keep what was probed about them, see server_table_adopt().
+   Returns whether the list changed. */
+static gboolean
+session_replace_subservers (UccsSession * session, json_result_t * result)
+{
+	gboolean changed = FALSE;
+
+	if (result->subservers == NULL) {
+		changed = session->subservers != NULL && server_table_length(session->subservers) > 0;
+		g_clear_pointer(&session->subservers, server_table_free);
+	} else {
+		changed = server_table_adopt(result->subservers, session->subservers);
+		g_clear_pointer(&session->subservers, server_table_free);
+		session->subservers = result->subservers;
+		result->subservers = NULL;
+	}
+
+	session_probe_servers(session);
+
+	return changed;
+}
+
+/* The worker thread is done with it, the password is wiped */
+static void
+json_task_free (gpointer data)
+{
+	json_task_t * json_task = (json_task_t *)data;
+
+	g_clear_pointer(&json_task->data, g_bytes_unref);
+	g_free(json_task->cache_path);
+
+	if (json_task->password != NULL) {
+		memset(json_task->password, 0, strlen(json_task->password));
+		g_free(json_task->password);
+	}
+
+	g_free(json_task);
+
+	return;
+}
+
+/* Everything the worker thread needs about the user of @session */
+static json_task_t *
+json_task_new (UccsSession * session, GBytes * data)
+{
+	json_task_t * json_task = g_new0(json_task_t, 1);
+
+	json_task->data = data != NULL ? g_bytes_ref(data) : NULL;
+
+	if (session->username != NULL && session->password != NULL) {
+		json_task->cache_path = cache_file_path(session->username, session->server->parent.uri);
+		json_task->password = g_strdup(session->password);
+	}
+
+	return json_task;
+}
+
+/* Worker thread reading, decrypting and parsing the last server list
+   we got from the network for the user */
+static void
+cache_json_load_thread (GTask * task, gpointer RLS_UNUSED source_object, gpointer task_data, GCancellable RLS_UNUSED *cancellable)
+{
+	json_task_t * json_task = (json_task_t *)task_data;
+	json_result_t * result = g_new0(json_result_t, 1);
+	gchar * encrypted = NULL;
+	gsize encrypted_length = 0;
+
+	if (g_file_get_contents(json_task->cache_path, &encrypted, &encrypted_length, NULL) && encrypted_length > 0) {
+		gchar * contents = do_aes_decrypt(encrypted, json_task->password, encrypted_length);
+
+		/* A wrong password gets us garbage, which won't parse */
+		if (contents != NULL) {
+			JsonParser * parser = json_parser_new();
+
+			if (json_parser_load_from_data(parser, contents, -1, NULL)) {
+				result->passed = parse_json_root(json_parser_get_root(parser), result);
+			}
+
+			g_object_unref(parser);
+
+			if (result->passed && result->replace) {
+				gsize length = strlen(contents);
+				result->json = g_bytes_new_take(contents, length);
+			} else {
+				g_free(contents);
+			}
+		}
+	}
+
+	g_free(encrypted);
+
+	g_task_return_pointer(task, result, json_result_free);
+	return;
+}
+
+/* Tell the waiters that allowed the cache about the list we loaded
+   from it, the others keep waiting for the network */
+static void
+cache_waiters_notify (UccsSession * session)
+{
+	GList * network = NULL;
+	GList * link = session->json_waiters;
+
+	while (link != NULL) {
+		GList * next = g_list_next(link);
+		json_callback_t * json_callback = (json_callback_t *)link->data;
+
+		if (!json_callback->allowcache) {
+			session->json_waiters = g_list_remove_link(session->json_waiters, link);
+			network = g_list_concat(network, link);
+		}
+
+		link = next;
+	}
+
+	json_waiters_notify(session, TRUE, NULL);
+
+	/* The callbacks might have queued new waiters */
+	session->json_waiters = g_list_concat(network, session->json_waiters);
+
+	return;
+}
+
+/* Back in the main loop with what was in the cache, answer with that
+   and then go and see if the network has anything newer */
+static void
+cache_json_load_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	UccsServer * server = UCCS_SERVER(src_obj);
+	guint id = GPOINTER_TO_UINT(user_data);
+
+	json_result_t * result = g_task_propagate_pointer(G_TASK(res), NULL);
+	UccsSession * session = session_find_query(server, id);
+
+	/* Credentials changed or everyone left while we were loading */
+	if (session == NULL) {
+		json_result_free(result);
+		return;
+	}
+
+	session->json_query = 0;
+
+	if (result->json != NULL) {
+		session_replace_subservers(session, result);
+
+		g_clear_pointer(&session->json_last, g_bytes_unref);
+		session->json_last = g_bytes_ref(result->json);
+		session->cached = TRUE;
+
+		cache_waiters_notify(session);
+	}
+
+	json_result_free(result);
+
+	fetch_json(session);
+
+	return;
+}
+
+/* Start loading the last server list we got from the network for the
+   user.  A big list takes a while to read, decrypt and parse so that's
+   done in a worker thread, holding the session's query slot meanwhile. */
+static gboolean
+cache_json_load (UccsSession * session)
+{
+	if (session->username == NULL || session->password == NULL) {
+		return FALSE;
+	}
+
+	guint id = json_query_new_id();
+
+	GTask * task = g_task_new(session->server, NULL, cache_json_load_cb, GUINT_TO_POINTER(id));
+	g_task_set_task_data(task, json_task_new(session, NULL), json_task_free);
+	g_task_run_in_thread(task, cache_json_load_thread);
+	g_object_unref(task);
+
+	session->json_query = id;
+
+	return TRUE;
+}
+
+/* Save the server list we got from the network so that we can use
+   it next time the user logs in, called in the worker thread */
+static void
+cache_json_save (const gchar * path, const gchar * password, GBytes * data)
+{
+	gsize length = 0;
+	const gchar * buffer = g_bytes_get_data(data, &length);
+
+	if (length == 0 || path == NULL || password == NULL) {
+		return;
+	}
+
+	/* Encrypting needs a NULL terminated string */
+	gchar * json = g_strndup(buffer, length);
+	size_t enc_length = 0;
+	gchar * enc_data = do_aes_encrypt(json, password, &enc_length);
+	g_free(json);
+
+	if (enc_data == NULL) {
+		return;
+	}
+
+	gchar * dir_path = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dir_path, 0700) == 0) {
+		if (!g_file_set_contents(path, enc_data, enc_length, NULL)) {
+			g_warning("Failed writing cache data to '%s'.", path);
+		}
+	} else {
+		g_warning("Failed to create '%s'.", dir_path);
+	}
+
+	g_free(dir_path);
+	g_free(enc_data);
+
+	return;
+}
+
+/* Send the new list to everyone who has unlocked us as this user, it's
+   not a broadcast as it's their list only */
+static void
+login_servers_updated (UccsSession * session)
+{
+	if (g_hash_table_size(session->lovers) == 0) {
+		return;
+	}
+
+	GDBusConnection * bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL); /* Shouldn't block, we should have it */
+	if (bus == NULL) {
+		return;
+	}
+
+	GHashTableIter iter;
+	gpointer key;
+	g_hash_table_iter_init(&iter, session->lovers);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		const gchar * sender = (const gchar *)key;
+		GError * error = NULL;
+
+		g_dbus_connection_emit_signal(bus,
+		                              sender, /* dest */
+		                              "/org/ArcticaProject/RemoteLogon", /* object path */
+		                              "org.ArcticaProject.RemoteLogon", /* interface name */
+		                              "LoginServersUpdated", /* signal name */
+		                              g_variant_new("(sss@a(sssba(sbva{sv})a(si)))",
+		                                            session->server->parent.uri,
+		                                            session->username,
+		                                            session->cached ? "cached" : "network",
+		                                            uccs_server_get_servers(session->server, sender)), /* params */
+		                              &error);
+
+		if (error != NULL) {
+			g_warning("Unable to signal new servers to '%s': %s", sender, error->message);
+			g_error_free(error);
+		}
+	}
+
+	g_object_unref(bus);
+
+	return;
+}
+
+/* Probing is done, those who have the list get it again if any of the
+   servers came, went or moved */
+static void
+session_probe_done (gboolean changed, gpointer user_data)
+{
+	UccsSession * session = (UccsSession *)user_data;
+	guint i;
+
+	/* Part of their history when we rank them */
+	if (session->server->rank_servers && session->server->probe_servers && session->subservers != NULL) {
+		for (i = 0; i < server_table_length(session->subservers); i++) {
+			Server * serv = server_table_peek(session->subservers, i);
+
+			if (serv != NULL && SERVER_GET_CLASS(serv)->probe_ports != NULL) {
+				session_record_health(session, serv->name, serv->state == SERVER_STATE_ALLGOOD);
+			}
+		}
+	}
+
+	if (changed) {
+		login_servers_updated(session);
+	}
+
+	return;
+}
+
+/* Find out where the user's servers are and which of them can
+   actually be reached */
+static void
+session_probe_servers (UccsSession * session)
+{
+	UccsServer * server = session->server;
+	ServerProbeFlags flags = 0;
+
+	if (server->probe_servers) {
+		flags |= SERVER_PROBE_CONNECT;
+	}
+
+	if (server->resolve_servers) {
+		flags |= SERVER_PROBE_RESOLVE;
+	}
+
+	/* The broker too, each time a list came from it */
+	resolve_broker(server);
+
+	if (flags == 0 || session->subservers == NULL) {
+		return;
+	}
+
+	if (session->probe == NULL) {
+		session->probe = server_probe_new(flags, UCCS_PROBE_SERVERS_MAX, UCCS_PROBE_SERVERS_TIMEOUT, session_probe_done, session);
+	}
+
+	/* Probing needs the objects */
+	GPtrArray * servers = server_table_get_servers(session->subservers);
+	server_probe_start(session->probe, servers);
+	g_ptr_array_unref(servers);
+
+	return;
+}
+
+/* Go through the waiters and notify them of the status */
+static void
+json_waiters_notify (UccsSession * session, gboolean unlocked, const GError * error)
+{
+	/* The run is over one way or another */
+	if (session->json_deadline != 0) {
+		g_source_remove(session->json_deadline);
+		session->json_deadline = 0;
+	}
+
+	/* NOTE: Taking the list as the call back might add themselves to
+	   the list so we don't want to have it corrupted in the middle of
+	   the execution of this function */
+	GList * waiters = session->json_waiters;
+	session->json_waiters = NULL;
+
+	while (waiters != NULL) {
+		json_callback_t * json_callback = (json_callback_t *)waiters->data;
+
+		if (json_callback->watch != 0) {
+			g_bus_unwatch_name(json_callback->watch);
+		}
+
+		if (unlocked) {
+			session_add_lover(session, json_callback->sender);
+		}
+
+		if (json_callback->callback != NULL) {
+			json_callback->callback(session->server, unlocked, session->cached, error, json_callback->userdata);
+		}
+
+		g_free(json_callback->sender);
+		g_free(json_callback);
+		waiters = g_list_delete_link(waiters, waiters);
+	}
+
+	return;
+}
+
+/* Back in the main loop with the servers from the worker thread */
+static void
+parse_json_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	UccsServer * server = UCCS_SERVER(src_obj);
+	guint id = GPOINTER_TO_UINT(user_data);
+
+	json_result_t * result = g_task_propagate_pointer(G_TASK(res), NULL);
+	UccsSession * session = session_find_query(server, id);
+
+	/* Credentials changed while we were parsing */
+	if (session == NULL) {
+		json_result_free(result);
+		return;
+	}
+
+	session->json_query = 0;
+
+	/* Got a new set of servers, merge it into the old one.  Those who
+	   got the cached list want to hear it's the network one now even
+	   if nothing changed. */
+	gboolean changed = FALSE;
+	if (result->replace) {
+		changed = session_replace_subservers(session, result) || session->cached;
+		session->cached = FALSE;
+	}
+
+	gboolean passed = result->passed;
+	json_result_free(result);
+
+	if (passed) {
+		json_task_t * json_task = (json_task_t *)g_task_get_task_data(G_TASK(res));
+
+		g_clear_pointer(&session->json_last, g_bytes_unref);
+		session->json_last = g_bytes_ref(json_task->data);
+
+		/* Those already unlocked get the new list, the waiters get
+		   it as their answer */
+		if (changed) {
+			login_servers_updated(session);
+		}
+	}
+
+	json_waiters_notify(session, passed, NULL);
+	refresh_schedule(session);
+
+	return;
+}
+
+/* We've got everything query @id is going to give us.  If it worked
+   the JSON gets parsed in a thread, otherwise the credentials are no
+   good. */
+static void
+json_query_done (UccsSession * session, guint id, gboolean success, GBytes * data)
+{
+	if (!success || data == NULL) {
+		session->json_query = 0;
+		session->valid = FALSE;
+
+		/* Those who got the cached list were let in with credentials
+		   the broker doesn't take, they're not logged in anymore */
+		if (session->cached) {
+			clear_hash(session);
+			session->cached = FALSE;
+		}
+		session_last_used_save(session);
+		session_clear_password(session);
+		g_clear_pointer(&session->last_used, g_key_file_free);
+
+		json_waiters_notify(session, FALSE, NULL);
+		session_check_unused(session);
+		return;
+	}
+
+	/* Same as last time, the servers we have are already right, but
+	   whether they can be reached might not be */
+	if (session->json_last != NULL && g_bytes_equal(session->json_last, data)) {
+		session->json_query = 0;
+		session->cached = FALSE;
+
+		session_probe_servers(session);
+		json_waiters_notify(session, TRUE, NULL);
+		refresh_schedule(session);
+		return;
+	}
+
+	GTask * task = g_task_new(session->server, NULL, parse_json_cb, GUINT_TO_POINTER(id));
+	g_task_set_task_data(task, json_task_new(session, data), json_task_free);
+	g_task_run_in_thread(task, parse_json_thread);
+	g_object_unref(task);
+
+	return;
+}
+
+/* The one-shot agent both exited and closed its output */
+static void
+json_spawn_done (UccsSession * session)
+{
+	GBytes * data = session->json_data;
+	session->json_data = NULL;
+
+	g_clear_object(&session->json_cancel);
+
+	/* Drop the Streams -- NOTE: DO NOT CROSS THE STREAMS */
+	if (session->pass_stream != NULL) {
+		g_output_stream_close(session->pass_stream, NULL, NULL);
+		g_clear_object(&session->pass_stream);
+	}
+
+	json_query_done(session, session->json_query, session->json_status == 0, data);
+
+	g_bytes_unref(data);
+
+	return;
+}
+
+/* Callback from when we know that the agent is done, we might still
+   be reading what it said though */
+static void
+json_grab_cb (GPid pid, gint status, gpointer user_data)
+{
+	UccsSession * session = (UccsSession *)user_data;
+
+	session->json_pid = 0;
+	session->json_watch = 0;
+	session->json_status = status;
+
+	g_spawn_close_pid(pid);
+
+	if (session->json_data != NULL) {
+		json_spawn_done(session);
+	}
+
+	return;
+}
+
+/* Callback from when we've read all of the agent's output, which came
+   in chunks as it was written */
+static void
+json_read_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	json_query_t * query = (json_query_t *)user_data;
+	UccsServer * server = query->server;
+	guint id = query->id;
+	g_free(query);
+
+	GError * error = NULL;
+	g_output_stream_splice_finish(G_OUTPUT_STREAM(src_obj), res, &error);
+
+	if (error != NULL) {
+		/* Cancelled means the server might be gone, don't touch it */
+		if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_error_free(error);
+			return;
+		}
+
+		g_warning("Unable to read from UCCS process: %s", error->message);
+		g_error_free(error);
+	}
+
+	UccsSession * session = session_find_query(server, id);
+	if (session == NULL) {
+		return;
+	}
+
+	/* Already closed if everything went well, just making sure */
+	g_output_stream_close(G_OUTPUT_STREAM(src_obj), NULL, NULL);
+	session->json_data = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(src_obj));
+
+	if (session->json_pid == 0) {
+		json_spawn_done(session);
+	}
+
+	return;
+}
+
+/* This is the callback for writing the password, it mostly exists
+   to free the buffer, but we'll print some info as well just because
+   we can */
+static void
+password_write_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	/* Kill the buffer */
+	g_free(user_data);
+
+	GError * error = NULL;
+	g_output_stream_write_finish(G_OUTPUT_STREAM(src_obj), res, &error);
+
+	if (error != NULL) {
+		g_warning("Unable to write password to UCCS process: %s", error->message);
+		g_error_free(error);
+	} else {
+		g_debug("Wrote password to UCCS process");
+		g_output_stream_close(G_OUTPUT_STREAM(src_obj), NULL, NULL);
+	}
+
+	return;
+}
+
+/* Get an ID for a new query, never 0 as that means none */
+static guint
+json_query_new_id (void)
+{
+	if (++json_query_id == 0) {
+		++json_query_id;
+	}
+
+	return json_query_id;
+}
+
+/* Run the one-shot agent for the user, its output is collected as it
+   comes and parsed once it exits */
+static void
+spawn_json (UccsSession * session)
+{
+	UccsServer * server = session->server;
+	gint std_in, std_out;
+	GError * error = NULL;
+
+	const gchar * argv[3];
+	argv[0] = server->exec;
+	argv[1] = session->username;
+	argv[2] = NULL;
+
+	/* Only the child gets these, other threads may be reading ours */
+	gchar ** envp = g_get_environ();
+	if (server->parent.uri != NULL) {
+		envp = g_environ_setenv(envp, "SERVER_ROOT", server->parent.uri, TRUE);
+	}
+	envp = g_environ_setenv(envp, "API_VERSION", UCCS_API_VERSION, TRUE);
+
+	g_spawn_async_with_pipes(NULL, /* pwd */
+	                         (gchar **)argv,
+	                         envp,
+	                         G_SPAWN_DO_NOT_REAP_CHILD,
+	                         NULL, NULL, /* child setup */
+	                         &session->json_pid,
+	                         &std_in,
+	                         &std_out,
+	                         NULL, /* stderr */
+	                         &error); /* error */
+
+	g_strfreev(envp);
+
+	if (error != NULL) {
+		g_warning("Unable to start UCCS process: %s", error->message);
+		g_error_free(error);
+		session->json_pid = 0; /* really shouldn't get changed, but since we're using it to detect if it's running, let's double check, eh? */
+		session->json_query = 0;
+		json_waiters_notify(session, FALSE, NULL);
+		return;
+	}
+
+	json_query_t * query = g_new0(json_query_t, 1);
+	query->server = server;
+	query->id = json_query_new_id();
+	session->json_query = query->id;
+	session->json_agent = NULL;
+	session->json_status = 0;
+
+	/* Watch for when it's done */
+	session->json_watch = g_child_watch_add(session->json_pid, json_grab_cb, session);
+
+	/* Set up I/O streams */
+	session->json_cancel = g_cancellable_new();
+
+	GInputStream * json_stream = g_unix_input_stream_new(std_out, TRUE);
+	GOutputStream * json_output = g_memory_output_stream_new_resizable();
+	g_output_stream_splice_async(json_output,
+	                             json_stream,
+	                             G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+	                             G_PRIORITY_DEFAULT,
+	                             session->json_cancel,
+	                             json_read_cb,
+	                             query);
+	g_object_unref(json_output);
+	g_object_unref(json_stream);
+
+	session->pass_stream = g_unix_output_stream_new(std_in, TRUE);
+
+	gchar * pass = g_strdup(session->password != NULL ? session->password : "");
+	g_output_stream_write_async(session->pass_stream,
+	                            pass,
+	                            strlen(pass), /* number of bytes */
+	                            G_PRIORITY_DEFAULT, /* priority */
+	                            NULL, /* cancellable */
+	                            password_write_cb,
+	                            pass);
+
+	return;
+}
+
+/* Reply from the persistent agent */
+static void
+agent_reply_cb (gint status, const gchar * data, gsize length, const GError * error, gpointer user_data)
+{
+	json_query_t * query = (json_query_t *)user_data;
+	UccsServer * server = query->server;
+	guint id = query->id;
+	g_free(query);
+
+	/* The agent is being shut down along with the server */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		return;
+	}
+
+	/* Credentials changed while the agent was busy */
+	UccsSession * session = session_find_query(server, id);
+	if (session == NULL) {
+		return;
+	}
+
+	session->json_agent = NULL;
+
+	if (error != NULL) {
+		g_warning("Persistent UCCS agent failed, running a one-shot one: %s", error->message);
+		session->json_query = 0;
+		spawn_json(session);
+		return;
+	}
+
+	GBytes * bytes = g_bytes_new(data, length);
+	json_query_done(session, id, status == 0, bytes);
+	g_bytes_unref(bytes);
+
+	return;
+}
+
+/* Get the JSON for the user by running the agent, the persistent one
+   if we're using it */
+static void
+exec_json (UccsSession * session)
+{
+	UccsServer * server = session->server;
+
+	if (server->exec == NULL) {
+		g_warning("No UCCS agent to fall back to for: %s", server->parent.uri);
+		json_waiters_notify(session, FALSE, NULL);
+		return;
+	}
+
+	if (server->persistent) {
+		if (server->agent == NULL) {
+			server->agent = uccs_agent_new(server->exec, server->parent.uri);
+		}
+
+		json_query_t * query = g_new0(json_query_t, 1);
+		query->server = server;
+		query->id = json_query_new_id();
+
+		if (uccs_agent_query(server->agent, session->username, session->password, agent_reply_cb, query)) {
+			session->json_query = query->id;
+			session->json_agent = query;
+			return;
+		}
+
+		g_free(query);
+	}
+
+	spawn_json(session);
+
+	return;
+}
+
+/* Done with the request to the broker */
+static void
+native_fetch_clear (UccsSession * session)
+{
+	session->json_native = FALSE;
+	g_clear_object(&session->json_cancel);
+	g_clear_object(&session->json_message);
+
+	return;
+}
+
+/* The broker couldn't be asked, try the agent instead */
+static void
+native_fetch_failed (UccsSession * session, const gchar * message)
+{
+	g_warning("Unable to get server list from '%s': %s", session->server->parent.uri, message);
+
+	native_fetch_clear(session);
+	session->json_query = 0;
+	exec_json(session);
+
+	return;
+}
+
+/* We've got the whole reply from the broker */
+static void
+native_read_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	json_query_t * query = (json_query_t *)user_data;
+	UccsServer * server = query->server;
+	guint id = query->id;
+	g_free(query);
+
+	GError * error = NULL;
+	g_output_stream_splice_finish(G_OUTPUT_STREAM(src_obj), res, &error);
+
+	/* Cancelled means the server might be gone, don't touch it */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(error);
+		return;
+	}
+
+	/* Credentials changed while we were reading */
+	UccsSession * session = session_find_query(server, id);
+	if (session == NULL) {
+		g_clear_error(&error);
+		return;
+	}
+
+	if (error != NULL) {
+		native_fetch_failed(session, error->message);
+		g_error_free(error);
+		return;
+	}
+
+	guint statuscode = session->json_message->status_code;
+	g_debug("Server list came back with status: %d", statuscode);
+
+	if (statuscode == SOUP_STATUS_OK) {
+		GBytes * bytes = g_memory_output_stream_steal_as_bytes(G_MEMORY_OUTPUT_STREAM(src_obj));
+
+		native_fetch_clear(session);
+		json_query_done(session, id, TRUE, bytes);
+		g_bytes_unref(bytes);
+	} else if (statuscode == SOUP_STATUS_UNAUTHORIZED || statuscode == SOUP_STATUS_FORBIDDEN) {
+		native_fetch_clear(session);
+		json_query_done(session, id, FALSE, NULL);
+	} else {
+		native_fetch_failed(session, session->json_message->reason_phrase);
+	}
+
+	return;
+}
+
+/* The broker answered, read the body of what it said */
+static void
+native_fetch_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	json_query_t * query = (json_query_t *)user_data;
+	GError * error = NULL;
+	GInputStream * stream = soup_session_send_finish(SOUP_SESSION(src_obj), res, &error);
+
+	/* Cancelled means the server might be gone, don't touch it */
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free(error);
+		g_free(query);
+		return;
+	}
+
+	/* Credentials changed or we're shutting down */
+	UccsSession * session = session_find_query(query->server, query->id);
+	if (session == NULL) {
+		g_clear_error(&error);
+		g_clear_object(&stream);
+		g_free(query);
+		return;
+	}
+
+	if (error != NULL) {
+		native_fetch_failed(session, error->message);
+		g_error_free(error);
+		g_free(query);
+		return;
+	}
+
+	GOutputStream * output = g_memory_output_stream_new_resizable();
+	g_output_stream_splice_async(output,
+	                             stream,
+	                             G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE | G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+	                             G_PRIORITY_DEFAULT,
+	                             session->json_cancel,
+	                             native_read_cb,
+	                             query);
+	g_object_unref(output);
+	g_object_unref(stream);
+
+	return;
+}
+
+/* Ask the broker for the server list ourselves, reusing the shared
+   soup session's connections */
+static gboolean
+native_fetch (UccsSession * session)
+{
+	UccsServer * server = session->server;
+
+	if (server->parent.uri == NULL || server->session == NULL) {
+		return FALSE;
+	}
+
+	gchar * url = g_strconcat(server->parent.uri,
+	                          g_str_has_suffix(server->parent.uri, "/") ? "" : "/",
+	                          "api/", UCCS_API_VERSION,
+	                          NULL);
+
+	SoupMessage * message = soup_message_new("GET", url);
+
+	if (message == NULL) {
+		g_warning("Unable to build server list request for: %s", url);
+		g_free(url);
+		return FALSE;
+	}
+
+	/* Send the credentials right away instead of waiting to be
+	   challenged for them */
+	gchar * credentials = g_strdup_printf("%s:%s", session->username, session->password != NULL ? session->password : "");
+	gchar * encoded = g_base64_encode((const guchar *)credentials, strlen(credentials));
+	gchar * authorization = g_strdup_printf("Basic %s", encoded);
+
+	soup_message_headers_replace(message->request_headers, "Authorization", authorization);
+	soup_message_headers_replace(message->request_headers, "Accept", "application/json");
+
+	memset(credentials, 0, strlen(credentials));
+	memset(authorization, 0, strlen(authorization));
+	g_free(credentials);
+	g_free(encoded);
+	g_free(authorization);
+
+	json_query_t * query = g_new0(json_query_t, 1);
+	query->server = server;
+	query->id = json_query_new_id();
+	session->json_query = query->id;
+	session->json_agent = NULL;
+	session->json_native = TRUE;
+
+	/* Cancelled along with everything else of this session's run, or
+	   when the network goes away */
+	session->json_message = message;
+	session->json_cancel = g_cancellable_new();
+
+	g_debug("Getting server list from: %s", url);
+	soup_session_send_async(server->session, message, session->json_cancel, native_fetch_cb, query);
+
+	g_free(url);
+
+	return TRUE;
+}
+
+/* Stop getting the JSON for the user.  Only the user's own query is
+   given up on, if the persistent agent is stuck on it it gets restarted
+   and the queries of the others are sent to it again. */
+static void
+json_abandon (UccsSession * session)
+{
+	UccsServer * server = session->server;
+	gpointer agent_query = session->json_query != 0 ? session->json_agent : NULL;
+
+	json_stop(session);
+
+	if (agent_query != NULL && server->agent != NULL) {
+		uccs_agent_cancel(server->agent, agent_query);
+	}
+
+	return;
+}
+
+/* The agent or the broker took too long, stop waiting on it and tell
+   the waiters it timed out */
+static gboolean
+json_deadline_cb (gpointer user_data)
+{
+	UccsSession * session = (UccsSession *)user_data;
+	UccsServer * server = session->server;
+
+	session->json_deadline = 0;
+
+	if (session->json_pid == 0 && session->json_query == 0) {
+		return G_SOURCE_REMOVE;
+	}
+
+	g_warning("No server list from '%s' for '%s' after %u seconds", server->parent.uri, session->username, server->timeout);
+
+	json_abandon(session);
+
+	/* Don't let the next login think it's unlocked with nothing */
+	if (session->subservers == NULL) {
+		session->valid = FALSE;
+	}
+
+	GError * error = g_error_new(G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "No server list from '%s' in %u seconds", server->parent.uri, server->timeout);
+	json_waiters_notify(session, FALSE, error);
+	g_error_free(error);
+
+	refresh_schedule(session);
+	session_check_unused(session);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Start getting the JSON for the user, from the broker directly if
+   we're doing that */
+static void
+fetch_json (UccsSession * session)
+{
+	if (session->server->timeout != 0) {
+		if (session->json_deadline != 0) {
+			g_source_remove(session->json_deadline);
+		}
+
+		session->json_deadline = g_timeout_add_seconds(session->server->timeout, json_deadline_cb, session);
+	}
+
+	if (session->server->native && native_fetch(session)) {
+		return;
+	}
+
+	exec_json(session);
+
+	return;
+}
+
+/* The one who asked went away before getting an answer, if nobody
+   else wants the list we stop getting it */
+static void
+json_waiter_vanished (GDBusConnection RLS_UNUSED *connection, const gchar RLS_UNUSED *name, gpointer user_data)
+{
+	json_callback_t * json_callback = (json_callback_t *)user_data;
+	UccsSession * session = json_callback->session;
+
+	g_bus_unwatch_name(json_callback->watch);
+	session->json_waiters = g_list_remove(session->json_waiters, json_callback);
+
+	if (json_callback->callback != NULL) {
+		GError * error = g_error_new(G_IO_ERROR, G_IO_ERROR_CANCELLED, "'%s' went away", json_callback->sender);
+		json_callback->callback(session->server, FALSE, session->cached, error, json_callback->userdata);
+		g_error_free(error);
+	}
+
+	g_free(json_callback->sender);
+	g_free(json_callback);
+
+	if (session->json_waiters != NULL || g_hash_table_size(session->lovers) != 0) {
+		return;
+	}
+
+	g_debug("Nobody is waiting on the server list from '%s' for '%s' anymore", session->server->parent.uri, session->username);
+
+	json_abandon(session);
+
+	if (session->subservers == NULL) {
+		session->valid = FALSE;
+	}
+
+	session_check_unused(session);
+
+	return;
+}
+
+/* Time to see if the broker has something new for the folks that
+   have unlocked us as this user */
+static gboolean
+refresh_cb (gpointer user_data)
+{
+	UccsSession * session = (UccsSession *)user_data;
+	session->refresh_timer = 0;
+
+	if (!session->valid || g_hash_table_size(session->lovers) == 0) {
+		return G_SOURCE_REMOVE;
+	}
+
+	if (session->json_pid == 0 && session->json_query == 0) {
+		fetch_json(session);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Start the timer for the next refresh if we're doing them */
+static void
+refresh_schedule (UccsSession * session)
+{
+	if (session->server->refresh_interval == 0 || session->refresh_timer != 0) {
+		return;
+	}
+
+	if (!session->valid || g_hash_table_size(session->lovers) == 0) {
+		return;
+	}
+
+	session->refresh_timer = g_timeout_add_seconds(session->server->refresh_interval, refresh_cb, session);
+
+	return;
+}
+
+/**
+ * uccs_server_unlock:
+ * @server: The server to unlock
+ * @address: DBus address of the person unlocking us
+ * @username: Username for the UCCS
+ * @password: (allow-none) Password to use
+ * @allowcache: If using cache is allowed
+ * @callback: Function to call when we have an answer
+ * @user_data: Data for the callback
+ *
+ * Unlocks the UCCS server making servers available either from the
+ * cache or from the network.  When @allowcache is set and the list from
+ * an earlier login is saved on disk @callback gets that one, marked as
+ * cached, and the list is then refreshed from the network.  Each user
+ * gets their own session so logins by different users don't wait on,
+ * or cancel, each other.
+ *
+ * Return value: Whether @callback is going to be called, or already
+ *   was.  It isn't if the login couldn't be started at all.
+ */
+gboolean
+uccs_server_unlock (UccsServer * server, const gchar * address, const gchar * username, const gchar * password, gboolean allowcache, UccsServerUnlockCallback callback, gpointer user_data)
+{
+	g_return_val_if_fail(IS_UCCS_SERVER(server), FALSE);
+	g_return_val_if_fail(username != NULL, FALSE);
+	g_return_val_if_fail(address != NULL, FALSE);
+
+	UccsSession * session = g_hash_table_lookup(server->sessions, username);
+
+	/* Check the values we have for this user, if the last try didn't
+	   work out they won't match */
+	if (allowcache && session != NULL && session->valid &&
+			g_strcmp0(password, session->password) == 0) {
+		session_add_lover(session, address);
+
+		if (callback != NULL) {
+			callback(server, TRUE, session->cached, NULL, user_data);
+		}
+
+		return TRUE;
+	}
+
+	/* The agent wasn't found when the config file was read */
+	if (server->exec == NULL && !server->native) {
+		g_warning("No UCCS agent to log into '%s' with", server->parent.uri);
+		return FALSE;
+	}
+
+	if (session == NULL) {
+		session = session_new(server, username, password);
+		g_hash_table_insert(server->sessions, session->username, session);
+	} else {
+		/* If we're not going to allow the cache, just clear it right away */
+		if (!allowcache) {
+			clear_hash(session);
+		}
+
+		/* We're changing the password, if there were other people who
+		   had it, they need to know we're different now */
+		if (!session->valid || g_strcmp0(password, session->password) != 0) {
+			clear_hash(session);
+			clear_json(session);
+
+			session_last_used_save(session);
+			session_clear_password(session);
+			session->password = g_strdup(password);
+			session->valid = TRUE;
+			session->cached = FALSE;
+			g_clear_pointer(&session->json_last, g_bytes_unref);
+			g_clear_pointer(&session->last_used, g_key_file_free);
+		}
+	}
+
+	/* Add ourselves to the queue */
+	json_callback_t * json_callback = g_new0(json_callback_t, 1);
+	json_callback->session = session;
+	json_callback->sender = g_strdup(address);
+	json_callback->callback = callback;
+	json_callback->userdata = user_data;
+	json_callback->allowcache = allowcache;
+
+	session->json_waiters = g_list_append(session->json_waiters, json_callback);
+
+	/* Stop waiting for them if they leave the bus */
+	GDBusConnection * bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL); /* Shouldn't block, we should have it */
+	if (bus != NULL) {
+		json_callback->watch = g_bus_watch_name_on_connection(bus, address, G_BUS_NAME_WATCHER_FLAGS_NONE, NULL, json_waiter_vanished, json_callback, NULL);
+		g_object_unref(bus);
+	}
+
+	/* Answer with what we got last time once it's loaded, and then go
+	   and see if the network has anything newer */
+	if (session->json_pid == 0 && session->json_query == 0) {
+		if (!allowcache || !cache_json_load(session)) {
+			fetch_json(session);
+		}
+	}
+
+	return TRUE;
+}
+
+/* Remember which version of the last used file we have in memory */
+static void
+session_last_used_stat (UccsSession * session, const gchar * path)
+{
+	GStatBuf buf;
+
+	if (g_stat(path, &buf) == 0) {
+		session->last_used_mtime = buf.st_mtime;
+		session->last_used_size = buf.st_size;
+	} else {
+		session->last_used_mtime = 0;
+		session->last_used_size = 0;
 	}
 
-	/* Make sure we have a sane root node */
-	JsonNode * root_node = NULL;
-	if (passed) {
-		root_node = json_parser_get_root(parser);
+	return;
+}
 
-#if 0
-		JsonGenerator * gen = json_generator_new();
-		json_generator_set_root(gen, root_node);
-		gchar * data = json_generator_to_data(gen, NULL);
-		g_debug("%s", data);
-		g_free(data);
-		g_object_unref(G_OBJECT(gen));
-#endif
+/* The decrypted last used file of the user.  It's kept in memory and
+   only read again if the file changes under us. */
+static GKeyFile *
+session_get_last_used (UccsSession * session)
+{
+	if (session->username == NULL || session->password == NULL) {
+		return NULL;
 	}
-	if (root_node != NULL && JSON_NODE_TYPE(root_node) != JSON_NODE_OBJECT) {
-		g_warning("Root node of JSON data is not an object.  It is: %s", json_node_type_name(root_node));
-		passed = FALSE;
+
+	/* What we have is newer than the disk until our writes land */
+	if (session->last_used != NULL && (session->last_used_dirty || session->last_used_write != 0)) {
+		return session->last_used;
 	}
 
-	/* Take our object and see if it has the property that we need */
-	JsonObject * root_object = NULL;
-	if (passed) {
-		root_object = json_node_get_object(root_node);
+	gchar * file_path = cache_file_path(session->username, NULL);
+	GStatBuf buf;
+
+	/* Nothing saved, or someone cleaned up after us */
+	if (g_stat(file_path, &buf) != 0) {
+		g_clear_pointer(&session->last_used, g_key_file_free);
+		g_free(file_path);
+		return NULL;
 	}
-	if (root_object != NULL && json_object_has_member(root_object, "RemoteDesktopServers")) {
-		/* This shows that we have some.  It's okay if there aren't any.  Seems
-		   a bit silly, but we're not bitching too much. */
-		JsonNode * rds_node = json_object_get_member(root_object, "RemoteDesktopServers");
-		if (JSON_NODE_TYPE(rds_node) == JSON_NODE_ARRAY) {
-			JsonArray * rds_array = json_node_get_array(rds_node);
-			passed = parse_rds_array(server, rds_array);
-		} else {
-			/* Okay we're a little bit angrier about this one */
-			g_warning("Malformed 'RemoteDesktopServer' entry.  Not an array but a: %s", json_node_type_name(rds_node));
-			passed = FALSE;
-		}
 
-		if (json_object_has_member(root_object, "DefaultServer")) {
-			JsonNode * ds_node = json_object_get_member(root_object, "DefaultServer");
-			if (JSON_NODE_TYPE(ds_node) == JSON_NODE_VALUE && json_node_get_value_type(ds_node) == G_TYPE_STRING) {
-				const gchar * default_server_name = json_node_get_string(ds_node);
-				if (default_server_name != NULL) {
-					GList * lserver;
-					for (lserver = server->subservers; lserver != NULL; lserver = g_list_next(lserver)) {
-						Server * serv = SERVER(lserver->data);
-
-						if (g_strcmp0(serv->name, default_server_name) == 0) {
-							serv->last_used = TRUE;
-							break;
-						}
-					}
-					if (lserver == NULL && strlen(default_server_name) > 0) {
-						g_warning("Could not find the 'DefaultServer' server.");
-						passed = FALSE;
-					}
-				}
+	if (session->last_used != NULL && buf.st_mtime == session->last_used_mtime && buf.st_size == session->last_used_size) {
+		g_free(file_path);
+		return session->last_used;
+	}
+
+	g_clear_pointer(&session->last_used, g_key_file_free);
+
+	gchar * encrypted_contents;
+	gsize encrypted_contents_length;
+	if (g_file_get_contents(file_path, &encrypted_contents, &encrypted_contents_length, NULL)) {
+		gchar * file_contents = do_aes_decrypt(encrypted_contents, session->password, encrypted_contents_length);
+		g_free(encrypted_contents);
+
+		if (file_contents != NULL) {
+			GKeyFile * key_file = g_key_file_new();
+			if (g_key_file_load_from_data(key_file, file_contents, strlen(file_contents), G_KEY_FILE_NONE, NULL)) {
+				session->last_used = key_file;
 			} else {
-				g_warning("Malformed 'DefaultServer' entry.  Not a string value");
-				passed = FALSE;
+				g_key_file_free(key_file);
 			}
+			g_free(file_contents);
 		}
-	} else {
-		g_debug("No 'RemoteDesktopServers' found");
 	}
 
-	g_object_unref(parser);
-	return passed;
+	/* Even if it didn't work out, no need to try again until it changes */
+	session->last_used_mtime = buf.st_mtime;
+	session->last_used_size = buf.st_size;
+
+	g_free(file_path);
+
+	return session->last_used;
 }
 
-/* Go through the waiters and notify them of the status */
-static void
-json_waiters_notify (UccsServer * server, gboolean unlocked)
+/* A write of the last used file that's on its way to disk */
+typedef struct _last_used_write_t last_used_write_t;
+struct _last_used_write_t {
+	UccsServer * server;
+	guint id;
+	gchar * username;
+	gchar * dir_path;
+	gchar * path;
+	GBytes * data;
+};
+
+/* One thread for all the writes, so they land in the order we made them */
+static GThreadPool * last_used_pool = NULL;
+
+/* Back in the main loop after the write, if it's the latest one for
+   the user we know what's on disk now */
+static gboolean
+last_used_written_cb (gpointer user_data)
 {
-	/* NOTE: Taking the list as the call back might add themselves to
-	   the list so we don't want to have it corrupted in the middle of
-	   the execution of this function */
-	GList * waiters = server->json_waiters;
-	server->json_waiters = NULL;
+	last_used_write_t * write = (last_used_write_t *)user_data;
+	UccsServer * server = write->server;
 
-	while (waiters != NULL) {
-		json_callback_t * json_callback = (json_callback_t *)waiters->data;
+	UccsSession * session = g_hash_table_lookup(server->sessions, write->username);
+	if (session != NULL && session->last_used_write == write->id) {
+		session->last_used_write = 0;
+		session_last_used_stat(session, write->path);
+	}
 
-		if (unlocked) {
-			g_hash_table_insert(server->lovers, g_strdup(json_callback->sender), GINT_TO_POINTER(TRUE));
-		}
+	server->last_used_writes--;
 
-		if (json_callback->callback != NULL) {
-			json_callback->callback(server, unlocked, json_callback->userdata);
-		}
+	g_object_unref(server);
+	g_free(write->username);
+	g_free(write->dir_path);
+	g_free(write->path);
+	g_bytes_unref(write->data);
+	g_free(write);
 
-		g_free(json_callback->sender);
-		g_free(json_callback);
-		waiters = g_list_delete_link(waiters, waiters);
+	return G_SOURCE_REMOVE;
+}
+
+/* Put the data on disk, this can block for a while on network file
+   systems so it's done in the pool's thread */
+static void
+last_used_write_thread (gpointer data, gpointer RLS_UNUSED user_data)
+{
+	last_used_write_t * write = (last_used_write_t *)data;
+
+	if (g_mkdir_with_parents(write->dir_path, 0700) != 0) {
+		g_warning("Failed to create '%s'.", write->dir_path);
+	} else {
+		gsize length = 0;
+		const gchar * buffer = g_bytes_get_data(write->data, &length);
+
+		if (!g_file_set_contents(write->path, buffer, length, NULL)) {
+			g_warning("Failed writing cache data to '%s'.", write->path);
+		}
 	}
 
+	g_idle_add(last_used_written_cb, write);
+
 	return;
 }
 
-/* Callback from when we know that we've got all the JSON we're
-   gonna get */
+/* Encrypt the user's last used servers and send them off to disk */
 static void
-json_grab_cb (GPid pid, gint status, gpointer user_data)
+session_last_used_write (UccsSession * session)
 {
-	UccsServer * server = UCCS_SERVER(user_data);
+	session->last_used_dirty = FALSE;
 
-	server->json_pid = 0;
-	server->json_watch = 0;
+	if (session->last_used == NULL || session->password == NULL) {
+		return;
+	}
 
-	if (status == 0) {
-		gboolean parser = parse_json(server, server->json_stream);
+	gsize data_length;
+	gchar * data = g_key_file_to_data(session->last_used, &data_length, NULL);
 
-		json_waiters_notify(server, parser);
-	} else {
-		g_free(server->username);
-		server->username = NULL;
-		g_free(server->password);
-		server->password = NULL;
+	size_t enc_data_length;
+	gchar * enc_data = do_aes_encrypt(data, session->password, &enc_data_length);
+	g_free(data);
 
-		json_waiters_notify(server, FALSE);
+	if (enc_data == NULL) {
+		return;
 	}
 
-	/* Drop the Streams -- NOTE: DO NOT CROSS THE STREAMS */
-	g_output_stream_close(server->pass_stream, NULL, NULL);
-	g_object_unref(server->pass_stream);
-	server->pass_stream = NULL;
+	if (last_used_pool == NULL) {
+		last_used_pool = g_thread_pool_new(last_used_write_thread, NULL, 1, FALSE, NULL);
+	}
 
-	g_input_stream_close(server->json_stream, NULL, NULL);
-	g_object_unref(server->json_stream);
-	server->json_stream = NULL;
+	last_used_write_t * write = g_new0(last_used_write_t, 1);
+	write->server = g_object_ref(session->server);
+	write->id = json_query_new_id();
+	write->username = g_strdup(session->username);
+	write->dir_path = g_build_path("/", g_get_user_cache_dir(), "remote-logon-service", "cache", NULL);
+	write->path = cache_file_path(session->username, NULL);
+	write->data = g_bytes_new_take(enc_data, enc_data_length);
 
-	g_spawn_close_pid(pid);
+	session->last_used_write = write->id;
+	session->server->last_used_writes++;
+
+	g_thread_pool_push(last_used_pool, write, NULL);
 
 	return;
 }
 
-/* This is the callback for writing the password, it mostly exists
-   to free the buffer, but we'll print some info as well just because
-   we can */
+/* Changes have settled down, time to write them */
+static gboolean
+last_used_timer_cb (gpointer user_data)
+{
+	UccsSession * session = (UccsSession *)user_data;
+	session->last_used_timer = 0;
+
+	session_last_used_write(session);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Don't wait for more changes, send what we have to disk now.  Used
+   before the password goes away and we can't encrypt anymore. */
 static void
-password_write_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+session_last_used_save (UccsSession * session)
 {
-	/* Kill the buffer */
-	g_free(user_data);
+	if (session->last_used_timer != 0) {
+		g_source_remove(session->last_used_timer);
+		session->last_used_timer = 0;
+	}
+
+	if (session->last_used_dirty) {
+		session_last_used_write(session);
+	}
+
+	return;
+}
+
+/* The last used file changed, write it once things settle down */
+static void
+session_last_used_changed (UccsSession * session)
+{
+	session->last_used_dirty = TRUE;
+
+	if (session->last_used_timer == 0) {
+		session->last_used_timer = g_timeout_add(LAST_USED_WRITE_DELAY, last_used_timer_cb, session);
+	}
+
+	return;
+}
+
+/* The group in the last used file with the history of the servers
+   from this UCCS server */
+static gchar *
+session_health_group (UccsSession * session)
+{
+	if (session->server->parent.name == NULL) {
+		return NULL;
+	}
+
+	return g_strconcat(session->server->parent.name, " health", NULL);
+}
+
+/* Whether the name of the server can be a key in the last used file */
+static gboolean
+health_key_valid (const gchar * name)
+{
+	return name != NULL && name[0] != '\0' && strpbrk(name, "=[]\n") == NULL;
+}
+
+/* How often connecting to the server worked out lately, from 0 to 1.
+   Servers we don't know anything about get the benefit of the doubt. */
+static gdouble
+session_get_health (GKeyFile * last_used, const gchar * group, const gchar * name)
+{
+	if (last_used == NULL || group == NULL || !health_key_valid(name)) {
+		return 1.0;
+	}
 
 	GError * error = NULL;
-	g_output_stream_write_finish(G_OUTPUT_STREAM(src_obj), res, &error);
+	gdouble health = g_key_file_get_double(last_used, group, name, &error);
 
 	if (error != NULL) {
-		g_warning("Unable to write password to UCCS process: %s", error->message);
 		g_error_free(error);
-	} else {
-		g_debug("Wrote password to UCCS process");
-		g_output_stream_close(G_OUTPUT_STREAM(src_obj), NULL, NULL);
+		return 1.0;
 	}
 
-	return;
+	return CLAMP(health, 0.0, 1.0);
 }
 
-/**
- * uccs_server_unlock:
- * @server: The server to unlock
- * @address: DBus address of the person unlocking us
- * @username: Username for the UCCS
- * @password: (allow-none) Password to use
- * @allowcache: If using cache is allowed
- * @callback: Function to call when we have an answer
- * @user_data: Data for the callback
- *
- * Unlocks the UCCS server making servers available either from the
- * cache or from the network.
- */
-void
-uccs_server_unlock (UccsServer * server, const gchar * address, const gchar * username, const gchar * password, gboolean allowcache, void (*callback) (UccsServer * server, gboolean unlocked, gpointer user_data), gpointer user_data)
+/* Add whether connecting to the server worked to its history, the
+   recent results counting the most */
+static void
+session_record_health (UccsSession * session, const gchar * name, gboolean success)
 {
-	g_return_if_fail(IS_UCCS_SERVER(server));
-	g_return_if_fail(username != NULL);
-	g_return_if_fail(address != NULL);
+	if (session->username == NULL || session->password == NULL || !health_key_valid(name)) {
+		return;
+	}
 
-	/* Check the current values we have, they might be NULL, which in
-	   that case they won't match */
-	if (allowcache && g_strcmp0(username, server->username) == 0 &&
-			g_strcmp0(password, server->password) == 0) {
-		g_hash_table_insert(server->lovers, g_strdup(address), GINT_TO_POINTER(TRUE));
+	gchar * group = session_health_group(session);
+	if (group == NULL) {
+		return;
+	}
 
-		if (callback != NULL) {
-			callback(server, TRUE, user_data);
-		}
+	GKeyFile * key_file = session_get_last_used(session);
+	gdouble health = session_get_health(key_file, group, name);
+	gdouble newhealth = (1.0 - RANK_HEALTH_ALPHA) * health + RANK_HEALTH_ALPHA * (success ? 1.0 : 0.0);
 
+	/* Not worth a write */
+	if (ABS(newhealth - health) < 0.01 && key_file != NULL) {
+		g_free(group);
 		return;
 	}
 
-	g_return_if_fail(server->exec != NULL); /* Shouldn't happen, but I'd feel safer if we checked */
-
-	/* If we're not going to allow the cache, just clear it right away */
-	if (!allowcache) {
-		clear_hash(server);
+	if (key_file == NULL) {
+		key_file = session->last_used = g_key_file_new();
 	}
 
-	/* We're changing the username and password, if there were other
-	   people who had it, they need to know we're different now */
-	if (g_strcmp0(username, server->username) != 0 ||
-			g_strcmp0(password, server->password) != 0) {
-		clear_hash(server);
-		clear_json(server);
+	g_key_file_set_double(key_file, group, name, newhealth);
+	session_last_used_changed(session);
+
+	g_free(group);
+
+	return;
+}
 
-		g_clear_pointer(&server->username, g_free);
-		g_clear_pointer(&server->password, g_free);
+/* How good a choice the server is for the user, from 0 to 100 */
+static gint
+session_server_score (GKeyFile * last_used, const gchar * group, Server * subserver)
+{
+	gdouble health = session_get_health(last_used, group, subserver->name);
 
-		server->username = g_strdup(username);
-		server->password = g_strdup(password);
+	/* 1 for no time at all, half at 100ms */
+	gdouble latency = 0.5;
+	if (subserver->latency >= 0) {
+		latency = 100.0 / (100.0 + subserver->latency);
 	}
 
-	/* Add ourselves to the queue */
-	json_callback_t * json_callback = g_new0(json_callback_t, 1);
-	json_callback->sender = g_strdup(address);
-	json_callback->callback = callback;
-	json_callback->userdata = user_data;
+	gdouble score = RANK_WEIGHT_HEALTH * health
+	              + RANK_WEIGHT_LATENCY * latency
+	              + (subserver->last_used ? RANK_WEIGHT_LAST_USED : 0);
 
-	server->json_waiters = g_list_append(server->json_waiters, json_callback);
+	return (gint)(score + 0.5);
+}
 
-	if (server->json_pid == 0) {
-		gint std_in, std_out;
-		GError * error = NULL;
+/* A server and where it goes in the list */
+typedef struct _ranked_t ranked_t;
+struct _ranked_t {
+	Server * server;
+	gint score;
+	guint index;
+};
 
-		const gchar * argv[3];
-		argv[0] = server->exec;
-		argv[1] = server->username;
-		argv[2] = NULL;
-
-		g_setenv("SERVER_ROOT", server->parent.uri, TRUE);
-		g_setenv("API_VERSION", UCCS_API_VERSION, TRUE);
-
-		g_spawn_async_with_pipes(NULL, /* pwd */
-		                         (gchar **)argv,
-		                         NULL, /* env */
-		                         G_SPAWN_DO_NOT_REAP_CHILD,
-		                         NULL, NULL, /* child setup */
-		                         &server->json_pid,
-		                         &std_in,
-		                         &std_out,
-		                         NULL, /* stderr */
-		                         &error); /* error */
+/* Best score first, keeping the broker's order for the same score */
+static gint
+ranked_compare (gconstpointer a, gconstpointer b)
+{
+	const ranked_t * ra = (const ranked_t *)a;
+	const ranked_t * rb = (const ranked_t *)b;
 
-		if (error != NULL) {
-			g_warning("Unable to start UCCS process: %s", error->message);
-			g_error_free(error);
-			server->json_pid = 0; /* really shouldn't get changed, but since we're using it to detect if it's running, let's double check, eh? */
-			json_waiters_notify(server, FALSE);
-		} else {
-			/* Watch for when it's done */
-			server->json_watch = g_child_watch_add(server->json_pid, json_grab_cb, server);
+	if (ra->score != rb->score) {
+		return rb->score - ra->score;
+	}
 
-			/* Set up I/O streams */
-			server->json_stream = g_unix_input_stream_new(std_out, TRUE);
-			server->pass_stream = g_unix_output_stream_new(std_in, TRUE);
+	return (ra->index > rb->index) - (ra->index < rb->index);
+}
 
-			gchar * pass = g_strdup(server->password);
-			g_output_stream_write_async(server->pass_stream,
-			                            pass,
-			                            strlen(pass), /* number of bytes */
-			                            G_PRIORITY_DEFAULT, /* priority */
-			                            NULL, /* cancellable */
-			                            password_write_cb,
-			                            pass);
-		}
+/**
+ * uccs_server_flush:
+ * @server: Server to flush
+ *
+ * Writes everything that is waiting to go to disk and waits for the
+ * writes to finish.  Call before exiting.
+ */
+void
+uccs_server_flush (UccsServer * server)
+{
+	g_return_if_fail(IS_UCCS_SERVER(server));
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, server->sessions);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		session_last_used_save((UccsSession *)value);
+	}
+
+	while (server->last_used_writes > 0) {
+		g_main_context_iteration(NULL, TRUE);
 	}
 
 	return;
@@ -790,8 +2727,9 @@ null_server_array (void)
  * @server: Server to get our list from
  * @address: Who's asking
  *
- * Will get a valid variant with servers.  If the asker hasn't unlocked us
- * then the list will always be empty.
+ * Will get a valid variant with the servers of the user @address has
+ * unlocked us as.  If the asker hasn't unlocked us then the list will
+ * always be empty.
  *
  * Return value: A variant array
  */
@@ -801,66 +2739,86 @@ uccs_server_get_servers (UccsServer * server, const gchar * address)
 	g_return_val_if_fail(IS_UCCS_SERVER(server), null_server_array());
 	g_return_val_if_fail(address != NULL, null_server_array());
 
-	if (!GPOINTER_TO_INT(g_hash_table_lookup(server->lovers, address))) {
+	UccsSession * session = g_hash_table_lookup(server->senders, address);
+
+	if (session == NULL) {
 		g_warning("Address '%s' is not authorized", address);
 		return null_server_array();
 	}
 
 	gchar *last_used_server_name = NULL;
-	if (server->username != NULL && server->password != NULL) {
-		gchar *username_sha = g_compute_checksum_for_string (G_CHECKSUM_SHA256, server->username, -1);
-		gchar *file_path = g_build_path ("/", g_get_user_cache_dir(), "remote-logon-service", "cache", username_sha, NULL);
-		gchar *encryptedContents;
-		gsize encryptedContentsLength;
-		if (g_file_get_contents (file_path, &encryptedContents, &encryptedContentsLength, NULL)) {
-			gchar *file_contents = do_aes_decrypt(encryptedContents, server->password, encryptedContentsLength);
-			g_free (encryptedContents);
-			if (file_contents != NULL) {
-				GKeyFile * key_file = g_key_file_new();
-				if (g_key_file_load_from_data (key_file, file_contents, strlen (file_contents), G_KEY_FILE_NONE, NULL)) {
-					last_used_server_name = g_key_file_get_string (key_file, server->parent.name, "last_used", NULL);
-				}
-				g_key_file_free (key_file);
-				g_free (file_contents);
-			}
-		}
-		g_free (username_sha);
-		g_free (file_path);
+	GKeyFile * last_used = session_get_last_used(session);
+	if (last_used != NULL) {
+		last_used_server_name = g_key_file_get_string (last_used, server->parent.name, "last_used", NULL);
 	}
 
 	GVariantBuilder array;
 	g_variant_builder_init(&array, G_VARIANT_TYPE_ARRAY);
-	GList * lserver;
+	guint subservercnt = session->subservers != NULL ? server_table_length(session->subservers) : 0;
+	guint i;
 	gint servercnt = 0;
 
-	Server * last_used_server = NULL;
-	if (last_used_server_name != NULL) {
-		for (lserver = server->subservers; last_used_server == NULL && lserver != NULL; lserver = g_list_next(lserver)) {
-			Server * serv = SERVER(lserver->data);
-
-			/* We only want servers that are all good */
-			if (serv->state != SERVER_STATE_ALLGOOD) {
-				continue;
-			}
-			if (g_strcmp0(serv->name, last_used_server_name) == 0)
-				last_used_server = serv;
+	gint last_used_server = -1;
+	for (i = 0; last_used_server_name != NULL && last_used_server < 0 && i < subservercnt; i++) {
+		/* We only want servers that are all good */
+		if (server_table_get_state(session->subservers, i) != SERVER_STATE_ALLGOOD) {
+			continue;
 		}
+		if (g_strcmp0(server_table_get_name(session->subservers, i), last_used_server_name) == 0)
+			last_used_server = i;
 	}
 	g_free (last_used_server_name);
 
-	for (lserver = server->subservers; lserver != NULL; lserver = g_list_next(lserver)) {
-		Server * serv = SERVER(lserver->data);
+	/* Ranking them, they go in once they're sorted.  Scores are kept
+	   with the servers, so that needs their objects. */
+	GArray * ranked = NULL;
+	gchar * health_group = NULL;
+	if (server->rank_servers) {
+		ranked = g_array_sized_new(FALSE, FALSE, sizeof(ranked_t), subservercnt);
+		health_group = session_health_group(session);
+	}
 
+	for (i = 0; i < subservercnt; i++) {
 		/* We only want servers that are all good */
-		if (serv->state != SERVER_STATE_ALLGOOD) {
+		if (server_table_get_state(session->subservers, i) != SERVER_STATE_ALLGOOD) {
+			continue;
+		}
+
+		if (last_used_server >= 0)
+			server_table_set_last_used(session->subservers, i, last_used_server == (gint)i);
+
+		if (ranked != NULL) {
+			Server * serv = server_table_get_server(session->subservers, i);
+			ranked_t rank;
+			rank.server = serv;
+			rank.score = session_server_score(last_used, health_group, serv);
+			rank.index = i;
+
+			server_set_score(serv, rank.score);
+			g_array_append_val(ranked, rank);
 			continue;
 		}
 
-		if (last_used_server != NULL)
-			serv->last_used = last_used_server == serv;
+		GVariant * variant = server_table_get_variant(session->subservers, i);
+		if (variant != NULL) {
+			servercnt++;
+			g_variant_builder_add_value(&array, variant);
+			g_variant_unref(variant);
+		}
+	}
+
+	if (ranked != NULL) {
+		g_array_sort(ranked, ranked_compare);
+
+		for (i = 0; i < ranked->len; i++) {
+			servercnt++;
+			GVariant * variant = server_get_variant(g_array_index(ranked, ranked_t, i).server);
+			g_variant_builder_add_value(&array, variant);
+			g_variant_unref(variant);
+		}
 
-		servercnt++;
-		g_variant_builder_add_value(&array, server_get_variant(serv));
+		g_array_free(ranked, TRUE);
+		g_free(health_group);
 	}
 
 	if (servercnt == 0) {
@@ -880,79 +2838,126 @@ get_cached_domains (Server * server)
 	return g_variant_new_array(G_VARIANT_TYPE_STRING, NULL, 0);
 }
 
-/* Tail recursive function to look at a list entry and see
-   if that server matches a URI, or go down the list */
+/* Look up a subserver of the user by URI */
 static Server *
-find_uri_helper (GList * list, const gchar * uri)
+session_find_uri (UccsSession * session, const gchar * uri)
 {
-	if (list == NULL) return NULL;
-
-	Server * inserver = SERVER(list->data);
-
-	if (inserver == NULL) {
-		return find_uri_helper(g_list_next(list), uri);
+	if (session->subservers == NULL) {
+		return NULL;
 	}
 
-	Server * outserver = server_find_uri(inserver, uri);
-
-	if (outserver != NULL) {
-		return outserver;
+	gint found = server_table_find_uri(session->subservers, uri);
+	if (found < 0) {
+		return NULL;
 	}
 
-	return find_uri_helper(g_list_next(list), uri);
+	return server_table_get_server(session->subservers, found);
 }
 
-/* Look through our subservers to see if any of them match this
-   URI either */
+/* Look up the URI in the subservers of each of the users */
 static Server *
 find_uri (Server * server, const gchar * uri)
 {
 	g_return_val_if_fail(IS_UCCS_SERVER(server), NULL);
 	/* If it is this server that's handled by the super class */
-	return find_uri_helper(UCCS_SERVER(server)->subservers, uri);
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, UCCS_SERVER(server)->sessions);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		Server * outserver = session_find_uri((UccsSession *)value, uri);
+
+		if (outserver != NULL) {
+			return outserver;
+		}
+	}
+
+	return NULL;
 }
 
-/* Look through our subservers to see if any of them match this
-   URI and set as used */
+/* Mark the subserver with this URI as used for the user of the session
+   and remember it on disk */
 static void
-set_last_used_server (Server * server, const gchar * uri)
+session_set_last_used_server (UccsSession * session, const gchar * uri)
 {
-	Server * subserver = server_find_uri(server, uri);
+	UccsServer * server = session->server;
+	gint found = -1;
 
-	if (subserver != NULL) {
-		subserver->last_used = TRUE;
+	if (session->subservers != NULL) {
+		found = server_table_find_uri(session->subservers, uri);
+	}
 
-		/* Write to disk */
-		if (UCCS_SERVER(server)->username != NULL && UCCS_SERVER(server)->password) {
-			GKeyFile * key_file = g_key_file_new();
-			g_key_file_set_string (key_file, server->name, "last_used", subserver->name);
-			gsize data_length;
-			gchar *data = g_key_file_to_data (key_file, &data_length, NULL);
-			g_key_file_free (key_file);
-
-			size_t enc_data_length;
-			gchar *enc_data = do_aes_encrypt(data, UCCS_SERVER(server)->password, &enc_data_length);
-			g_free (data);
-
-			gchar *dir_path = g_build_path ("/", g_get_user_cache_dir(), "remote-logon-service", "cache", NULL);
-			gint status = g_mkdir_with_parents (dir_path, 0700);
-			if (status == 0)
-			{
-				gchar *username_sha = g_compute_checksum_for_string (G_CHECKSUM_SHA256, UCCS_SERVER(server)->username, -1);
-				gchar *path = g_build_path ("/", dir_path, username_sha, NULL);
-				gboolean success = g_file_set_contents (path, enc_data, enc_data_length, NULL);
-				if (!success) {
-					g_warning("Failed writing cache data to '%s'.", path);
-				}
-				g_free (username_sha);
-				g_free (path);
+	if (found >= 0) {
+		const gchar * name = server_table_get_name(session->subservers, found);
+		server_table_set_last_used(session->subservers, found, TRUE);
+
+		/* Write to disk, once things settle down */
+		if (session->username != NULL && session->password) {
+			/* Update what we have so the other servers' entries stay */
+			GKeyFile * key_file = session_get_last_used(session);
+			if (key_file == NULL) {
+				key_file = session->last_used = g_key_file_new();
 			}
-			else
-			{
-				g_warning("Failed to create '%s'.", dir_path);
+
+			g_key_file_set_string (key_file, server->parent.name, "last_used", name);
+			session_last_used_changed(session);
+
+			/* Picking it counts as it working out */
+			if (server->rank_servers) {
+				session_record_health(session, name, TRUE);
 			}
-			g_free (enc_data);
-			g_free (dir_path);
 		}
 	}
 }
+
+/* Without knowing who's asking we go with the first user that has a
+   server with this URI */
+static void
+set_last_used_server (Server * server, const gchar * uri)
+{
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, UCCS_SERVER(server)->sessions);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		UccsSession * session = (UccsSession *)value;
+
+		if (session->subservers != NULL && server_table_find_uri(session->subservers, uri) >= 0) {
+			session_set_last_used_server(session, uri);
+			return;
+		}
+	}
+}
+
+/**
+ * uccs_server_set_last_used_server:
+ * @server: Server the subserver is in
+ * @address: Who's asking
+ * @uri: URI of the subserver
+ *
+ * Sets the subserver with @uri as the last used one for the user
+ * @address has unlocked us as.
+ */
+void
+uccs_server_set_last_used_server (UccsServer * server, const gchar * address, const gchar * uri)
+{
+	g_return_if_fail(IS_UCCS_SERVER(server));
+	g_return_if_fail(address != NULL);
+
+	if (g_strcmp0(server->parent.uri, uri) == 0) {
+		server_set_last_used(SERVER(server), TRUE);
+		return;
+	}
+
+	UccsSession * session = g_hash_table_lookup(server->senders, address);
+
+	if (session == NULL) {
+		g_warning("Address '%s' is not authorized", address);
+		return;
+	}
+
+	session_set_last_used_server(session, uri);
+
+	return;
+}
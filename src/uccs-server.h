@@ -25,6 +25,8 @@
 #include <libnm/NetworkManager.h>
 #include <libsoup/soup.h>
 #include "server.h"
+#include "server-probe.h"
+#include "uccs-agent.h"
 
 G_BEGIN_DECLS
 
@@ -38,6 +40,11 @@ G_BEGIN_DECLS
 typedef struct _UccsServer      UccsServer;
 typedef struct _UccsServerClass UccsServerClass;
 
+/* @unlocked is whether the credentials worked.  If they couldn't be
+   checked @error says why, G_IO_ERROR_TIMED_OUT when the agent or the
+   broker didn't answer in time. */
+typedef void (*UccsServerUnlockCallback) (UccsServer * server, gboolean unlocked, gboolean cached, const GError * error, gpointer user_data);
+
 struct _UccsServerClass {
 	ServerClass parent_class;
 };
@@ -46,37 +53,48 @@ struct _UccsServer {
 	Server parent;
 
 	gchar * exec;
+	gboolean persistent;
+	UccsAgent * agent;
+	gboolean native;
 
-	gchar * username;
-	gchar * password;
-
-	GHashTable * lovers;
-
-	GList * subservers;
+	GHashTable * sessions;
+	GHashTable * senders;
 
-	GList * json_waiters;
-	guint json_watch;
-	GPid json_pid;
-
-	GInputStream * json_stream;
-	GOutputStream * pass_stream;
+	guint refresh_interval;
+	guint timeout;
+	guint last_used_writes;
 
 	NMState min_network;
 	NMState last_network;
 	NMClient * nm_client;
 	gulong nm_signal;
 
+	gboolean probe_servers;
+	gboolean rank_servers;
+	gboolean resolve_servers;
+	ServerProbe * resolve;
+
 	gboolean verify_server;
 	gboolean verified_server;
+	SoupMessage * verify_message;
+	guint probe_interval;
+	guint probe_timer;
+	guint probe_failures;
+	gint64 probe_start;
+	gint64 latency;
 	SoupSession * session;
+	GCancellable * cancel;
 };
 
 GType uccs_server_get_type (void);
 Server * uccs_server_new_from_keyfile (GKeyFile * keyfile, const gchar * name);
-void uccs_server_unlock (UccsServer * server, const gchar * address, const gchar * username, const gchar * password, gboolean allowcache, void (*callback) (UccsServer * server, gboolean unlocked, gpointer user_data), gpointer user_data);
+gboolean uccs_server_unlock (UccsServer * server, const gchar * address, const gchar * username, const gchar * password, gboolean allowcache, UccsServerUnlockCallback callback, gpointer user_data);
 GVariant * uccs_server_get_servers (UccsServer * server, const gchar * address);
+void uccs_server_set_last_used_server (UccsServer * server, const gchar * address, const gchar * uri);
+void uccs_server_flush (UccsServer * server);
 const gchar *uccs_server_set_exec (UccsServer * server, const gchar * exec);
 void uccs_notify_state_change (UccsServer * server);
+guint uccs_server_probe_delay (UccsServer * server);
 
 G_END_DECLS
 
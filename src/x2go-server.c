@@ -23,34 +23,35 @@
 #include "config.h"
 #endif
 
-#include <sys/mman.h>
-
 #include <glib/gi18n.h>
 
-#include <string.h>
-
 #include "x2go-server.h"
 #include "defines.h"
 
 static void x2go_server_class_init (X2GoServerClass *klass);
 static void x2go_server_init       (X2GoServer *self);
-static void x2go_server_dispose    (GObject *object);
-static void x2go_server_finalize   (GObject *object);
-static GVariant *  get_properties        (Server * server);
 
 G_DEFINE_TYPE (X2GoServer, x2go_server, SERVER_TYPE);
 
+/* What the broker can tell us about an X2Go server */
+static const ServerField fields[] = {
+       { JSON_USERNAME,    SERVER_FIELD_STRING,  G_STRUCT_OFFSET(X2GoServer, username), "username", -1 },
+       { JSON_PASSWORD,    SERVER_FIELD_SECRET,  G_STRUCT_OFFSET(X2GoServer, password), "password", -1 },
+       { JSON_COMMNAD,     SERVER_FIELD_STRING,  G_STRUCT_OFFSET(X2GoServer, command), "command", G_STRUCT_OFFSET(X2GoServer, command_required) },
+       { JSON_COMMNAD_REQ, SERVER_FIELD_BOOLEAN, G_STRUCT_OFFSET(X2GoServer, command_required), NULL, -1 }
+};
+
+/* SSH */
+static const guint16 probe_ports[] = { 22, 0 };
+
 static void
 x2go_server_class_init (X2GoServerClass *klass)
 {
-       GObjectClass *object_class = G_OBJECT_CLASS (klass);
-
-       object_class->dispose = x2go_server_dispose;
-       object_class->finalize = x2go_server_finalize;
-
        ServerClass * server_class = SERVER_CLASS(klass);
 
-       server_class->get_properties = get_properties;
+       server_class->protocol = "x2go";
+       server_class_set_fields(server_class, fields, G_N_ELEMENTS(fields));
+       server_class->probe_ports = probe_ports;
 
        return;
 }
@@ -66,84 +67,6 @@ x2go_server_init (X2GoServer *self)
        return;
 }
 
-static void
-x2go_server_dispose (GObject *object)
-{
-
-       G_OBJECT_CLASS (x2go_server_parent_class)->dispose (object);
-       return;
-}
-
-/* Unlocks the memory before freeing */
-static void
-password_clear (gpointer data)
-{
-       char * pass = (char *)data;
-       munlock(pass, strlen(pass));
-       g_free(pass);
-       return;
-}
-
-static void
-x2go_server_finalize (GObject *object)
-{
-       X2GoServer * server = X2GO_SERVER(object);
-
-       g_clear_pointer(&server->username, g_free);
-       g_clear_pointer(&server->password, password_clear);
-       g_clear_pointer(&server->command, g_free);
-
-       G_OBJECT_CLASS (x2go_server_parent_class)->finalize (object);
-       return;
-}
-
-static GVariant *
-get_properties (Server * server)
-{
-       X2GoServer * rserver = X2GO_SERVER(server);
-
-       GVariantBuilder propbuilder;
-       g_variant_builder_init(&propbuilder, G_VARIANT_TYPE_ARRAY);
-
-       GVariantBuilder namebuilder;
-       g_variant_builder_init(&namebuilder, G_VARIANT_TYPE_TUPLE);
-       g_variant_builder_add_value(&namebuilder, g_variant_new_string("username"));
-       g_variant_builder_add_value(&namebuilder, g_variant_new_boolean(TRUE));
-       if (rserver->username == NULL) {
-               g_variant_builder_add_value(&namebuilder, g_variant_new_variant(g_variant_new_string("")));
-       } else {
-               g_variant_builder_add_value(&namebuilder, g_variant_new_variant(g_variant_new_string(rserver->username)));
-       }
-       g_variant_builder_add_value(&namebuilder, g_variant_parse(G_VARIANT_TYPE_VARDICT, "{}", NULL, NULL, NULL));
-       g_variant_builder_add_value(&propbuilder, g_variant_builder_end(&namebuilder));
-
-       GVariantBuilder passbuilder;
-       g_variant_builder_init(&passbuilder, G_VARIANT_TYPE_TUPLE);
-       g_variant_builder_add_value(&passbuilder, g_variant_new_string("password"));
-       g_variant_builder_add_value(&passbuilder, g_variant_new_boolean(TRUE));
-       if (rserver->password == NULL) {
-               g_variant_builder_add_value(&passbuilder, g_variant_new_variant(g_variant_new_string("")));
-       } else {
-               g_variant_builder_add_value(&passbuilder, g_variant_new_variant(g_variant_new_string(rserver->password)));
-       }
-       g_variant_builder_add_value(&passbuilder, g_variant_parse(G_VARIANT_TYPE_VARDICT, "{}", NULL, NULL, NULL));
-       g_variant_builder_add_value(&propbuilder, g_variant_builder_end(&passbuilder));
-
-       GVariantBuilder commandbuilder;
-       g_variant_builder_init(&commandbuilder, G_VARIANT_TYPE_TUPLE);
-       g_variant_builder_add_value(&commandbuilder, g_variant_new_string("command"));
-       g_variant_builder_add_value(&commandbuilder, g_variant_new_boolean(rserver->command_required));
-       if (rserver->command == NULL) {
-               g_variant_builder_add_value(&commandbuilder, g_variant_new_variant(g_variant_new_string("")));
-       } else {
-               g_variant_builder_add_value(&commandbuilder, g_variant_new_variant(g_variant_new_string(rserver->command)));
-       }
-       g_variant_builder_add_value(&commandbuilder, g_variant_parse(G_VARIANT_TYPE_VARDICT, "{}", NULL, NULL, NULL));
-       g_variant_builder_add_value(&propbuilder, g_variant_builder_end(&commandbuilder));
-
-       return g_variant_builder_end(&propbuilder);
-}
-
 Server *
 x2go_server_new_from_keyfile (GKeyFile * keyfile, const gchar * groupname)
 {
@@ -159,69 +82,14 @@ x2go_server_new_from_keyfile (GKeyFile * keyfile, const gchar * groupname)
 
        if (g_key_file_has_key(keyfile, groupname, CONFIG_SERVER_NAME, NULL)) {
                gchar * keyname = g_key_file_get_string(keyfile, groupname, CONFIG_SERVER_NAME, NULL);
-               server->parent.name = g_strdup(_(keyname));
+               server->parent.name = g_intern_string(_(keyname));
                g_free(keyname);
        }
 
        if (g_key_file_has_key(keyfile, groupname, CONFIG_SERVER_URI, NULL)) {
-               server->parent.uri = g_key_file_get_string(keyfile, groupname, CONFIG_SERVER_URI, NULL);
-       }
-
-       return SERVER(server);
-}
-
-/* Build the X2Go server from information in the JSON object */
-Server *
-x2go_server_new_from_json (JsonObject * object)
-{
-       X2GoServer * server = g_object_new(X2GO_SERVER_TYPE, NULL);
-
-       if (json_object_has_member(object, JSON_SERVER_NAME)) {
-               JsonNode * node = json_object_get_member(object, JSON_SERVER_NAME);
-               if (JSON_NODE_TYPE(node) == JSON_NODE_VALUE && json_node_get_value_type(node) == G_TYPE_STRING) {
-                       const gchar * name = json_node_get_string(node);
-                       server->parent.name = g_strdup(name);
-               }
-       }
-
-       if (json_object_has_member(object, JSON_URI)) {
-               JsonNode * node = json_object_get_member(object, JSON_URI);
-               if (JSON_NODE_TYPE(node) == JSON_NODE_VALUE && json_node_get_value_type(node) == G_TYPE_STRING) {
-                       const gchar * uri = json_node_get_string(node);
-                       server->parent.uri = g_strdup(uri);
-               }
-       }
-
-       if (json_object_has_member(object, JSON_USERNAME)) {
-               JsonNode * node = json_object_get_member(object, JSON_USERNAME);
-               if (JSON_NODE_TYPE(node) == JSON_NODE_VALUE && json_node_get_value_type(node) == G_TYPE_STRING) {
-                       const gchar * username = json_node_get_string(node);
-                       server->username = g_strdup(username);
-               }
-       }
-
-       if (json_object_has_member(object, JSON_PASSWORD)) {
-               JsonNode * node = json_object_get_member(object, JSON_PASSWORD);
-               if (JSON_NODE_TYPE(node) == JSON_NODE_VALUE && json_node_get_value_type(node) == G_TYPE_STRING) {
-                       const gchar * password = json_node_get_string(node);
-                       server->password = g_strdup(password);
-                       mlock(server->password, strlen(server->password));
-               }
-       }
-
-       if (json_object_has_member(object, JSON_COMMNAD)) {
-               JsonNode * node = json_object_get_member(object, JSON_COMMNAD);
-               if (JSON_NODE_TYPE(node) == JSON_NODE_VALUE && json_node_get_value_type(node) == G_TYPE_STRING) {
-                       const gchar * command = json_node_get_string(node);
-                       server->command = g_strdup(command);
-               }
-       }
-
-       if (json_object_has_member(object, JSON_COMMNAD_REQ)) {
-               JsonNode * node = json_object_get_member(object, JSON_COMMNAD_REQ);
-               if (JSON_NODE_TYPE(node) == JSON_NODE_VALUE && json_node_get_value_type(node) == G_TYPE_BOOLEAN) {
-                       server->command_required = json_node_get_boolean(node);
-               }
+               gchar * uri = g_key_file_get_string(keyfile, groupname, CONFIG_SERVER_URI, NULL);
+               server->parent.uri = g_intern_string(uri);
+               g_free(uri);
        }
 
        return SERVER(server);
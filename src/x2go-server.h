@@ -45,15 +45,14 @@ struct _X2GoServerClass {
 struct _X2GoServer {
        Server parent;
 
-       gchar * username;
+       const gchar * username;
        gchar * password;
-       gchar * command;
+       const gchar * command;
        gboolean command_required;
 };
 
 GType x2go_server_get_type (void);
 Server * x2go_server_new_from_keyfile (GKeyFile * keyfile, const gchar * name);
-Server * x2go_server_new_from_json (JsonObject * object);
 
 G_END_DECLS
 
@@ -1,7 +1,11 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <glib/gstdio.h>
 #include <libdbustest/dbus-test.h>
+#include <libsoup/soup.h>
+#include <string.h>
+#include <unistd.h>
 
 typedef struct _slmock_table_t slmock_table_t;
 typedef struct _slmock_server_t slmock_server_t;
@@ -145,15 +149,55 @@ find_server (GVariant * varray, slmock_server_t * server)
 	return FALSE;
 }
 
+static void
+slmock_clear_cache(slmock_table_t * slmockdata)
+{
+	gchar *username_sha = g_compute_checksum_for_string (G_CHECKSUM_SHA256, slmockdata->username, -1);
+	gchar *uri_sha = g_compute_checksum_for_string (G_CHECKSUM_SHA256, "https://slmock.com/", -1);
+	gchar *list_name = g_strdup_printf ("%s-%s.json", username_sha, uri_sha);
+	gchar *file_path = g_build_path ("/", g_get_user_cache_dir(), "remote-logon-service", "cache", username_sha, NULL);
+	gchar *list_path = g_build_path ("/", g_get_user_cache_dir(), "remote-logon-service", "cache", list_name, NULL);
+	unlink (file_path);
+	unlink (list_path);
+	g_free (username_sha);
+	g_free (uri_sha);
+	g_free (list_name);
+	g_free (file_path);
+	g_free (list_path);
+}
+
+static gboolean
+slmock_check_reply(GVariant * retval, slmock_table_t * slmockdata, const gchar * datatype)
+{
+	g_assert(retval != NULL);
+	g_assert(g_variant_n_children(retval) == 3);
+
+	GVariant * loggedin = g_variant_get_child_value(retval, 0);
+	g_assert(g_variant_get_boolean(loggedin));
+	g_variant_unref(loggedin); loggedin = NULL;
+
+	GVariant * data = g_variant_get_child_value(retval, 1);
+	g_assert(g_strcmp0(g_variant_get_string(data, NULL), datatype) == 0);
+	g_variant_unref(data); data = NULL;
+
+	GVariant * array = g_variant_get_child_value(retval, 2);
+	int i;
+	// Check all servers should be in the result are in the result
+	for (i = 0; slmockdata->servers[i].name != NULL; i++) {
+		g_assert(find_server(array, &slmockdata->servers[i]));
+	}
+	// Check there is no more servers in the result than we expected
+	g_assert(i == g_variant_n_children(array));
+	g_variant_unref(array);
+
+	return TRUE;
+}
+
 static gboolean
-slmock_check_login(GDBusConnection * session, slmock_table_t * slmockdata, gboolean clear_cache)
+slmock_check_login(GDBusConnection * session, slmock_table_t * slmockdata, gboolean clear_cache, const gchar * datatype)
 {
 	if (clear_cache) {
-		gchar *username_sha = g_compute_checksum_for_string (G_CHECKSUM_SHA256, slmockdata->username, -1);
-		gchar *file_path = g_build_path ("/", g_get_user_cache_dir(), "remote-logon-service", "cache", username_sha, NULL);
-		unlink (file_path);
-		g_free (username_sha);
-		g_free (file_path);
+		slmock_clear_cache(slmockdata);
 	}
 	GVariant * retval = g_dbus_connection_call_sync(session,
 	                                                "org.ArcticaProject.RemoteLogon",
@@ -171,40 +215,710 @@ slmock_check_login(GDBusConnection * session, slmock_table_t * slmockdata, gbool
 	                                                NULL,
 	                                                NULL);
 
+	g_assert(slmock_check_reply(retval, slmockdata, datatype));
+
+	g_variant_unref(retval);
+
+	return TRUE;
+}
+
+static void
+test_getservers_slmock (gconstpointer data)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	g_assert(slmock_check_login(session, (slmock_table_t *)data, TRUE, "network"));
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+static void
+test_getservers_slmock_none (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	GVariant * retval = g_dbus_connection_call_sync(session,
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "/org/ArcticaProject/RemoteLogon",
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "GetServersForLogin",
+	                                                g_variant_new("(sssb)",
+	                                                              "https://slmock.com/",
+	                                                              "Baduser",
+	                                                              "Badpass",
+	                                                              TRUE), /* params */
+	                                                G_VARIANT_TYPE("(bsa(sssba(sbva{sv})a(si)))"), /* ret type */
+	                                                G_DBUS_CALL_FLAGS_NONE,
+	                                                -1,
+	                                                NULL,
+	                                                NULL);
+
 	g_assert(retval != NULL);
 	g_assert(g_variant_n_children(retval) == 3);
 
 	GVariant * loggedin = g_variant_get_child_value(retval, 0);
-	g_assert(g_variant_get_boolean(loggedin));
+	g_assert(!g_variant_get_boolean(loggedin));
 	g_variant_unref(loggedin); loggedin = NULL;
 
-	GVariant * data = g_variant_get_child_value(retval, 1);
-	g_assert(g_strcmp0(g_variant_get_string(data, NULL), "network") == 0);
-	g_variant_unref(data); data = NULL;
+	GVariant * array = g_variant_get_child_value(retval, 2);
+	g_assert(g_variant_n_children(array) == 0);
+	g_variant_unref(array);
+	g_variant_unref(retval);
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+static void
+test_getservers_slmock_two (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	g_assert(slmock_check_login(session, &slmock_table[0], TRUE, "network"));
+	g_assert(slmock_check_login(session, &slmock_table[1], TRUE, "network"));
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+/* Two UCCS servers with the same URI, the first one in the config
+   file is the one that has to get used */
+static void
+test_getservers_slmock_duplicate (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_DUPLICATE_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	g_assert(slmock_check_login(session, &slmock_table[1], TRUE, "network"));
+
+	/* A subserver of the first one is found by its URI */
+	GError * error = NULL;
+	GVariant * retval = g_dbus_connection_call_sync(session,
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "/org/ArcticaProject/RemoteLogon",
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "GetCachedDomainsForServer",
+	                                                g_variant_new("(s)", freerdp2_server_table[0].uri), /* params */
+	                                                G_VARIANT_TYPE("(as)"), /* ret type */
+	                                                G_DBUS_CALL_FLAGS_NONE,
+	                                                -1,
+	                                                NULL,
+	                                                &error);
+
+	g_assert_no_error(error);
+	g_assert(retval != NULL);
+	g_variant_unref(retval);
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+static void
+test_getservers_slmock_persistent (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_PERSISTENT_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	/* Same agent answers both of them */
+	g_assert(slmock_check_login(session, &slmock_table[0], TRUE, "network"));
+	g_assert(slmock_check_login(session, &slmock_table[1], TRUE, "network"));
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+/* An agent that doesn't know the persistent mode answers without a
+   status, which must not be taken for a wrong password */
+static void
+test_getservers_slmock_legacy (void)
+{
+	/* Where the old agent puts anything it got for a password */
+	gchar * leak = g_build_filename(g_get_tmp_dir(), "slmock-legacy-leak-XXXXXX", NULL);
+	gint fd = g_mkstemp(leak);
+	g_assert(fd != -1);
+	close(fd);
+	g_unlink(leak);
+	g_setenv("SLMOCK_LEGACY_LEAK", leak, TRUE);
+
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_LEGACY_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	/* Both go to one-shot agents, the second without trying again */
+	g_assert(slmock_check_login(session, &slmock_table[0], TRUE, "network"));
+	g_assert(slmock_check_login(session, &slmock_table[1], TRUE, "network"));
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	/* It never got to see a password */
+	g_assert(!g_file_test(leak, G_FILE_TEST_EXISTS));
+
+	g_unsetenv("SLMOCK_LEGACY_LEAK");
+	g_free(leak);
+
+	return;
+}
+
+/* A broker serving /api/5 with what the mock agent says, so NativeFetch
+   has something to talk to.  It runs in a thread of its own as the
+   test blocks on the service. */
+typedef enum _broker_mode_t broker_mode_t;
+enum _broker_mode_t {
+	BROKER_OK,
+	BROKER_DENY,
+	BROKER_BROKEN
+};
+
+typedef struct _broker_t broker_t;
+struct _broker_t {
+	GMainContext * context;
+	GMainLoop * loop;
+	GThread * thread;
+	SoupServer * server;
+	gchar * uri;
+	gint mode;
+	gint requests;
+};
+
+static void
+broker_handler (SoupServer * server, SoupMessage * msg, const char * path, GHashTable * query, SoupClientContext * client, gpointer user_data)
+{
+	broker_t * broker = (broker_t *)user_data;
+
+	/* The service checking that we're up */
+	if (msg->method == SOUP_METHOD_HEAD) {
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		return;
+	}
+
+	if (g_strcmp0(path, "/api/5") != 0) {
+		soup_message_set_status(msg, SOUP_STATUS_NOT_FOUND);
+		return;
+	}
+
+	g_atomic_int_inc(&broker->requests);
+
+	switch (g_atomic_int_get(&broker->mode)) {
+	case BROKER_DENY:
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+		return;
+	case BROKER_BROKEN:
+		soup_message_set_status(msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return;
+	}
+
+	const gchar * authorization = soup_message_headers_get_one(msg->request_headers, "Authorization");
+	if (authorization == NULL || !g_str_has_prefix(authorization, "Basic ")) {
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+		return;
+	}
+
+	gsize length = 0;
+	guchar * decoded = g_base64_decode(authorization + strlen("Basic "), &length);
+	gchar * credentials = g_strndup((const gchar *)decoded, length);
+	gchar * password = strchr(credentials, ':');
+	g_free(decoded);
+
+	if (password == NULL) {
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+		g_free(credentials);
+		return;
+	}
+
+	*password++ = '\0';
+
+	GSubprocess * agent = g_subprocess_new(G_SUBPROCESS_FLAGS_STDIN_PIPE | G_SUBPROCESS_FLAGS_STDOUT_PIPE, NULL, SLMOCK, credentials, NULL);
+	gchar * output = NULL;
+	g_assert(agent != NULL);
+
+	if (g_subprocess_communicate_utf8(agent, password, NULL, &output, NULL, NULL) && g_subprocess_get_successful(agent)) {
+		soup_message_set_status(msg, SOUP_STATUS_OK);
+		soup_message_set_response(msg, "application/json", SOUP_MEMORY_TAKE, output, strlen(output));
+		output = NULL;
+	} else {
+		soup_message_set_status(msg, SOUP_STATUS_UNAUTHORIZED);
+	}
+
+	g_free(output);
+	g_object_unref(agent);
+	g_free(credentials);
+
+	return;
+}
+
+static gpointer
+broker_thread (gpointer user_data)
+{
+	broker_t * broker = (broker_t *)user_data;
+
+	g_main_context_push_thread_default(broker->context);
+	g_main_loop_run(broker->loop);
+	g_main_context_pop_thread_default(broker->context);
+
+	return NULL;
+}
+
+static broker_t *
+broker_new (void)
+{
+	broker_t * broker = g_new0(broker_t, 1);
+
+	broker->context = g_main_context_new();
+	broker->loop = g_main_loop_new(broker->context, FALSE);
+
+	/* Its sockets get watched from the broker's context */
+	g_main_context_push_thread_default(broker->context);
+	broker->server = soup_server_new(NULL, NULL);
+	soup_server_add_handler(broker->server, NULL, broker_handler, broker, NULL);
+	g_assert(soup_server_listen_local(broker->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, NULL));
+	g_main_context_pop_thread_default(broker->context);
+
+	GSList * uris = soup_server_get_uris(broker->server);
+	g_assert(uris != NULL);
+	broker->uri = soup_uri_to_string((SoupURI *)uris->data, FALSE);
+	g_slist_free_full(uris, (GDestroyNotify)soup_uri_free);
+
+	broker->thread = g_thread_new("broker", broker_thread, broker);
+
+	return broker;
+}
+
+static gboolean
+broker_quit_cb (gpointer user_data)
+{
+	g_main_loop_quit((GMainLoop *)user_data);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+broker_free (broker_t * broker)
+{
+	/* Through the context so it can't come before the loop runs */
+	GSource * source = g_idle_source_new();
+	g_source_set_callback(source, broker_quit_cb, broker->loop, NULL);
+	g_source_attach(source, broker->context);
+	g_source_unref(source);
+
+	g_thread_join(broker->thread);
+
+	g_object_unref(broker->server);
+	g_main_loop_unref(broker->loop);
+	g_main_context_unref(broker->context);
+	g_free(broker->uri);
+	g_free(broker);
+
+	return;
+}
+
+/* A config with the broker as its UCCS server, the mock agent being
+   the fallback */
+static gchar *
+broker_config_new (broker_t * broker)
+{
+	GKeyFile * keyfile = g_key_file_new();
+	g_key_file_set_string(keyfile, "Remote Logon Service", "Servers", "SLMock Server");
+	g_key_file_set_string(keyfile, "Server SLMock Server", "Name", "SLMock");
+	g_key_file_set_string(keyfile, "Server SLMock Server", "Type", "UCCS");
+	g_key_file_set_string(keyfile, "Server SLMock Server", "URI", broker->uri);
+	g_key_file_set_string(keyfile, "Server SLMock Server", "Exec", SLMOCK);
+	g_key_file_set_string(keyfile, "Server SLMock Server", "NetworkRequired", "None");
+	g_key_file_set_boolean(keyfile, "Server SLMock Server", "NativeFetch", TRUE);
+
+	gchar * path = NULL;
+	gint fd = g_file_open_tmp("slmock-native-XXXXXX.conf", &path, NULL);
+	g_assert(fd >= 0);
+	g_close(fd, NULL);
+
+	g_assert(g_key_file_save_to_file(keyfile, path, NULL));
+	g_key_file_free(keyfile);
+
+	return path;
+}
+
+static GVariant *
+broker_login (GDBusConnection * session, broker_t * broker, const gchar * username, const gchar * password)
+{
+	return g_dbus_connection_call_sync(session,
+	                                   "org.ArcticaProject.RemoteLogon",
+	                                   "/org/ArcticaProject/RemoteLogon",
+	                                   "org.ArcticaProject.RemoteLogon",
+	                                   "GetServersForLogin",
+	                                   g_variant_new("(sssb)",
+	                                                 broker->uri,
+	                                                 username,
+	                                                 password,
+	                                                 FALSE), /* params */
+	                                   G_VARIANT_TYPE("(bsa(sssba(sbva{sv})a(si)))"), /* ret type */
+	                                   G_DBUS_CALL_FLAGS_NONE,
+	                                   -1,
+	                                   NULL,
+	                                   NULL);
+}
+
+static void
+test_getservers_slmock_native (void)
+{
+	broker_t * broker = broker_new();
+	gchar * config = broker_config_new(broker);
+	gchar * param = g_strdup_printf("--config-file=%s", config);
+
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, param);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	/* Straight from the broker */
+	GVariant * retval = broker_login(session, broker, "c", "c");
+	g_assert(slmock_check_reply(retval, &slmock_table[0], "network"));
+	g_variant_unref(retval);
+	g_assert_cmpint(g_atomic_int_get(&broker->requests), ==, 1);
+
+	/* Turned away by the broker, the agent would have let us in but
+	   it isn't asked */
+	g_atomic_int_set(&broker->mode, BROKER_DENY);
+	retval = broker_login(session, broker, "f", "f");
+	g_assert(retval != NULL);
+	GVariant * loggedin = g_variant_get_child_value(retval, 0);
+	g_assert(!g_variant_get_boolean(loggedin));
+	g_variant_unref(loggedin);
+	g_variant_unref(retval);
+	g_assert_cmpint(g_atomic_int_get(&broker->requests), ==, 2);
+
+	/* Broken, the agent gets asked instead */
+	g_atomic_int_set(&broker->mode, BROKER_BROKEN);
+	retval = broker_login(session, broker, "f", "f");
+	g_assert(slmock_check_reply(retval, &slmock_table[1], "network"));
+	g_variant_unref(retval);
+	g_assert_cmpint(g_atomic_int_get(&broker->requests), ==, 3);
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	g_unlink(config);
+	g_free(param);
+	g_free(config);
+	broker_free(broker);
+
+	return;
+}
+
+static void
+test_getservers_slmock_cached (void)
+{
+	int run;
+
+	/* The second service should find what the first one saved */
+	for (run = 0; run < 2; run++) {
+		DbusTestService * service = dbus_test_service_new(NULL);
+
+		/* RLS */
+		DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+		dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+		dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+		/* Dummy */
+		DbusTestTask * dummy = dbus_test_task_new();
+		dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+		dbus_test_service_add_task(service, dummy);
+
+		/* Get RLS up and running and us on that bus */
+		dbus_test_service_start_tasks(service);
+
+		GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+		g_dbus_connection_set_exit_on_close(session, FALSE);
+
+		g_assert(slmock_check_login(session, &slmock_table[1], run == 0, run == 0 ? "network" : "cached"));
+
+		g_object_unref(session);
+		g_object_unref(rls);
+		g_object_unref(service);
+	}
+
+	return;
+}
+
+typedef struct _parallel_login_t parallel_login_t;
+struct _parallel_login_t {
+	slmock_table_t * slmockdata;
+	GVariant * retval;
+};
+
+static void
+parallel_login_cb (GObject * obj, GAsyncResult * res, gpointer user_data)
+{
+	parallel_login_t * login = (parallel_login_t *)user_data;
+	login->retval = g_dbus_connection_call_finish(G_DBUS_CONNECTION(obj), res, NULL);
+	return;
+}
+
+static void
+test_getservers_slmock_parallel (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	/* Two users at once, neither should cancel the other */
+	parallel_login_t logins[2] = {
+		{&slmock_table[0], NULL},
+		{&slmock_table[1], NULL}
+	};
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		slmock_clear_cache(logins[i].slmockdata);
+		g_dbus_connection_call(session,
+		                       "org.ArcticaProject.RemoteLogon",
+		                       "/org/ArcticaProject/RemoteLogon",
+		                       "org.ArcticaProject.RemoteLogon",
+		                       "GetServersForLogin",
+		                       g_variant_new("(sssb)",
+		                                     "https://slmock.com/",
+		                                     logins[i].slmockdata->username,
+		                                     logins[i].slmockdata->password,
+		                                     TRUE), /* params */
+		                       G_VARIANT_TYPE("(bsa(sssba(sbva{sv})a(si)))"), /* ret type */
+		                       G_DBUS_CALL_FLAGS_NONE,
+		                       -1,
+		                       NULL,
+		                       parallel_login_cb,
+		                       &logins[i]);
+	}
+
+	while (logins[0].retval == NULL || logins[1].retval == NULL) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	for (i = 0; i < 2; i++) {
+		g_assert(slmock_check_reply(logins[i].retval, logins[i].slmockdata, "network"));
+		g_variant_unref(logins[i].retval);
+	}
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+static void
+test_getservers_slmock_all (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	slmock_table_t * slmockdata = &slmock_table[1];
+	slmock_clear_cache(slmockdata);
+
+	GVariant * retval = g_dbus_connection_call_sync(session,
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "/org/ArcticaProject/RemoteLogon",
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "GetServersForLoginAll",
+	                                                g_variant_new("(ssbu)",
+	                                                              slmockdata->username,
+	                                                              slmockdata->password,
+	                                                              TRUE,
+	                                                              0), /* params */
+	                                                G_VARIANT_TYPE("(a(sbs)a(sssba(sbva{sv})a(si)))"), /* ret type */
+	                                                G_DBUS_CALL_FLAGS_NONE,
+	                                                -1,
+	                                                NULL,
+	                                                NULL);
+	g_assert(retval != NULL);
+
+	/* The one UCCS server in the config */
+	GVariant * results = g_variant_get_child_value(retval, 0);
+	g_assert(g_variant_n_children(results) == 1);
 
-	GVariant * array = g_variant_get_child_value(retval, 2);
+	const gchar * uri = NULL;
+	gboolean unlocked = FALSE;
+	const gchar * datatype = NULL;
+	g_variant_get_child(results, 0, "(&sb&s)", &uri, &unlocked, &datatype);
+	g_assert(g_strcmp0(uri, "https://slmock.com/") == 0);
+	g_assert(unlocked);
+	g_assert(g_strcmp0(datatype, "network") == 0);
+	g_variant_unref(results);
+
+	GVariant * array = g_variant_get_child_value(retval, 1);
 	int i;
-	// Check all servers should be in the result are in the result
 	for (i = 0; slmockdata->servers[i].name != NULL; i++) {
 		g_assert(find_server(array, &slmockdata->servers[i]));
 	}
-	// Check there is no more servers in the result than we expected
 	g_assert(i == g_variant_n_children(array));
 	g_variant_unref(array);
 
 	g_variant_unref(retval);
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
 
-	return TRUE;
+	return;
 }
 
+/* A broker whose agent can't be found never starts, the answer still
+   comes without waiting for the deadline */
 static void
-test_getservers_slmock (gconstpointer data)
+test_getservers_slmock_all_unstarted (void)
 {
 	DbusTestService * service = dbus_test_service_new(NULL);
 
 	/* RLS */
 	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
-	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_DUPLICATE_CONFIG_FILE);
 	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
 
 	/* Dummy */
@@ -218,8 +932,43 @@ test_getservers_slmock (gconstpointer data)
 	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
 	g_dbus_connection_set_exit_on_close(session, FALSE);
 
-	g_assert(slmock_check_login(session, (slmock_table_t *)data, TRUE));
+	slmock_table_t * slmockdata = &slmock_table[1];
+	slmock_clear_cache(slmockdata);
+
+	gint64 start = g_get_monotonic_time();
+	GVariant * retval = g_dbus_connection_call_sync(session,
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "/org/ArcticaProject/RemoteLogon",
+	                                                "org.ArcticaProject.RemoteLogon",
+	                                                "GetServersForLoginAll",
+	                                                g_variant_new("(ssbu)",
+	                                                              slmockdata->username,
+	                                                              slmockdata->password,
+	                                                              TRUE,
+	                                                              60000), /* params */
+	                                                G_VARIANT_TYPE("(a(sbs)a(sssba(sbva{sv})a(si)))"), /* ret type */
+	                                                G_DBUS_CALL_FLAGS_NONE,
+	                                                -1,
+	                                                NULL,
+	                                                NULL);
+	g_assert(retval != NULL);
+	g_assert(g_get_monotonic_time() - start < 30 * G_USEC_PER_SEC);
+
+	/* The first one worked, the second couldn't even try */
+	GVariant * results = g_variant_get_child_value(retval, 0);
+	g_assert(g_variant_n_children(results) == 2);
+
+	gboolean unlocked = FALSE;
+	const gchar * datatype = NULL;
+	g_variant_get_child(results, 0, "(&sb&s)", NULL, &unlocked, &datatype);
+	g_assert(unlocked);
+	g_assert(g_strcmp0(datatype, "network") == 0);
+	g_variant_get_child(results, 1, "(&sb&s)", NULL, &unlocked, &datatype);
+	g_assert(!unlocked);
+	g_assert(g_strcmp0(datatype, "timeout") != 0);
+	g_variant_unref(results);
 
+	g_variant_unref(retval);
 	g_object_unref(session);
 	g_object_unref(rls);
 	g_object_unref(service);
@@ -228,13 +977,13 @@ test_getservers_slmock (gconstpointer data)
 }
 
 static void
-test_getservers_slmock_none (void)
+test_getservers_slmock_timeout (void)
 {
 	DbusTestService * service = dbus_test_service_new(NULL);
 
 	/* RLS */
 	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
-	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_TIMEOUT_CONFIG_FILE);
 	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
 
 	/* Dummy */
@@ -248,6 +997,9 @@ test_getservers_slmock_none (void)
 	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
 	g_dbus_connection_set_exit_on_close(session, FALSE);
 
+	/* The agent sleeps for a minute, the service waits a second */
+	GError * error = NULL;
+	gint64 start = g_get_monotonic_time();
 	GVariant * retval = g_dbus_connection_call_sync(session,
 	                                                "org.ArcticaProject.RemoteLogon",
 	                                                "/org/ArcticaProject/RemoteLogon",
@@ -255,27 +1007,313 @@ test_getservers_slmock_none (void)
 	                                                "GetServersForLogin",
 	                                                g_variant_new("(sssb)",
 	                                                              "https://slmock.com/",
-	                                                              "Baduser",
-	                                                              "Badpass",
-	                                                              TRUE), /* params */
+	                                                              "s",
+	                                                              "s",
+	                                                              FALSE), /* params */
 	                                                G_VARIANT_TYPE("(bsa(sssba(sbva{sv})a(si)))"), /* ret type */
 	                                                G_DBUS_CALL_FLAGS_NONE,
 	                                                -1,
 	                                                NULL,
-	                                                NULL);
+	                                                &error);
 
-	g_assert(retval != NULL);
-	g_assert(g_variant_n_children(retval) == 3);
+	g_assert(retval == NULL);
+	g_assert(error != NULL);
+	g_assert(g_error_matches(error, g_quark_from_static_string("remote-logon-service"), 2)); /* ERROR_TIMEOUT */
+	g_assert(g_get_monotonic_time() - start < 30 * G_USEC_PER_SEC);
+	g_error_free(error);
 
-	GVariant * loggedin = g_variant_get_child_value(retval, 0);
-	g_assert(!g_variant_get_boolean(loggedin));
-	g_variant_unref(loggedin); loggedin = NULL;
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+/* What the last LoginServersUpdated we got said */
+typedef struct _servers_updated_t servers_updated_t;
+struct _servers_updated_t {
+	gchar * datatype;
+	gint count;
+};
+
+static void
+login_servers_updated_cb (GDBusConnection * connection, const gchar * sender, const gchar * path, const gchar * interface, const gchar * signal, GVariant * params, gpointer user_data)
+{
+	servers_updated_t * updated = (servers_updated_t *)user_data;
+	const gchar * datatype = NULL;
+	GVariant * array = NULL;
+
+	g_variant_get(params, "(&s&s&s@a(sssba(sbva{sv})a(si)))", NULL, NULL, &datatype, &array);
+
+	g_free(updated->datatype);
+	updated->datatype = g_strdup(datatype);
+	updated->count = g_variant_n_children(array);
 
-	GVariant * array = g_variant_get_child_value(retval, 2);
-	g_assert(g_variant_n_children(array) == 0);
 	g_variant_unref(array);
+	return;
+}
+
+static gboolean
+wait_timeout_cb (gpointer user_data)
+{
+	*(gboolean *)user_data = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+/* Wait for a LoginServersUpdated with @count servers, FALSE if it
+   doesn't come */
+static gboolean
+wait_for_servers_updated (servers_updated_t * updated, gint count)
+{
+	gboolean timedout = FALSE;
+	guint timer = g_timeout_add_seconds(20, wait_timeout_cb, &timedout);
+
+	updated->count = -1;
+	while (updated->count != count && !timedout) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	if (!timedout) {
+		g_source_remove(timer);
+	}
+
+	return !timedout;
+}
+
+/* Let the main loop run for a bit */
+static void
+wait_seconds (guint seconds)
+{
+	gboolean done = FALSE;
+	g_timeout_add_seconds(seconds, wait_timeout_cb, &done);
+
+	while (!done) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	return;
+}
+
+static void
+slow_login_cb (GObject * src_obj, GAsyncResult * res, gpointer user_data)
+{
+	GError ** error = (GError **)user_data;
+	GVariant * retval = g_dbus_connection_call_finish(G_DBUS_CONNECTION(src_obj), res, error);
+
+	g_assert(retval == NULL);
+	g_assert(*error != NULL);
+
+	return;
+}
+
+/* Ask for the servers of the user whose agent never answers, without
+   waiting for the reply */
+static void
+slow_login (GDBusConnection * connection, GError ** error)
+{
+	g_dbus_connection_call(connection,
+	                       "org.ArcticaProject.RemoteLogon",
+	                       "/org/ArcticaProject/RemoteLogon",
+	                       "org.ArcticaProject.RemoteLogon",
+	                       "GetServersForLogin",
+	                       g_variant_new("(sssb)",
+	                                     "https://slmock.com/",
+	                                     "s",
+	                                     "s",
+	                                     FALSE), /* params */
+	                       G_VARIANT_TYPE("(bsa(sssba(sbva{sv})a(si)))"), /* ret type */
+	                       G_DBUS_CALL_FLAGS_NONE,
+	                       -1,
+	                       NULL,
+	                       slow_login_cb,
+	                       error);
+
+	return;
+}
+
+/* The persistent agent is stuck on a query that times out, the one
+   queued behind it still gets answered */
+static void
+test_getservers_slmock_stuck (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_STUCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	GError * error = NULL;
+	slow_login(session, &error);
+	wait_seconds(1);
+
+	/* Times out two seconds after the slow one, which gets the agent
+	   restarted when it does */
+	g_assert(slmock_check_login(session, &slmock_table[0], TRUE, "network"));
+
+	while (error == NULL) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	g_assert(g_error_matches(error, g_quark_from_static_string("remote-logon-service"), 2)); /* ERROR_TIMEOUT */
+	g_error_free(error);
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+/* Whoever asked leaves the bus while the persistent agent is stuck on
+   their query, the query is dropped along with them */
+static void
+test_getservers_slmock_vanished (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_STUCK_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	/* A connection of its own so it can leave */
+	gchar * address = g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	GDBusConnection * leaving = g_dbus_connection_new_for_address_sync(address,
+	                                                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+	                                                                   NULL, NULL, NULL);
+	g_assert(leaving != NULL);
+	g_dbus_connection_set_exit_on_close(leaving, FALSE);
+	g_free(address);
+
+	GError * error = NULL;
+	slow_login(leaving, &error);
+	wait_seconds(1);
+
+	g_dbus_connection_close_sync(leaving, NULL, NULL);
+
+	while (error == NULL) {
+		g_main_context_iteration(NULL, TRUE);
+	}
+
+	g_error_free(error);
+	g_object_unref(leaving);
+
+	/* The agent would be busy for a minute, this would time out */
+	g_assert(slmock_check_login(session, &slmock_table[0], TRUE, "network"));
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
+static GVariant *
+slmock_login_user (GDBusConnection * session, const gchar * username, gboolean allowcache)
+{
+	return g_dbus_connection_call_sync(session,
+	                                   "org.ArcticaProject.RemoteLogon",
+	                                   "/org/ArcticaProject/RemoteLogon",
+	                                   "org.ArcticaProject.RemoteLogon",
+	                                   "GetServersForLogin",
+	                                   g_variant_new("(sssb)",
+	                                                 "https://slmock.com/",
+	                                                 username,
+	                                                 username,
+	                                                 allowcache), /* params */
+	                                   G_VARIANT_TYPE("(bsa(sssba(sbva{sv})a(si)))"), /* ret type */
+	                                   G_DBUS_CALL_FLAGS_NONE,
+	                                   -1,
+	                                   NULL,
+	                                   NULL);
+}
+
+static void
+test_getservers_slmock_probe (void)
+{
+	/* The broker always hands out the same server on this port */
+	GSocketListener * listener = g_socket_listener_new();
+	guint16 port = g_socket_listener_add_any_inet_port(listener, NULL, NULL);
+	g_assert(port != 0);
+	gchar * username = g_strdup_printf("p:%d", port);
+
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_PROBE_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	servers_updated_t updated = { NULL, -1 };
+	guint subscription = g_dbus_connection_signal_subscribe(session,
+	                                                        NULL, /* sender */
+	                                                        "org.ArcticaProject.RemoteLogon",
+	                                                        "LoginServersUpdated",
+	                                                        "/org/ArcticaProject/RemoteLogon",
+	                                                        NULL, /* arg0 */
+	                                                        G_DBUS_SIGNAL_FLAGS_NONE,
+	                                                        login_servers_updated_cb,
+	                                                        &updated,
+	                                                        NULL);
+
+	GVariant * retval = slmock_login_user(session, username, FALSE);
+	g_assert(retval != NULL);
 	g_variant_unref(retval);
 
+	/* Reachable once it's been probed */
+	g_assert(wait_for_servers_updated(&updated, 1));
+
+	/* The refreshes bring the same list, the probes still notice it
+	   going away and coming back */
+	g_socket_listener_close(listener);
+	g_object_unref(listener);
+	g_assert(wait_for_servers_updated(&updated, 0));
+
+	listener = g_socket_listener_new();
+	g_assert(g_socket_listener_add_inet_port(listener, port, NULL, NULL));
+	g_assert(wait_for_servers_updated(&updated, 1));
+
+	g_dbus_connection_signal_unsubscribe(session, subscription);
+	g_free(updated.datatype);
+
+	g_socket_listener_close(listener);
+	g_object_unref(listener);
+	g_free(username);
+
 	g_object_unref(session);
 	g_object_unref(rls);
 	g_object_unref(service);
@@ -283,14 +1321,30 @@ test_getservers_slmock_none (void)
 	return;
 }
 
+/* A refresh brings a server more, which those who have the list get
+   told about */
 static void
-test_getservers_slmock_two (void)
+test_getservers_slmock_refresh (void)
 {
+	GSocketListener * listener = g_socket_listener_new();
+	guint16 port = g_socket_listener_add_any_inet_port(listener, NULL, NULL);
+	g_assert(port != 0);
+
+	/* The broker hands out a server for each line */
+	gchar * hosts = NULL;
+	gint fd = g_file_open_tmp("slmock-hosts-XXXXXX", &hosts, NULL);
+	g_assert(fd >= 0);
+	g_close(fd, NULL);
+
+	gchar * host = g_strdup_printf("127.0.0.1:%d\n", port);
+	g_assert(g_file_set_contents(hosts, host, -1, NULL));
+	gchar * username = g_strdup_printf("l:%s", hosts);
+
 	DbusTestService * service = dbus_test_service_new(NULL);
 
 	/* RLS */
 	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
-	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+	dbus_test_process_append_param(rls, "--config-file=" SLMOCK_PROBE_CONFIG_FILE);
 	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
 
 	/* Dummy */
@@ -304,13 +1358,135 @@ test_getservers_slmock_two (void)
 	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
 	g_dbus_connection_set_exit_on_close(session, FALSE);
 
-	g_assert(slmock_check_login(session, &slmock_table[0], TRUE));
-	g_assert(slmock_check_login(session, &slmock_table[1], TRUE));
+	servers_updated_t updated = { NULL, -1 };
+	guint subscription = g_dbus_connection_signal_subscribe(session,
+	                                                        NULL, /* sender */
+	                                                        "org.ArcticaProject.RemoteLogon",
+	                                                        "LoginServersUpdated",
+	                                                        "/org/ArcticaProject/RemoteLogon",
+	                                                        NULL, /* arg0 */
+	                                                        G_DBUS_SIGNAL_FLAGS_NONE,
+	                                                        login_servers_updated_cb,
+	                                                        &updated,
+	                                                        NULL);
+
+	GVariant * retval = slmock_login_user(session, username, FALSE);
+	g_assert(retval != NULL);
+	g_variant_unref(retval);
+	g_assert(wait_for_servers_updated(&updated, 1));
+
+	/* Picked up by the next refresh */
+	gchar * twohosts = g_strconcat(host, host, NULL);
+	g_assert(g_file_set_contents(hosts, twohosts, -1, NULL));
+	g_assert(wait_for_servers_updated(&updated, 2));
+	g_assert_cmpstr(updated.datatype, ==, "network");
+
+	g_dbus_connection_signal_unsubscribe(session, subscription);
+	g_free(updated.datatype);
 
 	g_object_unref(session);
 	g_object_unref(rls);
 	g_object_unref(service);
 
+	g_unlink(hosts);
+	g_free(twohosts);
+	g_free(username);
+	g_free(host);
+	g_free(hosts);
+	g_socket_listener_close(listener);
+	g_object_unref(listener);
+
+	return;
+}
+
+static void
+login_changed_cb (GDBusConnection * connection, const gchar * sender, const gchar * path, const gchar * interface, const gchar * signal, GVariant * params, gpointer user_data)
+{
+	*(gboolean *)user_data = TRUE;
+	return;
+}
+
+static void
+test_getservers_slmock_revoked (void)
+{
+	/* The mock broker takes the user only while the ticket exists */
+	gchar * dir = g_dir_make_tmp("rls-test-XXXXXX", NULL);
+	g_assert(dir != NULL);
+	gchar * ticket = g_build_filename(dir, "ticket", NULL);
+	g_assert(g_file_set_contents(ticket, "", 0, NULL));
+	gchar * username = g_strdup_printf("t:%s", ticket);
+	int run;
+
+	for (run = 0; run < 2; run++) {
+		DbusTestService * service = dbus_test_service_new(NULL);
+
+		/* RLS */
+		DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+		dbus_test_process_append_param(rls, "--config-file=" SLMOCK_CONFIG_FILE);
+		dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+		/* Dummy */
+		DbusTestTask * dummy = dbus_test_task_new();
+		dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+		dbus_test_service_add_task(service, dummy);
+
+		/* Get RLS up and running and us on that bus */
+		dbus_test_service_start_tasks(service);
+
+		GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+		g_dbus_connection_set_exit_on_close(session, FALSE);
+
+		gboolean changed = FALSE;
+		guint subscription = g_dbus_connection_signal_subscribe(session,
+		                                                        NULL, /* sender */
+		                                                        "org.ArcticaProject.RemoteLogon",
+		                                                        "LoginChanged",
+		                                                        "/org/ArcticaProject/RemoteLogon",
+		                                                        NULL, /* arg0 */
+		                                                        G_DBUS_SIGNAL_FLAGS_NONE,
+		                                                        login_changed_cb,
+		                                                        &changed,
+		                                                        NULL);
+
+		/* The second time the saved list lets us in, then the network
+		   says no */
+		GVariant * retval = slmock_login_user(session, username, TRUE);
+		g_assert(retval != NULL);
+
+		GVariant * loggedin = g_variant_get_child_value(retval, 0);
+		GVariant * datatype = g_variant_get_child_value(retval, 1);
+		g_assert(g_variant_get_boolean(loggedin));
+		g_assert(g_strcmp0(g_variant_get_string(datatype, NULL), run == 0 ? "network" : "cached") == 0);
+		g_variant_unref(datatype);
+		g_variant_unref(loggedin);
+		g_variant_unref(retval);
+
+		if (run == 0) {
+			g_assert(g_unlink(ticket) == 0);
+		} else {
+			gboolean timedout = FALSE;
+			guint timer = g_timeout_add_seconds(20, wait_timeout_cb, &timedout);
+
+			while (!changed && !timedout) {
+				g_main_context_iteration(NULL, TRUE);
+			}
+
+			g_assert(changed);
+			g_source_remove(timer);
+		}
+
+		g_dbus_connection_signal_unsubscribe(session, subscription);
+
+		g_object_unref(session);
+		g_object_unref(rls);
+		g_object_unref(service);
+	}
+
+	g_rmdir(dir);
+	g_free(username);
+	g_free(ticket);
+	g_free(dir);
+
 	return;
 }
 
@@ -438,6 +1614,97 @@ test_getservers_uccs (void)
 	return;
 }
 
+static GVariant *
+get_servers_since (GDBusConnection * session, guint64 since)
+{
+	return g_dbus_connection_call_sync(session,
+	                                   "org.ArcticaProject.RemoteLogon",
+	                                   "/org/ArcticaProject/RemoteLogon",
+	                                   "org.ArcticaProject.RemoteLogon",
+	                                   "GetServersSince",
+	                                   g_variant_new("(t)", since), /* params */
+	                                   G_VARIANT_TYPE("(tba(sssba(sbva{sv})a(si))a(sssba(sbva{sv})a(si))as)"), /* ret type */
+	                                   G_DBUS_CALL_FLAGS_NONE,
+	                                   -1,
+	                                   NULL,
+	                                   NULL);
+}
+
+static void
+test_getserverssince_uccs (void)
+{
+	DbusTestService * service = dbus_test_service_new(NULL);
+
+	/* RLS */
+	DbusTestProcess * rls = dbus_test_process_new(REMOTE_LOGON_SERVICE);
+	dbus_test_process_append_param(rls, "--config-file=" UCCS_CONFIG_FILE);
+	dbus_test_service_add_task(service, DBUS_TEST_TASK(rls));
+
+	/* Dummy */
+	DbusTestTask * dummy = dbus_test_task_new();
+	dbus_test_task_set_wait_for(dummy, "org.ArcticaProject.RemoteLogon");
+	dbus_test_service_add_task(service, dummy);
+
+	/* Get RLS up and running and us on that bus */
+	dbus_test_service_start_tasks(service);
+
+	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+	g_dbus_connection_set_exit_on_close(session, FALSE);
+
+	guint64 generation = 0;
+	gboolean complete = TRUE;
+	GVariant * added = NULL;
+	GVariant * changed = NULL;
+	GVariant * removed = NULL;
+
+	/* Never seen anything, so it's all new */
+	GVariant * retval = get_servers_since(session, 0);
+	g_assert(retval != NULL);
+	g_variant_get(retval, "(tb@a(sssba(sbva{sv})a(si))@a(sssba(sbva{sv})a(si))@as)", &generation, &complete, &added, &changed, &removed);
+	g_assert(generation > 0);
+	g_assert(!complete);
+	g_assert(g_variant_n_children(added) == 1);
+	g_assert(g_variant_n_children(changed) == 0);
+	g_assert(g_variant_n_children(removed) == 0);
+	g_variant_unref(added);
+	g_variant_unref(changed);
+	g_variant_unref(removed);
+	g_variant_unref(retval);
+
+	/* Up to date */
+	guint64 current = generation;
+	retval = get_servers_since(session, current);
+	g_assert(retval != NULL);
+	g_variant_get(retval, "(tb@a(sssba(sbva{sv})a(si))@a(sssba(sbva{sv})a(si))@as)", &generation, &complete, &added, &changed, &removed);
+	g_assert(generation == current);
+	g_assert(!complete);
+	g_assert(g_variant_n_children(added) == 0);
+	g_assert(g_variant_n_children(changed) == 0);
+	g_assert(g_variant_n_children(removed) == 0);
+	g_variant_unref(added);
+	g_variant_unref(changed);
+	g_variant_unref(removed);
+	g_variant_unref(retval);
+
+	/* A generation we never had gets the whole list */
+	retval = get_servers_since(session, current + 10);
+	g_assert(retval != NULL);
+	g_variant_get(retval, "(tb@a(sssba(sbva{sv})a(si))@a(sssba(sbva{sv})a(si))@as)", &generation, &complete, &added, &changed, &removed);
+	g_assert(generation == current);
+	g_assert(complete);
+	g_assert(g_variant_n_children(added) == 1);
+	g_variant_unref(added);
+	g_variant_unref(changed);
+	g_variant_unref(removed);
+	g_variant_unref(retval);
+
+	g_object_unref(session);
+	g_object_unref(rls);
+	g_object_unref(service);
+
+	return;
+}
+
 static void
 test_getdomains_basic (void)
 {
@@ -516,7 +1783,7 @@ test_setlastused_basic (void)
 	GDBusConnection * session = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
 	g_dbus_connection_set_exit_on_close(session, FALSE);
 
-	g_assert(slmock_check_login(session, &slmock_table[1], TRUE));
+	g_assert(slmock_check_login(session, &slmock_table[1], TRUE, "network"));
 
 	GError * error = NULL;
 	GVariant * retval = g_dbus_connection_call_sync(session,
@@ -541,7 +1808,7 @@ test_setlastused_basic (void)
 	g_assert(g_variant_n_children(retval) == 0);
 	g_variant_unref(retval);
 
-	g_assert(slmock_check_login(session, &slmock_table[3], FALSE));
+	g_assert(slmock_check_login(session, &slmock_table[3], FALSE, "network"));
 
 	g_object_unref(session);
 	g_object_unref(rls);
@@ -557,11 +1824,26 @@ test_dbus_suite (void)
 {
 	g_test_add_func ("/dbus/interface/GetServers/None",   test_getservers_none);
 	g_test_add_func ("/dbus/interface/GetServers/UCCS",   test_getservers_uccs);
+	g_test_add_func ("/dbus/interface/GetServersSince/UCCS",   test_getserverssince_uccs);
 	g_test_add_data_func ("/dbus/interface/GetServers/SLMock/citrix",  &slmock_table[0], test_getservers_slmock);
 	g_test_add_data_func ("/dbus/interface/GetServers/SLMock/freerdp2", &slmock_table[1], test_getservers_slmock);
 	g_test_add_data_func ("/dbus/interface/GetServers/SLMock/big",     &slmock_table[2], test_getservers_slmock);
 	g_test_add_func ("/dbus/interface/GetServers/SLMock/none",   test_getservers_slmock_none);
 	g_test_add_func ("/dbus/interface/GetServers/SLMock/two",   test_getservers_slmock_two);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/duplicate",   test_getservers_slmock_duplicate);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/persistent",   test_getservers_slmock_persistent);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/legacy",   test_getservers_slmock_legacy);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/native",   test_getservers_slmock_native);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/cached",   test_getservers_slmock_cached);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/parallel",   test_getservers_slmock_parallel);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/all",   test_getservers_slmock_all);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/all-unstarted",   test_getservers_slmock_all_unstarted);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/timeout",   test_getservers_slmock_timeout);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/stuck",   test_getservers_slmock_stuck);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/vanished",   test_getservers_slmock_vanished);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/probe",   test_getservers_slmock_probe);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/refresh",   test_getservers_slmock_refresh);
+	g_test_add_func ("/dbus/interface/GetServers/SLMock/revoked",   test_getservers_slmock_revoked);
 	g_test_add_func ("/dbus/interface/GetDomains/Basic",   test_getdomains_basic);
 	g_test_add_func ("/dbus/interface/SetLastUsed/Basic",   test_setlastused_basic);
 
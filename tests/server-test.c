@@ -1,10 +1,17 @@
 #include <glib.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
 
 #include "defines.h"
 #include "server.h"
 #include "citrix-server.h"
 #include "rdp-server.h"
+#include "x2go-server.h"
 #include "uccs-server.h"
+#include "server-probe.h"
+#include "server-notify.h"
+#include "server-table.h"
+#include "crypt.h"
 
 static gboolean
 no_fatal_warnings (const gchar * log_domain, GLogLevelFlags level, const gchar * message, gpointer userdata)
@@ -63,6 +70,77 @@ test_update_signal (void)
 	return;
 }
 
+static void
+test_uccs_probe_delay (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	GKeyFile * keyfile = g_key_file_new();
+	const gchar * groupname = CONFIG_SERVER_PREFIX " Server Name";
+	g_key_file_set_string(keyfile, groupname, CONFIG_SERVER_NAME, "My Server");
+	g_key_file_set_string(keyfile, groupname, CONFIG_SERVER_URI,  "http://my.domain.com");
+	g_key_file_set_string(keyfile, groupname, CONFIG_UCCS_NETWORK, CONFIG_UCCS_NETWORK_NONE);
+	g_key_file_set_integer(keyfile, groupname, CONFIG_UCCS_PROBE, 60);
+
+	Server * server = server_new_from_keyfile(keyfile, groupname);
+	g_assert(server != NULL);
+	UccsServer * userver = UCCS_SERVER(server);
+	guint delay;
+
+	/* while it answers, the interval give or take a fifth */
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 48000 && delay <= 72000);
+
+	/* backing off from five seconds on failures */
+	userver->probe_failures = 1;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 4000 && delay <= 6000);
+
+	userver->probe_failures = 2;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 8000 && delay <= 12000);
+
+	/* up to five minutes, no matter how many */
+	userver->probe_failures = 7;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 240000 && delay <= 360000);
+
+	userver->probe_failures = G_MAXUINT;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 240000 && delay <= 360000);
+
+	/* and back to the interval once it answers again */
+	userver->probe_failures = 0;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 48000 && delay <= 72000);
+
+	/* a longer interval is where the backoff stops instead */
+	userver->probe_interval = 3600;
+	userver->probe_failures = 7;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 256000 && delay <= 384000);
+
+	userver->probe_failures = 20;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 2880000 && delay <= 4320000);
+
+	userver->probe_failures = 0;
+
+	/* intervals too long for a guint of milliseconds don't wrap */
+	userver->probe_interval = 5000000;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay >= 4000000000u);
+
+	userver->probe_interval = G_MAXUINT;
+	delay = uccs_server_probe_delay(userver);
+	g_assert(delay == G_MAXUINT);
+
+	g_object_unref(server);
+	g_key_file_free(keyfile);
+
+	return;
+}
+
 static void
 test_uccs_domains (void)
 {
@@ -116,6 +194,580 @@ test_uccs_exec (void)
 	return;
 }
 
+static void
+changed_signal (Server * server, gint * count)
+{
+	(*count)++;
+	return;
+}
+
+static void
+test_variant_memo (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	Server * server = g_object_new(RDP_SERVER_TYPE, NULL);
+	server->name = g_intern_static_string("My Name");
+	server->uri = g_intern_static_string("http://mysite.loves.testing.com");
+
+	gint changed = 0;
+	g_signal_connect(G_OBJECT(server), SERVER_SIGNAL_CHANGED, G_CALLBACK(changed_signal), &changed);
+
+	/* asking twice gives back the same variant */
+	GVariant * first = server_get_variant(server);
+	GVariant * second = server_get_variant(server);
+	g_assert(first != NULL);
+	g_assert(first == second);
+	g_variant_unref(second);
+
+	/* setting the same value doesn't invalidate */
+	g_assert(!server_set_last_used(server, FALSE));
+	g_assert(!server_set_state(server, SERVER_STATE_ALLGOOD));
+	g_assert(changed == 0);
+	second = server_get_variant(server);
+	g_assert(first == second);
+	g_variant_unref(second);
+
+	/* a real change does, and the new variant has the new value */
+	g_assert(server_set_last_used(server, TRUE));
+	g_assert(changed == 1);
+	second = server_get_variant(server);
+	g_assert(first != second);
+
+	GVariant * last_used = g_variant_get_child_value(second, 3);
+	g_assert(g_variant_get_boolean(last_used));
+	g_variant_unref(last_used);
+
+	g_variant_unref(second);
+	g_variant_unref(first);
+	g_object_unref(G_OBJECT(server));
+
+	return;
+}
+
+static void
+test_json_protocol (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	struct {
+		const gchar * protocol;
+		GType type;
+	} protocols[] = {
+		{ "ica",      CITRIX_SERVER_TYPE },
+		{ "ICA",      CITRIX_SERVER_TYPE },
+		{ "freerdp",  RDP_SERVER_TYPE },
+		{ "FreeRDP2", RDP_SERVER_TYPE },
+		{ "RDP",      RDP_SERVER_TYPE },
+		{ "X2Go",     X2GO_SERVER_TYPE },
+		{ "x2gO",     X2GO_SERVER_TYPE },
+		{ "vnc",      G_TYPE_INVALID },
+		{ "x2go2",    G_TYPE_INVALID }
+	};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(protocols); i++) {
+		JsonObject * object = json_object_new();
+		json_object_set_string_member(object, "Protocol", protocols[i].protocol);
+
+		Server * server = server_new_from_json(object);
+
+		if (protocols[i].type == G_TYPE_INVALID) {
+			g_assert(server == NULL);
+		} else {
+			g_assert(server != NULL);
+			g_assert(G_OBJECT_TYPE(server) == protocols[i].type);
+			g_object_unref(server);
+		}
+
+		json_object_unref(object);
+	}
+
+	return;
+}
+
+static Server *
+json_rdp_server (const gchar * domain)
+{
+	JsonObject * object = json_object_new();
+	json_object_set_string_member(object, "Protocol", "freerdp2");
+	json_object_set_string_member(object, "Name", "My Name");
+	json_object_set_string_member(object, "URL", "http://mysite.loves.testing.com");
+	json_object_set_string_member(object, "Username", "me");
+	json_object_set_string_member(object, "Password", "secret");
+	json_object_set_string_member(object, "WindowsDomain", domain);
+
+	Server * server = server_new_from_json(object);
+	json_object_unref(object);
+
+	return server;
+}
+
+static ServerTable *
+json_server_table (const gchar * domain)
+{
+	gchar * json = g_strdup_printf("["
+		"{\"Protocol\": \"freerdp2\", \"Name\": \"RDP\", \"URL\": \"rdp.example.com\", \"Username\": \"me\", \"Password\": \"secret\", \"WindowsDomain\": \"%s\"},"
+		"{\"Protocol\": \"nosuchthing\", \"Name\": \"Unknown\", \"URL\": \"unknown.example.com\"},"
+		"{\"Protocol\": \"x2go\", \"Name\": \"X2Go\", \"URL\": \"x2go.example.com\", \"Username\": \"me\"},"
+		"{\"Protocol\": \"freerdp2\", \"Name\": \"Again\", \"URL\": \"rdp.example.com\"}"
+		"]", domain);
+
+	JsonParser * parser = json_parser_new();
+	g_assert(json_parser_load_from_data(parser, json, -1, NULL));
+	ServerTable * table = server_table_new_from_json(json_node_get_array(json_parser_get_root(parser)));
+
+	g_object_unref(parser);
+	g_free(json);
+
+	return table;
+}
+
+static void
+test_server_update (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	Server * server = json_rdp_server("DOMAIN1");
+	Server * same = json_rdp_server("DOMAIN1");
+	Server * other = json_rdp_server("DOMAIN2");
+
+	gint changed = 0;
+	g_signal_connect(G_OBJECT(server), SERVER_SIGNAL_CHANGED, G_CALLBACK(changed_signal), &changed);
+
+	/* nothing new keeps the memoized variant */
+	GVariant * first = server_get_variant(server);
+	g_assert(!server_update(server, same));
+	g_assert(changed == 0);
+	GVariant * second = server_get_variant(server);
+	g_assert(first == second);
+	g_variant_unref(second);
+
+	/* a new domain is copied over */
+	g_assert(server_update(server, other));
+	g_assert(changed == 1);
+	g_assert(g_strcmp0(RDP_SERVER(server)->domain, "DOMAIN2") == 0);
+	g_assert(g_strcmp0(RDP_SERVER(server)->password, "secret") == 0);
+	second = server_get_variant(server);
+	g_assert(first != second);
+	g_variant_unref(second);
+
+	/* a field and the last used flag together only signal once */
+	Server * both = json_rdp_server("DOMAIN3");
+	both->last_used = TRUE;
+	g_assert(server_update(server, both));
+	g_assert(changed == 2);
+	g_assert(server->last_used);
+	g_object_unref(both);
+
+	g_variant_unref(first);
+	g_object_unref(other);
+	g_object_unref(same);
+	g_object_unref(server);
+
+	/* equal strings from the arenas of two tables aren't news either */
+	ServerTable * table = json_server_table("DOMAIN1");
+	ServerTable * again = json_server_table("DOMAIN1");
+	server = server_table_get_server(table, 0);
+	same = server_table_get_server(again, 0);
+
+	changed = 0;
+	g_signal_connect(G_OBJECT(server), SERVER_SIGNAL_CHANGED, G_CALLBACK(changed_signal), &changed);
+	g_assert(RDP_SERVER(server)->domain != RDP_SERVER(same)->domain);
+	g_assert(!server_update(server, same));
+	g_assert(changed == 0);
+
+	/* and new ones outlive the table they came from */
+	server_table_free(again);
+	again = json_server_table("DOMAIN2");
+	g_assert(server_update(server, server_table_get_server(again, 0)));
+	g_assert(changed == 1);
+	server_table_free(again);
+	g_assert(g_strcmp0(RDP_SERVER(server)->domain, "DOMAIN2") == 0);
+
+	server_table_free(table);
+
+	return;
+}
+
+static void
+test_server_table (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	ServerTable * table = json_server_table("DOMAIN1");
+
+	/* the unknown protocol is left out, the first URI wins */
+	g_assert_cmpuint(server_table_length(table), ==, 3);
+	g_assert_cmpint(server_table_find_uri(table, "rdp.example.com"), ==, 0);
+	g_assert_cmpint(server_table_find_uri(table, "unknown.example.com"), ==, -1);
+	g_assert_cmpint(server_table_find_name(table, "X2Go"), ==, 1);
+	g_assert_cmpint(server_table_find_name(table, "Again"), ==, 2);
+	g_assert_cmpstr(server_table_get_uri(table, 2), ==, "rdp.example.com");
+
+	/* the variant doesn't need an object to stay around */
+	GVariant * variant = server_table_get_variant(table, 0);
+	g_assert(variant != NULL);
+	g_assert(server_table_peek(table, 0) == NULL);
+
+	GVariant * again = server_table_get_variant(table, 0);
+	g_assert(variant == again);
+	g_variant_unref(again);
+
+	/* and is the same as an object made straight from the JSON */
+	Server * direct = json_rdp_server("DOMAIN1");
+	direct->name = g_intern_static_string("RDP");
+	direct->uri = g_intern_static_string("rdp.example.com");
+	server_changed(direct);
+	GVariant * expected = server_get_variant(direct);
+	g_assert(g_variant_equal(variant, expected));
+	g_variant_unref(expected);
+	g_object_unref(direct);
+
+	/* the last used flag is part of it */
+	g_assert(server_table_set_last_used(table, 0, TRUE));
+	g_assert(!server_table_set_last_used(table, 0, TRUE));
+	again = server_table_get_variant(table, 0);
+	g_assert(variant != again);
+	g_variant_unref(again);
+	g_variant_unref(variant);
+
+	/* objects are made when asked for, once */
+	Server * server = server_table_get_server(table, 0);
+	g_assert(IS_RDP_SERVER(server));
+	g_assert(server_table_peek(table, 0) == server);
+	g_assert(server_table_get_server(table, 0) == server);
+	g_assert(server->last_used);
+	g_assert_cmpstr(server->name, ==, "RDP");
+	g_assert_cmpstr(RDP_SERVER(server)->domain, ==, "DOMAIN1");
+	g_assert_cmpstr(RDP_SERVER(server)->password, ==, "secret");
+	g_assert(server_table_peek(table, 1) == NULL);
+
+	server_set_state(server, SERVER_STATE_UNAVAILABLE);
+	g_assert(server_table_get_state(table, 0) == SERVER_STATE_UNAVAILABLE);
+	g_assert(server_table_get_state(table, 1) == SERVER_STATE_ALLGOOD);
+
+	/* the same list again takes over the object */
+	ServerTable * same = json_server_table("DOMAIN1");
+	server_table_set_last_used(same, 0, TRUE);
+	g_assert(!server_table_adopt(same, table));
+	g_assert(server_table_peek(same, 0) == server);
+	server_table_free(table);
+
+	/* new values get a new object that was probed all the same */
+	g_object_ref(server);
+	ServerTable * other = json_server_table("DOMAIN2");
+	g_assert(server_table_adopt(other, same));
+	Server * newserver = server_table_peek(other, 0);
+	g_assert(newserver != NULL);
+	g_assert(newserver != server);
+	g_assert(newserver->state == SERVER_STATE_UNAVAILABLE);
+	g_assert_cmpstr(RDP_SERVER(newserver)->domain, ==, "DOMAIN2");
+	server_table_free(same);
+
+	/* the strings live as long as the objects using them */
+	g_assert_cmpstr(server->name, ==, "RDP");
+	g_assert_cmpstr(RDP_SERVER(server)->domain, ==, "DOMAIN1");
+	g_object_unref(server);
+
+	server_table_free(other);
+
+	return;
+}
+
+static void
+probe_done (gboolean changed, gpointer user_data)
+{
+	g_assert(changed);
+	g_main_loop_quit((GMainLoop *)user_data);
+	return;
+}
+
+static Server *
+probe_rdp_server (guint16 port)
+{
+	Server * server = g_object_new(RDP_SERVER_TYPE, NULL);
+	gchar * uri = g_strdup_printf("127.0.0.1:%d", port);
+
+	server->name = g_intern_static_string("Probed");
+	server->uri = g_intern_string(uri);
+	g_free(uri);
+
+	return server;
+}
+
+static void
+notify_count (gpointer user_data)
+{
+	(*(guint *)user_data)++;
+	return;
+}
+
+/* Flip the state of the server and tell about it like the servers do */
+static gboolean
+notify_flip (gpointer user_data)
+{
+	Server * server = SERVER(user_data);
+
+	server_set_state(server, server->state == SERVER_STATE_ALLGOOD ? SERVER_STATE_UNAVAILABLE : SERVER_STATE_ALLGOOD);
+	g_signal_emit_by_name(server, SERVER_SIGNAL_STATE_CHANGED, server->state);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+notify_quit (gpointer user_data)
+{
+	g_main_loop_quit((GMainLoop *)user_data);
+	return G_SOURCE_REMOVE;
+}
+
+static void
+test_server_notify (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	Server * one = probe_rdp_server(1);
+	Server * two = probe_rdp_server(2);
+	GMainLoop * loop = g_main_loop_new(NULL, FALSE);
+	guint count = 0;
+
+	/* changes spread over the window are told about once */
+	ServerNotify * notify = server_notify_new(300, notify_count, &count);
+	server_notify_add(notify, one);
+	server_notify_add(notify, two);
+
+	notify_flip(one);
+	g_timeout_add(50, notify_flip, two);
+	g_timeout_add(100, notify_flip, one);
+	g_timeout_add(150, notify_flip, two);
+	g_timeout_add(250, notify_quit, loop);
+	g_main_loop_run(loop);
+	g_assert(count == 0);
+
+	g_timeout_add(200, notify_quit, loop);
+	g_main_loop_run(loop);
+	g_assert(count == 1);
+
+	/* and the next change gets told about again */
+	notify_flip(two);
+	g_timeout_add(500, notify_quit, loop);
+	g_main_loop_run(loop);
+	g_assert(count == 2);
+
+	/* nothing after it's gone */
+	notify_flip(one);
+	server_notify_free(notify);
+	g_timeout_add(500, notify_quit, loop);
+	g_main_loop_run(loop);
+	g_assert(count == 2);
+
+	/* without a delay a burst is told about on the next idle */
+	count = 0;
+	notify = server_notify_new(0, notify_count, &count);
+	server_notify_add(notify, one);
+	server_notify_add(notify, two);
+
+	notify_flip(one);
+	notify_flip(two);
+	notify_flip(one);
+	g_assert(count == 0);
+
+	g_timeout_add(100, notify_quit, loop);
+	g_main_loop_run(loop);
+	g_assert(count == 1);
+
+	server_notify_free(notify);
+	g_main_loop_unref(loop);
+	g_object_unref(one);
+	g_object_unref(two);
+
+	return;
+}
+
+static void
+test_server_probe (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	/* one port that takes connections and one that doesn't */
+	GSocketListener * listener = g_socket_listener_new();
+	guint16 open_port = g_socket_listener_add_any_inet_port(listener, NULL, NULL);
+	g_assert(open_port != 0);
+
+	GSocketListener * closed = g_socket_listener_new();
+	guint16 closed_port = g_socket_listener_add_any_inet_port(closed, NULL, NULL);
+	g_assert(closed_port != 0);
+	g_socket_listener_close(closed);
+	g_object_unref(closed);
+
+	GPtrArray * servers = g_ptr_array_new_with_free_func(g_object_unref);
+	g_ptr_array_add(servers, probe_rdp_server(open_port));
+	g_ptr_array_add(servers, probe_rdp_server(closed_port));
+
+	Server * up = SERVER(g_ptr_array_index(servers, 0));
+	Server * down = SERVER(g_ptr_array_index(servers, 1));
+	g_assert(up->latency == -1);
+
+	/* one at a time so that the second waits for the first */
+	GMainLoop * loop = g_main_loop_new(NULL, FALSE);
+	ServerProbe * probe = server_probe_new(SERVER_PROBE_CONNECT, 1, 5, probe_done, loop);
+	server_probe_start(probe, servers);
+	g_main_loop_run(loop);
+
+	g_assert(up->state == SERVER_STATE_ALLGOOD);
+	g_assert(up->latency >= 0);
+	g_assert(down->state == SERVER_STATE_UNAVAILABLE);
+	g_assert(down->latency == -1);
+
+	/* the latency is passed on as a property */
+	GVariant * variant = server_get_variant(up);
+	GVariant * props = g_variant_get_child_value(variant, 4);
+	GVariant * last = g_variant_get_child_value(props, g_variant_n_children(props) - 1);
+	const gchar * name = NULL;
+	g_variant_get_child(last, 0, "&s", &name);
+	g_assert(g_strcmp0(name, "latency") == 0);
+	g_variant_unref(last);
+	g_variant_unref(props);
+	g_variant_unref(variant);
+
+	server_probe_free(probe);
+	g_main_loop_unref(loop);
+	g_ptr_array_unref(servers);
+	g_object_unref(listener);
+
+	return;
+}
+
+static void
+probe_count (gboolean changed, gpointer user_data)
+{
+	g_assert(changed);
+	(*(guint *)user_data)++;
+	return;
+}
+
+static void
+test_server_probe_many (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	/* addresses that need no lookup finish right away, one after the
+	   other without nesting */
+	GPtrArray * servers = g_ptr_array_new_with_free_func(g_object_unref);
+	guint i;
+	for (i = 0; i < 50000; i++) {
+		g_ptr_array_add(servers, probe_rdp_server(3389));
+	}
+
+	guint done = 0;
+	ServerProbe * probe = server_probe_new(SERVER_PROBE_RESOLVE, 16, 5, probe_count, &done);
+	server_probe_start(probe, servers);
+
+	g_assert(done == 1);
+	for (i = 0; i < servers->len; i++) {
+		Server * server = SERVER(g_ptr_array_index(servers, i));
+		g_assert(g_strcmp0(server->addresses[0], "127.0.0.1") == 0);
+	}
+
+	server_probe_free(probe);
+	g_ptr_array_unref(servers);
+
+	return;
+}
+
+static void
+test_server_resolve (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	GPtrArray * servers = g_ptr_array_new_with_free_func(g_object_unref);
+	g_ptr_array_add(servers, probe_rdp_server(3389));
+
+	Server * server = SERVER(g_ptr_array_index(servers, 0));
+	server->uri = g_intern_static_string("localhost:3389");
+	g_assert(server->addresses == NULL);
+
+	/* only looked up, so the state stays as it was */
+	GMainLoop * loop = g_main_loop_new(NULL, FALSE);
+	ServerProbe * probe = server_probe_new(SERVER_PROBE_RESOLVE, 1, 5, probe_done, loop);
+	server_probe_start(probe, servers);
+	g_main_loop_run(loop);
+
+	g_assert(server->state == SERVER_STATE_ALLGOOD);
+	g_assert(server->latency == -1);
+	g_assert(server->addresses != NULL);
+	g_assert(server->addresses[0] != NULL);
+
+	/* the same addresses again don't change anything */
+	g_assert(!server_set_addresses(server, (const gchar * const *)server->addresses));
+
+	/* and they're passed on as a property */
+	GVariant * variant = server_get_variant(server);
+	GVariant * props = g_variant_get_child_value(variant, 4);
+	GVariant * last = g_variant_get_child_value(props, g_variant_n_children(props) - 1);
+	const gchar * name = NULL;
+	GVariant * value = NULL;
+	g_variant_get_child(last, 0, "&s", &name);
+	g_variant_get_child(last, 2, "v", &value);
+	g_assert(g_strcmp0(name, "addresses") == 0);
+	g_assert(g_variant_is_of_type(value, G_VARIANT_TYPE_STRING_ARRAY));
+	g_variant_unref(value);
+	g_variant_unref(last);
+	g_variant_unref(props);
+	g_variant_unref(variant);
+
+	g_assert(server_set_addresses(server, NULL));
+	g_assert(server->addresses == NULL);
+
+	server_probe_free(probe);
+	server_probe_forget();
+	g_main_loop_unref(loop);
+	g_ptr_array_unref(servers);
+
+	return;
+}
+
+static void
+test_server_score (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	Server * server = json_rdp_server("DOMAIN1");
+	GVariant * first = server_get_variant(server);
+
+	/* not ranked is the default */
+	g_assert(server->score == -1);
+	g_assert(!server_set_score(server, -1));
+
+	g_assert(server_set_score(server, 75));
+	g_assert(!server_set_score(server, 75));
+	g_assert(server_set_score(server, 250));
+	g_assert(server->score == 100);
+
+	/* ends up as the last property */
+	GVariant * second = server_get_variant(server);
+	g_assert(first != second);
+
+	GVariant * props = g_variant_get_child_value(second, 4);
+	GVariant * last = g_variant_get_child_value(props, g_variant_n_children(props) - 1);
+	const gchar * name = NULL;
+	GVariant * value = NULL;
+	g_variant_get_child(last, 0, "&s", &name);
+	g_variant_get_child(last, 2, "v", &value);
+	g_assert(g_strcmp0(name, "score") == 0);
+	g_assert(g_variant_get_int32(value) == 100);
+
+	g_variant_unref(value);
+	g_variant_unref(last);
+	g_variant_unref(props);
+	g_variant_unref(second);
+	g_variant_unref(first);
+	g_object_unref(server);
+
+	return;
+}
+
 typedef struct _type_data_t type_data_t;
 struct _type_data_t {
 	GType type;
@@ -146,6 +798,151 @@ fatal_func (const gchar * log_domain, GLogLevelFlags level, const gchar * messag
 	return FALSE;
 }
 
+static void
+unlock_done (UccsServer * server, gboolean unlocked, gboolean cached, const GError * error, gpointer user_data)
+{
+	g_assert(unlocked);
+	g_main_loop_quit((GMainLoop *)user_data);
+	return;
+}
+
+/* Where the service keeps the files of @username, the server list of
+   @uri or the last used file */
+static gchar *
+cache_path (const gchar * username, const gchar * uri)
+{
+	gchar * username_sha = g_compute_checksum_for_string(G_CHECKSUM_SHA256, username, -1);
+	gchar * filename = NULL;
+
+	if (uri != NULL) {
+		gchar * uri_sha = g_compute_checksum_for_string(G_CHECKSUM_SHA256, uri, -1);
+		filename = g_strdup_printf("%s-%s.json", username_sha, uri_sha);
+		g_free(uri_sha);
+	} else {
+		filename = g_strdup(username_sha);
+	}
+
+	gchar * path = g_build_filename(g_get_user_cache_dir(), "remote-logon-service", "cache", filename, NULL);
+
+	g_free(filename);
+	g_free(username_sha);
+
+	return path;
+}
+
+static void
+test_uccs_rank (void)
+{
+	g_test_log_set_fatal_handler(no_fatal_warnings, NULL);
+
+	/* The broker hands out a server for each of these */
+	gchar * hosts = NULL;
+	gint fd = g_file_open_tmp("rank-hosts-XXXXXX", &hosts, NULL);
+	g_assert(fd >= 0);
+	g_close(fd, NULL);
+	g_assert(g_file_set_contents(hosts, "127.0.0.1:1 127.0.0.2:1 127.0.0.3:1 127.0.0.4:1", -1, NULL));
+	gchar * username = g_strdup_printf("l:%s", hosts);
+
+	/* How things went with them before, encrypted like the service
+	   does it */
+	GKeyFile * history = g_key_file_new();
+	g_key_file_set_string(history, "SLMock", "last_used", "Listed 3");
+	g_key_file_set_double(history, "SLMock health", "Listed 1", 0.4);
+	g_key_file_set_double(history, "SLMock health", "Listed 4", 0.7);
+
+	gchar * data = g_key_file_to_data(history, NULL, NULL);
+	size_t length = 0;
+	gchar * encrypted = do_aes_encrypt(data, username, &length);
+	gchar * last_used = cache_path(username, NULL);
+	gchar * dir = g_path_get_dirname(last_used);
+	g_assert(g_mkdir_with_parents(dir, 0700) == 0);
+	g_assert(g_file_set_contents(last_used, encrypted, length, NULL));
+	g_free(dir);
+	g_free(encrypted);
+	g_free(data);
+	g_key_file_free(history);
+
+	GKeyFile * keyfile = g_key_file_new();
+	const gchar * groupname = CONFIG_SERVER_PREFIX " SLMock";
+	g_key_file_set_string(keyfile, groupname, CONFIG_SERVER_NAME, "SLMock");
+	g_key_file_set_string(keyfile, groupname, CONFIG_SERVER_URI, "https://slmock.com/");
+	g_key_file_set_string(keyfile, groupname, CONFIG_UCCS_EXEC, SLMOCK);
+	g_key_file_set_string(keyfile, groupname, CONFIG_UCCS_NETWORK, CONFIG_UCCS_NETWORK_NONE);
+	g_key_file_set_boolean(keyfile, groupname, CONFIG_UCCS_VERIFY, FALSE);
+	g_key_file_set_boolean(keyfile, groupname, CONFIG_UCCS_RANK, TRUE);
+
+	Server * server = server_new_from_keyfile(keyfile, groupname);
+	g_assert(server != NULL);
+	UccsServer * userver = UCCS_SERVER(server);
+
+	GMainLoop * loop = g_main_loop_new(NULL, FALSE);
+	uccs_server_unlock(userver, ":1.42", username, username, FALSE, unlock_done, loop);
+	g_main_loop_run(loop);
+	g_main_loop_unref(loop);
+
+	/* Latencies as a probe would have found them */
+	gint latencies[] = { 0, 100, 100, 0 };
+	guint i;
+	for (i = 0; i < G_N_ELEMENTS(latencies); i++) {
+		gchar * uri = g_strdup_printf("127.0.0.%d:1", i + 1);
+		Server * subserver = server_find_uri(server, uri);
+		g_assert(subserver != NULL);
+		server_set_latency(subserver, latencies[i]);
+		g_free(uri);
+	}
+
+	/* Listed 1: 20 health + 30 latency = 50
+	   Listed 2: 50 health + 15 latency = 65
+	   Listed 3: 50 health + 15 latency + 20 last used = 85
+	   Listed 4: 35 health + 30 latency = 65, after Listed 2 like the
+	             broker had them */
+	const gchar * expected[] = { "Listed 3", "Listed 2", "Listed 4", "Listed 1" };
+	gint scores[] = { 85, 65, 65, 50 };
+
+	GVariant * array = uccs_server_get_servers(userver, ":1.42");
+	g_assert_cmpuint(g_variant_n_children(array), ==, G_N_ELEMENTS(expected));
+
+	for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+		GVariant * child = g_variant_get_child_value(array, i);
+		const gchar * name = NULL;
+		gboolean used = FALSE;
+		g_variant_get_child(child, 1, "&s", &name);
+		g_variant_get_child(child, 3, "b", &used);
+		g_assert_cmpstr(name, ==, expected[i]);
+		g_assert(used == (i == 0));
+
+		GVariant * props = g_variant_get_child_value(child, 4);
+		GVariant * last = g_variant_get_child_value(props, g_variant_n_children(props) - 1);
+		GVariant * value = NULL;
+		g_variant_get_child(last, 0, "&s", &name);
+		g_variant_get_child(last, 2, "v", &value);
+		g_assert_cmpstr(name, ==, "score");
+		g_assert_cmpint(g_variant_get_int32(value), ==, scores[i]);
+
+		g_variant_unref(value);
+		g_variant_unref(last);
+		g_variant_unref(props);
+		g_variant_unref(child);
+	}
+
+	g_variant_unref(array);
+
+	uccs_server_flush(userver);
+	g_object_unref(server);
+	g_key_file_unref(keyfile);
+
+	gchar * list = cache_path(username, "https://slmock.com/");
+	g_unlink(list);
+	g_unlink(last_used);
+	g_unlink(hosts);
+	g_free(list);
+	g_free(last_used);
+	g_free(username);
+	g_free(hosts);
+
+	return;
+}
+
 static void
 test_object_variant (gconstpointer data)
 {
@@ -158,8 +955,8 @@ test_object_variant (gconstpointer data)
 	g_assert(server != NULL);
 	g_assert(IS_SERVER(server));
 
-	server->name = g_strdup("My Name");
-	server->uri = g_strdup("http://mysite.loves.testing.com");
+	server->name = g_intern_static_string("My Name");
+	server->uri = g_intern_static_string("http://mysite.loves.testing.com");
 
 	GVariant * variant = server_get_variant(server);
 
@@ -180,7 +977,6 @@ test_object_variant (gconstpointer data)
 	g_assert(g_strcmp0(g_variant_get_string(child, NULL), "http://mysite.loves.testing.com") == 0);
 	g_variant_unref(child);
 
-	g_variant_ref_sink(variant);
 	g_variant_unref(variant);
 	g_object_unref(G_OBJECT(server));
 
@@ -263,9 +1059,21 @@ test_objects_suite (void)
 	g_test_add_data_func ("/server/object/variant/rdp",     &(type_data[1]), test_object_variant);
 	g_test_add_data_func ("/server/object/variant/uccs",    &(type_data[2]), test_object_variant);
 
+	g_test_add_func ("/server/object/variant/memo",  test_variant_memo);
+	g_test_add_func ("/server/object/json/protocol", test_json_protocol);
+	g_test_add_func ("/server/object/update",        test_server_update);
+	g_test_add_func ("/server/object/table",         test_server_table);
+	g_test_add_func ("/server/object/probe",         test_server_probe);
+	g_test_add_func ("/server/object/probe-many",    test_server_probe_many);
+	g_test_add_func ("/server/object/resolve",       test_server_resolve);
+	g_test_add_func ("/server/object/score",         test_server_score);
+	g_test_add_func ("/server/object/notify",        test_server_notify);
+
 	g_test_add_func ("/server/uccs/exec",     test_uccs_exec);
 	g_test_add_func ("/server/uccs/domains",  test_uccs_domains);
 	g_test_add_func ("/server/uccs/signal",   test_update_signal);
+	g_test_add_func ("/server/uccs/rank",     test_uccs_rank);
+	g_test_add_func ("/server/uccs/backoff",  test_uccs_probe_delay);
 
 	return;
 }